@@ -0,0 +1,355 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Breakpoint conditions (see 6502-condition.h). A recursive descent parser
+// compiles the text into postfix bytecode, with this grammar, from the
+// lowest precedence up:
+//
+//   or         := and (("or" | "||") and)*
+//   and        := not (("and" | "&&") not)*
+//   not        := ("not" | "!") not | comparison
+//   comparison := value [("==" | "=" | "!=" | "<" | "<=" | ">" | ">=") value]
+//   value      := "(" or ")" | "mem" "[" or "]" | register | flag | number
+//
+// eval_condition runs the code on a small stack of values. Registers,
+// flags and numbers push a value, mem replaces an address on top with the
+// byte there, and the operators replace the top one or two values with
+// their result. Both sides of "and" and "or" are always evaluated, so the
+// loop has no jumps. The parser tracks the stack depth, so a condition
+// that could overflow the stack is rejected when it is compiled rather
+// than checked for on every hit.
+//
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "6502-condition.h"
+#include "6502-core.h"
+
+// The stack machine's instructions. Each pushes a value, or replaces the
+// values on top of the stack with a result.
+enum condition_op {
+    OP_PUSH,    // Followed by a 16-bit value, low byte first
+    OP_A,
+    OP_X,
+    OP_Y,
+    OP_S,
+    OP_PC,
+    OP_FLAG,    // Followed by the flag's bit in the status register
+    OP_MEM,     // Replaces an address with the byte there
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_AND,
+    OP_OR,
+    OP_NOT
+};
+
+#define MAX_STACK 16
+
+static const struct {
+    const char *name;
+    enum condition_op op;
+} REGISTERS[] = {
+    {"a", OP_A},
+    {"x", OP_X},
+    {"y", OP_Y},
+    {"s", OP_S},
+    {"pc", OP_PC}
+};
+
+static const struct {
+    const char *name;
+    int flag;
+} FLAGS[] = {
+    {"c", FLAG_C},
+    {"z", FLAG_Z},
+    {"i", FLAG_I},
+    {"d", FLAG_D},
+    {"b", FLAG_B},
+    {"v", FLAG_V},
+    {"n", FLAG_N}
+};
+
+// Longer operators first, so "<=" isn't taken as "<"
+static const struct {
+    const char *token;
+    enum condition_op op;
+} COMPARISONS[] = {
+    {"==", OP_EQ},
+    {"!=", OP_NE},
+    {"<=", OP_LE},
+    {">=", OP_GE},
+    {"<", OP_LT},
+    {">", OP_GT},
+    {"=", OP_EQ}
+};
+
+#define COUNT(array) ((int) (sizeof(array) / sizeof(array[0])))
+
+struct parser {
+    const char *next;
+    struct condition *condition;
+    int depth;          // Values on the stack after the code so far
+    const char *error;  // The first problem found, or NULL
+};
+
+static void fail(struct parser *parser, const char *error) {
+    if (parser->error == NULL) {
+        parser->error = error;
+    }
+}
+
+static void emit(struct parser *parser, uint8_t byte) {
+    struct condition *condition = parser->condition;
+    if (condition->length == MAX_CONDITION_CODE) {
+        fail(parser, "Condition is too long");
+        return;
+    }
+
+    condition->code[condition->length++] = byte;
+}
+
+static void adjust_depth(struct parser *parser, int change) {
+    parser->depth += change;
+    if (parser->depth > MAX_STACK) {
+        fail(parser, "Condition is too complex");
+    }
+}
+
+// Consume token if it is next. Names must be followed by something other
+// than a letter or digit, so "pc" isn't taken as a register in "pcx".
+static int match(struct parser *parser, const char *token) {
+    while (isspace((unsigned char) *parser->next)) {
+        parser->next++;
+    }
+
+    size_t length = strlen(token);
+    if (strncasecmp(parser->next, token, length) != 0) {
+        return 0;
+    }
+
+    if (isalpha((unsigned char) token[0])
+            && isalnum((unsigned char) parser->next[length])) {
+        return 0;
+    }
+
+    parser->next += length;
+    return 1;
+}
+
+static void parse_or(struct parser *parser);
+
+static void parse_number(struct parser *parser) {
+    const char *start = parser->next;
+    char *end;
+    long value;
+    if (*start == '$') {
+        start++;
+        value = strtol(start, &end, 16);
+    } else {
+        value = strtol(start, &end, 10);
+    }
+
+    if (end == start || !isxdigit((unsigned char) *start)) {
+        fail(parser, "Expected a register, flag, mem[address], or number");
+        return;
+    }
+
+    if (value > 0xffff) {
+        fail(parser, "Number is out of range");
+        return;
+    }
+
+    parser->next = end;
+    emit(parser, OP_PUSH);
+    emit(parser, value & 0xff);
+    emit(parser, value >> 8);
+    adjust_depth(parser, 1);
+}
+
+static void parse_value(struct parser *parser) {
+    if (match(parser, "(")) {
+        parse_or(parser);
+        if (!match(parser, ")")) {
+            fail(parser, "Missing )");
+        }
+
+        return;
+    }
+
+    if (match(parser, "mem")) {
+        if (!match(parser, "[")) {
+            fail(parser, "Expected [ after mem");
+            return;
+        }
+
+        parse_or(parser);
+        if (!match(parser, "]")) {
+            fail(parser, "Missing ]");
+        }
+
+        emit(parser, OP_MEM);
+        return;
+    }
+
+    for (int i = 0; i < COUNT(REGISTERS); i++) {
+        if (match(parser, REGISTERS[i].name)) {
+            emit(parser, REGISTERS[i].op);
+            adjust_depth(parser, 1);
+            return;
+        }
+    }
+
+    for (int i = 0; i < COUNT(FLAGS); i++) {
+        if (match(parser, FLAGS[i].name)) {
+            emit(parser, OP_FLAG);
+            emit(parser, FLAGS[i].flag);
+            adjust_depth(parser, 1);
+            return;
+        }
+    }
+
+    parse_number(parser);
+}
+
+static void parse_comparison(struct parser *parser) {
+    parse_value(parser);
+    for (int i = 0; i < COUNT(COMPARISONS); i++) {
+        if (match(parser, COMPARISONS[i].token)) {
+            parse_value(parser);
+            emit(parser, COMPARISONS[i].op);
+            adjust_depth(parser, -1);
+            return;
+        }
+    }
+}
+
+// As in Python, not applies to a whole comparison.
+static void parse_not(struct parser *parser) {
+    if (match(parser, "not") || match(parser, "!")) {
+        parse_not(parser);
+        emit(parser, OP_NOT);
+    } else {
+        parse_comparison(parser);
+    }
+}
+
+static void parse_and(struct parser *parser) {
+    parse_not(parser);
+    while (match(parser, "and") || match(parser, "&&")) {
+        parse_not(parser);
+        emit(parser, OP_AND);
+        adjust_depth(parser, -1);
+    }
+}
+
+static void parse_or(struct parser *parser) {
+    parse_and(parser);
+    while (match(parser, "or") || match(parser, "||")) {
+        parse_and(parser);
+        emit(parser, OP_OR);
+        adjust_depth(parser, -1);
+    }
+}
+
+int compile_condition(struct condition *condition, const char *text,
+                      const char **error) {
+    struct parser parser;
+    parser.next = text;
+    parser.condition = condition;
+    parser.depth = 0;
+    parser.error = NULL;
+    condition->length = 0;
+    if (strlen(text) >= MAX_CONDITION_TEXT) {
+        fail(&parser, "Condition is too long");
+    } else {
+        strcpy(condition->text, text);
+        parse_or(&parser);
+        if (!match(&parser, "") || *parser.next != '\0') {
+            fail(&parser, "Unexpected text after the condition");
+        }
+    }
+
+    if (parser.error) {
+        condition->length = 0;
+        *error = parser.error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int eval_condition(struct m6502 *proc, const struct condition *condition) {
+    unsigned int stack[MAX_STACK];
+    int top = -1;
+    const uint8_t *code = condition->code;
+    const uint8_t *end = code + condition->length;
+    if (code == end) {
+        return 1;
+    }
+
+#define BINARY(op, operator) \
+    case op: \
+        top--; \
+        stack[top] = stack[top] operator stack[top + 1]; \
+        break;
+
+    while (code < end) {
+        switch (*code++) {
+            case OP_PUSH:
+                stack[++top] = code[0] | (code[1] << 8);
+                code += 2;
+                break;
+
+            case OP_A: stack[++top] = (uint8_t) proc->a; break;
+            case OP_X: stack[++top] = proc->x; break;
+            case OP_Y: stack[++top] = proc->y; break;
+            case OP_S: stack[++top] = proc->s & 0xff; break;
+            case OP_PC: stack[++top] = proc->pc; break;
+            case OP_FLAG: stack[++top] = get_flag(proc, *code++); break;
+
+            case OP_MEM: {
+                uint16_t addr = stack[top];
+                const struct page_mapping *mapping
+                    = &proc->pages[addr >> PAGE_SHIFT];
+                stack[top] = mapping->memory
+                    ? mapping->memory[addr % PAGE_SIZE] : 0;
+                break;
+            }
+
+            BINARY(OP_EQ, ==)
+            BINARY(OP_NE, !=)
+            BINARY(OP_LT, <)
+            BINARY(OP_LE, <=)
+            BINARY(OP_GT, >)
+            BINARY(OP_GE, >=)
+            BINARY(OP_AND, &&)
+            BINARY(OP_OR, ||)
+
+            case OP_NOT: stack[top] = !stack[top]; break;
+        }
+    }
+
+#undef BINARY
+
+    return stack[0] != 0;
+}
@@ -0,0 +1,51 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_CONDITION_H
+#define __6502_CONDITION_H
+
+#include <stdint.h>
+
+// Conditions for breakpoints, such as "x == $10 and mem[$20] > 5", over
+// the registers (a, x, y, s, pc), flags (c, z, i, d, b, v, n), and memory
+// (mem[address]). Numbers are decimal, or hex with a leading $. Values
+// can be compared with ==, !=, <, <=, >, and >=, and combined with and,
+// or, not, and parentheses. A value on its own is true if it isn't zero.
+//
+// A condition is parsed once into bytecode for a small stack machine, so
+// checking it each time its breakpoint is reached is a short loop over a
+// few bytes, without looking at the text again.
+#define MAX_CONDITION_CODE 64
+#define MAX_CONDITION_TEXT 128
+
+struct m6502;
+
+struct condition {
+    int length;     // Of code, 0 if there is no condition
+    uint8_t code[MAX_CONDITION_CODE];
+    char text[MAX_CONDITION_TEXT];  // As written, for listing
+};
+
+// Returns 0 on success, or -1 with a description of the problem in
+// error.
+int compile_condition(struct condition *condition, const char *text,
+                      const char **error);
+
+// Returns nonzero if the condition is true, or if there is none. Memory
+// is read without calling device handlers or checking watchpoints.
+int eval_condition(struct m6502 *proc, const struct condition *condition);
+
+#endif
@@ -0,0 +1,124 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Buffered console output device (see 6502-console.h).
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "6502-console.h"
+
+struct console *open_console(int fd, int flags) {
+    struct console *console = malloc(sizeof(struct console));
+    if (console == NULL) {
+        return NULL;
+    }
+
+    console->fd = fd;
+    console->flags = flags;
+    console->length = 0;
+    console->capacity = fd < 0 ? 0 : CONSOLE_BUFFER_SIZE;
+    console->buffer = NULL;
+    if (console->capacity) {
+        console->buffer = malloc(console->capacity);
+        if (console->buffer == NULL) {
+            free(console);
+            return NULL;
+        }
+    }
+
+    return console;
+}
+
+void close_console(struct console *console) {
+    if (console) {
+        flush_console(console);
+        free(console->buffer);
+        free(console);
+    }
+}
+
+int flush_console(struct console *console) {
+    if (console->fd < 0 || console->length == 0) {
+        return 0;
+    }
+
+    // Anything the host printed with stdio comes first
+    if (console->fd == STDOUT_FILENO) {
+        fflush(stdout);
+    }
+
+    const char *ptr = console->buffer;
+    size_t length = console->length;
+    console->length = 0;
+    while (length > 0) {
+        ssize_t written = write(console->fd, ptr, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        ptr += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+int console_put(struct console *console, uint8_t value) {
+    if (console->length == console->capacity) {
+        if (console->fd >= 0) {
+            if (flush_console(console) < 0) {
+                return -1;
+            }
+        } else {
+            size_t capacity = console->capacity ? console->capacity * 2
+                : CONSOLE_BUFFER_SIZE;
+            char *buffer = realloc(console->buffer, capacity);
+            if (buffer == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            console->buffer = buffer;
+            console->capacity = capacity;
+        }
+    }
+
+    console->buffer[console->length++] = value;
+    if (value == '\n' && (console->flags & CONSOLE_FLUSH_NEWLINE)) {
+        return flush_console(console);
+    }
+
+    return 0;
+}
+
+const char *console_output(const struct console *console, size_t *length) {
+    *length = console->fd < 0 ? console->length : 0;
+    return console->buffer;
+}
+
+void clear_console_output(struct console *console) {
+    if (console->fd < 0) {
+        console->length = 0;
+    }
+}
@@ -0,0 +1,61 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_CONSOLE_H
+#define __6502_CONSOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Output written to CONSOLE_OUT is collected here and written out with
+// one system call per batch, rather than one per character. A buffer is
+// written when it fills, at a newline if CONSOLE_FLUSH_NEWLINE is set,
+// and when run_instructions stops for any reason other than running out
+// of budget, so nothing is left waiting once the emulator stops. Callers
+// that run in slices don't pay for a write per slice; they can call
+// flush_console themselves.
+#define CONSOLE_BUFFER_SIZE 4096
+
+// Flags for open_console
+#define CONSOLE_FLUSH_NEWLINE 1
+
+struct console {
+    int fd;         // -1 to keep the output in memory instead
+    int flags;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+};
+
+// Open a console writing to fd, or if fd is -1, collecting everything
+// written to it in memory (see console_output). Returns NULL if out of
+// memory.
+struct console *open_console(int fd, int flags);
+
+// Flush and free the console.
+void close_console(struct console *console);
+
+// Returns 0 on success, or -1 with errno set if the output couldn't be
+// written, in which case it is discarded.
+int console_put(struct console *console, uint8_t value);
+int flush_console(struct console *console);
+
+// Everything written to a console opened with fd -1, since it was opened
+// or console_output was last cleared. This isn't NUL terminated.
+const char *console_output(const struct console *console, size_t *length);
+void clear_console_output(struct console *console);
+
+#endif
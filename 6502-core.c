@@ -14,437 +14,1508 @@
 // limitations under the License.
 //
 
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "6502-console.h"
 #include "6502-core.h"
-#include "instructions.h"
+#include "6502-profile.h"
+#include "6502-trace.h"
+#ifdef ENABLE_JIT
+#include "6502-jit.h"
+#endif
 
-uint8_t read_mem_u8(struct m6502 *proc, uint16_t addr) {
-    return proc->memory[addr];
+// Longest instruction, including page crossing and branch penalties
+#define MAX_INST_CYCLES 7
+
+//
+// Decoded instruction cache. Each entry holds everything needed to execute
+// the instruction at that address without refetching it from memory. The
+// next PC isn't stored here: the handler adds its (constant) length, which
+// keeps the cache lookup off the PC's dependency chain.
+//
+// An entry is only valid if its generation matches the processor's, so the
+// whole cache can be flushed by bumping the generation.
+//
+// The cache is split into pages, which are only allocated once code runs
+// from them, so a processor only pays for the code it executes. Until
+// then a page points at EMPTY_DECODE_PAGE, whose entries never match a
+// generation (they start at 1), so the lookup needs no NULL check.
+//
+struct decoded_inst {
+    int (*func)(struct m6502 *proc, uint16_t operand);
+    uint16_t operand;
+    uint8_t opcode;
+    uint8_t length;
+    uint32_t generation;
+};
+
+static struct decoded_inst EMPTY_DECODE_PAGE[PAGE_SIZE];
+
+static inline struct decoded_inst *get_decoded(struct m6502 *proc,
+                                               uint16_t addr) {
+    return &proc->decode_cache[addr >> PAGE_SHIFT][addr % PAGE_SIZE];
 }
 
-void write_mem_u8(struct m6502 *proc, uint16_t addr, uint8_t val) {
-    if (addr == 0xfffa) {
-        printf("%c", val);
+static int is_code_page(struct m6502 *proc, int page) {
+    return (proc->code_pages[page >> 5] >> (page & 31)) & 1;
+}
+
+// Pages not written since clear_dirty_pages are kept out of write_map so
+// the first write can mark them.
+static int is_clean_page(struct m6502 *proc, int page) {
+    return proc->track_dirty
+        && !((proc->dirty_pages[page >> 5] >> (page & 31)) & 1);
+}
+
+static int is_watched_page(const uint32_t *watch_pages, int page) {
+    return (watch_pages[page >> 5] >> (page & 31)) & 1;
+}
+
+static void update_page_map(struct m6502 *proc, int page) {
+    const struct page_mapping *mapping = &proc->pages[page];
+    proc->read_map[page] = mapping->read
+        || is_watched_page(proc->read_watch_pages, page)
+        ? NULL : mapping->memory;
+    if (mapping->write
+            || (mapping->flags & (MAP_READ_ONLY | MAP_COPY_ON_WRITE))
+            || is_watched_page(proc->write_watch_pages, page)) {
+        proc->ram_map[page] = NULL;
     } else {
-        proc->memory[addr] = val;
+        proc->ram_map[page] = mapping->memory;
     }
+
+    proc->write_map[page] = is_code_page(proc, page)
+        || is_clean_page(proc, page) ? NULL : proc->ram_map[page];
 }
 
-uint16_t read_mem_u16(struct m6502 *proc, uint16_t addr) {
-    return proc->memory[addr] | (proc->memory[addr + 1] << 8);
+static void mark_dirty(struct m6502 *proc, int page) {
+    if (is_clean_page(proc, page)) {
+        proc->dirty_pages[page >> 5] |= 1u << (page & 31);
+        update_page_map(proc, page);
+    }
 }
 
-uint16_t get_operand_addr(struct m6502 *proc, enum address_mode mode) {
-    switch (mode) {
-        case IND_ZERO_PAGE_X: { // ($hh, X)
-            unsigned short addr = read_mem_u8(proc, proc->pc++) + proc->x;
-            return read_mem_u16(proc, addr);
-        }
+// Start tracking which pages are written, or start over. Afterwards,
+// dirty_pages has a bit set for each page written since. Only the first
+// write to each page takes the slow path.
+void clear_dirty_pages(struct m6502 *proc) {
+    proc->track_dirty = 1;
+    memset(proc->dirty_pages, 0, sizeof(proc->dirty_pages));
+    for (int page = 0; page < NUM_PAGES; page++) {
+        update_page_map(proc, page);
+    }
+}
+
+//
+// Memory shared between processors by fork_proc. Any processor using it
+// may read it, but it is only written once a single processor is left
+// using it. The others make their own copy first. Processors may be on
+// different threads, so the count is updated atomically.
+//
+struct shared_page {
+    int refcount;
+    uint8_t data[PAGE_SIZE];
+};
+
+static void release_page(struct shared_page *shared) {
+    if (__atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(shared);
+    }
+}
+
+// Called before the first write to a page marked MAP_COPY_ON_WRITE. The
+// bytes don't change, so cached code for it is still valid, and translated
+// code looks up the page table on every access.
+static void copy_shared_page(struct m6502 *proc, int page) {
+    struct page_mapping *mapping = &proc->pages[page];
+    struct shared_page *shared = mapping->shared;
+    if (__atomic_load_n(&shared->refcount, __ATOMIC_ACQUIRE) > 1) {
+        struct shared_page *copy = malloc(sizeof(struct shared_page));
+        copy->refcount = 1;
+        memcpy(copy->data, shared->data, PAGE_SIZE);
+        release_page(shared);
+        mapping->shared = copy;
+        mapping->memory = copy->data;
+    }
 
-        case ZERO_PAGE: // $hh
-            return read_mem_u8(proc, proc->pc++);
+    mapping->flags &= ~MAP_COPY_ON_WRITE;
+    update_page_map(proc, page);
+}
+
+void mark_code_page(struct m6502 *proc, int page) {
+    proc->code_pages[page >> 5] |= 1u << (page & 31);
+    proc->write_map[page] = NULL;
+}
+
+// Programs commonly keep variables in the same page as their code, so
+// rather than dropping the whole page, only clear the entries for
+// instructions that include this byte. Instructions are at most three
+// bytes long. Variables often directly follow a subroutine's RTS, so it
+// matters not to drop instructions that end before it.
+// Entries in EMPTY_DECODE_PAGE have a length of 0, so they are never
+// written here.
+static void invalidate_code(struct m6502 *proc, uint16_t addr) {
+    for (int offset = 0; offset < 3; offset++) {
+        struct decoded_inst *di = get_decoded(proc, addr - offset);
+        if (di->length > offset) {
+            di->generation = 0;
+        }
+    }
+}
 
-        case ABSOLUTE: { // $hhhh
-            unsigned short addr = read_mem_u16(proc, proc->pc);
-            proc->pc += 2;
-            return addr;
+static void free_decode_cache(struct m6502 *proc) {
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (proc->decode_cache[page] != EMPTY_DECODE_PAGE) {
+            free(proc->decode_cache[page]);
         }
+    }
+}
 
-        case IND_ZERO_PAGE_Y: // ($hh), y
-            return read_mem_u16(proc, read_mem_u8(proc, proc->pc++)) + proc->y;
+// Start with no pages allocated, as for a new processor.
+static void reset_decode_cache(struct m6502 *proc) {
+    for (int page = 0; page < NUM_PAGES; page++) {
+        proc->decode_cache[page] = EMPTY_DECODE_PAGE;
+    }
+
+    proc->decode_generation = 0;
+}
 
-        case ZERO_PAGE_X: // $hh, X
-            return read_mem_u8(proc, proc->pc++) + proc->x;
+void flush_decode_cache(struct m6502 *proc) {
+    if (++proc->decode_generation == 0) {
+        free_decode_cache(proc);
+        reset_decode_cache(proc);
+        proc->decode_generation = 1;
+    }
 
-        case ZERO_PAGE_Y: // $hh, Y
-            return read_mem_u8(proc, proc->pc++) + proc->y;
+    memset(proc->code_pages, 0, sizeof(proc->code_pages));
+    for (int page = 0; page < NUM_PAGES; page++) {
+        update_page_map(proc, page);
+    }
 
-        case ABSOLUTE_X: { // $hhhh, X
-            unsigned short addr = read_mem_u16(proc, proc->pc);
-            proc->pc += 2;
-            return addr + proc->x;
+#ifdef ENABLE_JIT
+    if (proc->jit) {
+        jit_flush(proc);
+    }
+#endif
+}
+
+// Map host memory at the given guest pages. memory may be NULL to leave
+// the pages unmapped. Devices attached to the pages with map_handlers stay
+// in front of the new memory.
+void map_memory(struct m6502 *proc, int first_page, int num_pages,
+                uint8_t *memory, int flags) {
+    for (int i = 0; i < num_pages; i++) {
+        struct page_mapping *mapping = &proc->pages[first_page + i];
+        if (mapping->shared) {
+            release_page(mapping->shared);
+            mapping->shared = NULL;
         }
 
-        case ABSOLUTE_Y: { // $hhhh, Y
-            unsigned short addr = read_mem_u16(proc, proc->pc);
-            proc->pc += 2;
-            return addr + proc->y;
+        mapping->memory = memory ? memory + i * PAGE_SIZE : NULL;
+        mapping->flags = flags & ~MAP_COPY_ON_WRITE;
+    }
+
+    flush_decode_cache(proc);
+}
+
+// Attach a device to the given pages. Either handler may be NULL, in
+// which case that kind of access goes to the page's memory directly.
+void map_handlers(struct m6502 *proc, int first_page, int num_pages,
+                  mem_read_handler read, mem_write_handler write,
+                  void *context) {
+    for (int i = 0; i < num_pages; i++) {
+        struct page_mapping *mapping = &proc->pages[first_page + i];
+        mapping->read = read;
+        mapping->write = write;
+        mapping->context = context;
+    }
+
+    flush_decode_cache(proc);
+}
+
+// Load an image file at load_addr. Read-only images (MAP_READ_ONLY in
+// flags) are mapped from the file rather than copied, so any number of
+// processors can share one copy of a ROM. They must start on a page
+// boundary, and the mapping is never released. Other images are copied
+// into whatever memory is mapped at those addresses. Anything past the
+// end of the address space is ignored.
+// Returns 0 on success, or -1 with errno set.
+int load_image(struct m6502 *proc, const char *filename, uint16_t load_addr,
+               int flags) {
+    int read_only = (flags & MAP_READ_ONLY) != 0;
+    if (read_only && load_addr % PAGE_SIZE != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    if (size > (size_t) (MEM_SIZE - load_addr)) {
+        size = MEM_SIZE - load_addr;
+    }
+
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    // The host page size is a multiple of PAGE_SIZE, and mmap fills the
+    // rest of the last host page with zeroes, so the partial guest page
+    // at the end of the file is safe to map.
+    uint8_t *image = mmap(NULL, size, PROT_READ,
+        read_only ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+
+    if (read_only) {
+        map_memory(proc, load_addr >> PAGE_SHIFT,
+            (size + PAGE_SIZE - 1) / PAGE_SIZE, image, flags);
+        return 0;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        uint16_t addr = load_addr + i;
+        const struct page_mapping *mapping = &proc->pages[addr >> PAGE_SHIFT];
+        if (mapping->memory && !(mapping->flags & MAP_READ_ONLY)) {
+            if (mapping->flags & MAP_COPY_ON_WRITE) {
+                copy_shared_page(proc, addr >> PAGE_SHIFT);
+            }
+
+            mark_dirty(proc, addr >> PAGE_SHIFT);
+            mapping->memory[addr % PAGE_SIZE] = image[i];
         }
+    }
 
-        case INDIRECT:
-        case IMPLIED:
-        default:
-            assert(0);
+    munmap(image, size);
+    flush_decode_cache(proc);
+    return 0;
+}
+
+//
+// Save state file layout. The header is followed by PAGE_SIZE bytes for
+// each page with a bit set in saved_pages, in address order. A full state
+// leaves out pages of RAM that are all zeroes, as well as ROM and unmapped
+// pages, which aren't part of the state. A delta state only has the pages
+// written since the state it follows, identified by parent_id, and is
+// restored on top of it. Fields are little endian, and the header has no
+// padding, so it can be read and written directly on the hosts this runs
+// on. Change STATE_VERSION whenever the layout changes.
+//
+#define STATE_MAGIC "6502"
+#define STATE_VERSION 2
+
+struct saved_state {
+    char magic[4];
+    uint32_t version;
+    uint64_t id;
+    uint64_t parent_id;     // 0 for a full state
+    uint64_t instructions;
+    uint64_t cycles;
+    uint16_t s;
+    uint16_t pc;
+    uint16_t nz_result;
+    uint16_t c_result;
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t v_result;
+    uint8_t p;
+    uint8_t reserved[3];
+    uint32_t saved_pages[NUM_PAGES / 32];
+};
+
+_Static_assert(sizeof(struct saved_state) == 88,
+    "save state header must not have padding");
+
+static int is_ram_page(const struct page_mapping *mapping) {
+    return mapping->memory && !(mapping->flags & MAP_READ_ONLY);
+}
+
+static int is_zero_page(const uint8_t *memory) {
+    for (int i = 0; i < PAGE_SIZE; i++) {
+        if (memory[i]) {
             return 0;
+        }
+    }
+
+    return 1;
+}
+
+// IDs only need to be different for every state that might be chained,
+// so mix the previous one with the counts and the time.
+static uint64_t new_checkpoint_id(struct m6502 *proc) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const uint64_t values[] = {
+        proc->checkpoint_id, proc->instructions, proc->cycles,
+        (uint64_t) now.tv_sec, (uint64_t) now.tv_nsec
+    };
+
+    uint64_t id = 0xcbf29ce484222325ull;    // FNV-1a
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        id = (id ^ values[i]) * 0x100000001b3ull;
+    }
+
+    return id ? id : 1;
+}
+
+static int write_state(struct m6502 *proc, const char *filename, int delta) {
+    if (delta && (!proc->track_dirty || proc->checkpoint_id == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct saved_state state;
+    struct iovec iov[1 + NUM_PAGES];
+    memset(&state, 0, sizeof(state));
+    memcpy(state.magic, STATE_MAGIC, sizeof(state.magic));
+    state.version = STATE_VERSION;
+    state.id = new_checkpoint_id(proc);
+    state.parent_id = delta ? proc->checkpoint_id : 0;
+    state.instructions = proc->instructions;
+    state.cycles = proc->cycles;
+    state.s = proc->s;
+    state.pc = proc->pc;
+    state.nz_result = proc->nz_result;
+    state.c_result = proc->c_result;
+    state.a = proc->a;
+    state.x = proc->x;
+    state.y = proc->y;
+    state.v_result = proc->v_result;
+    state.p = proc->p;
+
+    iov[0].iov_base = &state;
+    iov[0].iov_len = sizeof(state);
+    int num_iov = 1;
+    size_t total = sizeof(state);
+    for (int page = 0; page < NUM_PAGES; page++) {
+        const struct page_mapping *mapping = &proc->pages[page];
+        if (!is_ram_page(mapping)) {
+            continue;
+        }
+
+        if (delta ? is_clean_page(proc, page)
+                : is_zero_page(mapping->memory)) {
+            continue;
+        }
+
+        state.saved_pages[page >> 5] |= 1u << (page & 31);
+        iov[num_iov].iov_base = mapping->memory;
+        iov[num_iov++].iov_len = PAGE_SIZE;
+        total += PAGE_SIZE;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t written = writev(fd, iov, num_iov);
+    if (written >= 0 && (size_t) written != total) {
+        errno = EIO;
+        written = -1;
+    }
+
+    if (close(fd) < 0 || written < 0) {
+        return -1;
+    }
+
+    proc->checkpoint_id = state.id;
+    clear_dirty_pages(proc);
+    return 0;
+}
+
+// Write the registers, counters, and RAM to a file, with one system call.
+// Afterwards, pages that are written are tracked for save_delta.
+// Returns 0 on success, or -1 with errno set.
+int save_state(struct m6502 *proc, const char *filename) {
+    return write_state(proc, filename, 0);
+}
+
+// Like save_state, but only write the pages that changed since the last
+// state was saved or loaded. Restoring it needs that state, and any deltas
+// between, to be loaded first. Fails with EINVAL if there is no previous
+// state.
+int save_delta(struct m6502 *proc, const char *filename) {
+    return write_state(proc, filename, 1);
+}
+
+// Restore a file written by save_state or save_delta. For a full state,
+// RAM pages that weren't saved are cleared. The processor must have the
+// same memory map as the one that was saved, including any ROM. Returns 0
+// on success, or -1 with errno set: EINVAL if the file isn't a save state
+// of this version, or is a delta that doesn't follow the last state
+// loaded.
+int load_state(struct m6502 *proc, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(struct saved_state)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct saved_state *state = (const struct saved_state *) file;
+    size_t num_pages = 0;
+    for (int i = 0; i < NUM_PAGES / 32; i++) {
+        num_pages += __builtin_popcount(state->saved_pages[i]);
+    }
+
+    if (memcmp(state->magic, STATE_MAGIC, sizeof(state->magic)) != 0
+            || state->version != STATE_VERSION
+            || size != sizeof(struct saved_state) + num_pages * PAGE_SIZE
+            || (state->parent_id != 0
+            && state->parent_id != proc->checkpoint_id)) {
+        munmap((void *) file, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint8_t *page_data = file + sizeof(struct saved_state);
+    for (int page = 0; page < NUM_PAGES; page++) {
+        struct page_mapping *mapping = &proc->pages[page];
+        int saved = (state->saved_pages[page >> 5] >> (page & 31)) & 1;
+        if (is_ram_page(mapping) && (saved || state->parent_id == 0)) {
+            if (mapping->flags & MAP_COPY_ON_WRITE) {
+                copy_shared_page(proc, page);
+            }
+
+            if (saved) {
+                memcpy(mapping->memory, page_data, PAGE_SIZE);
+            } else {
+                memset(mapping->memory, 0, PAGE_SIZE);
+            }
+        }
+
+        if (saved) {
+            page_data += PAGE_SIZE;
+        }
+    }
+
+    proc->instructions = state->instructions;
+    proc->cycles = state->cycles;
+    proc->s = state->s;
+    proc->pc = state->pc;
+    proc->nz_result = state->nz_result;
+    proc->c_result = state->c_result;
+    proc->a = state->a;
+    proc->x = state->x;
+    proc->y = state->y;
+    proc->v_result = state->v_result;
+    proc->p = state->p;
+    proc->halt = STOP_NONE;
+    proc->checkpoint_id = state->id;
+    munmap((void *) file, size);
+    flush_decode_cache(proc);
+    clear_dirty_pages(proc);
+    return 0;
+}
+
+static int console_write(struct m6502 *proc, uint16_t addr, uint8_t val,
+                         void *context) {
+    if (addr != CONSOLE_OUT) {
+        return 0;
+    }
+
+    if (proc->exit_on_mmio) {
+        proc->mmio_addr = addr;
+        proc->mmio_value = val;
+        proc->halt = STOP_MMIO;
+    } else {
+        console_put(proc->console, val);
+    }
+
+    return 1;
+}
+
+// Read memory for the debugger, without calling device handlers.
+static uint8_t peek_mem_u8(struct m6502 *proc, uint16_t addr) {
+    const struct page_mapping *mapping = &proc->pages[addr >> PAGE_SHIFT];
+    return mapping->memory ? mapping->memory[addr % PAGE_SIZE] : 0;
+}
+
+// Only accesses to pages in read_watch_pages or write_watch_pages get
+// here, along with device pages, so the ranges aren't checked otherwise.
+static void check_watchpoints(struct m6502 *proc, uint16_t addr, int flags,
+                              uint8_t old_value, uint8_t new_value) {
+    for (int i = 0; i < proc->num_watchpoints; i++) {
+        const struct watchpoint *watch = &proc->watchpoints[i];
+        if ((watch->flags & flags) && addr >= watch->start
+                && addr <= watch->end) {
+            // The instruction's address is filled in by run_instrumented,
+            // as pc has already moved past it.
+            proc->watch_hit.addr = addr;
+            proc->watch_hit.flags = flags;
+            proc->watch_hit.old_value = old_value;
+            proc->watch_hit.new_value = new_value;
+            proc->halt = STOP_WATCHPOINT;
+            return;
+        }
+    }
+}
+
+// The slow paths are kept out of line so the fast paths don't need to set
+// up a stack frame. Instruction fetches pass watch as 0, as they shouldn't
+// trigger read watchpoints.
+static __attribute__((noinline)) uint8_t read_mem_slow(struct m6502 *proc,
+                                                       uint16_t addr,
+                                                       int watch) {
+    const struct page_mapping *mapping = &proc->pages[addr >> PAGE_SHIFT];
+    uint8_t value;
+    if (!mapping->read
+            || !mapping->read(proc, addr, &value, mapping->context)) {
+        value = mapping->memory ? mapping->memory[addr % PAGE_SIZE] : 0;
+    }
+
+    if (watch && proc->num_watchpoints) {
+        check_watchpoints(proc, addr, WATCH_READ, value, value);
+    }
+
+    return value;
+}
+
+// Writes to RAM that isn't in write_map: pages that hold cached code, and
+// pages not written since clear_dirty_pages.
+static void write_ram_page(struct m6502 *proc, uint16_t addr, uint8_t val,
+                           uint8_t *memory) {
+    int page = addr >> PAGE_SHIFT;
+    if (is_code_page(proc, page)) {
+        invalidate_code(proc, addr);
+#ifdef ENABLE_JIT
+        if (proc->jit) {
+            jit_invalidate(proc, addr);
+        }
+#endif
+    }
+
+    mark_dirty(proc, page);
+    memory[addr % PAGE_SIZE] = val;
+}
+
+static __attribute__((noinline)) void write_mem_slow(struct m6502 *proc,
+                                                     uint16_t addr,
+                                                     uint8_t val) {
+    int page = addr >> PAGE_SHIFT;
+    const struct page_mapping *mapping = &proc->pages[page];
+    if (proc->num_watchpoints) {
+        check_watchpoints(proc, addr, WATCH_WRITE, peek_mem_u8(proc, addr),
+            val);
+    }
+
+    if (mapping->write && mapping->write(proc, addr, val, mapping->context)) {
+        return;
+    }
+
+    if (mapping->memory == NULL || (mapping->flags & MAP_READ_ONLY)) {
+        return;
+    }
+
+    if (mapping->flags & MAP_COPY_ON_WRITE) {
+        copy_shared_page(proc, page);
+    }
+
+    write_ram_page(proc, addr, val, mapping->memory);
+}
+
+static inline uint8_t read_mem(struct m6502 *proc, uint16_t addr,
+                               int watch) {
+#ifdef ENABLE_PROFILE
+    // Instruction fetches (watch is 0) are only made when decoding, which
+    // the decode cache skips for most executions, so they aren't counted.
+    if (watch && proc->profile) {
+        proc->profile->page_reads[addr >> PAGE_SHIFT]++;
     }
+#endif
+
+    const uint8_t *memory = proc->read_map[addr >> PAGE_SHIFT];
+    if (memory) {
+        return memory[addr % PAGE_SIZE];
+    }
+
+    return read_mem_slow(proc, addr, watch);
+}
+
+uint8_t read_mem_u8(struct m6502 *proc, uint16_t addr) {
+    return read_mem(proc, addr, 1);
 }
 
-uint8_t get_operand_value(struct m6502 *proc, enum address_mode mode) {
-    if (mode == IMPLIED) {
-        return proc->a;
+void write_mem_u8(struct m6502 *proc, uint16_t addr, uint8_t val) {
+    int page = addr >> PAGE_SHIFT;
+#ifdef ENABLE_PROFILE
+    if (proc->profile) {
+        proc->profile->page_writes[page]++;
     }
+#endif
 
-    if (mode == IMMEDIATE) {
-        return read_mem_u8(proc, proc->pc++);
+    uint8_t *memory = proc->write_map[page];
+    if (memory) {
+        memory[addr % PAGE_SIZE] = val;
+    } else if (proc->ram_map[page]) {
+        write_ram_page(proc, addr, val, proc->ram_map[page]);
+    } else {
+        write_mem_slow(proc, addr, val);
     }
+}
+
+uint16_t read_mem_u16(struct m6502 *proc, uint16_t addr) {
+    return read_mem_u8(proc, addr) | (read_mem_u8(proc, addr + 1) << 8);
+}
 
-    return read_mem_u8(proc, get_operand_addr(proc, mode));
+//
+// Operand address calculation, one function per addressing mode. The
+// generated per-opcode handlers in instructions.h call these directly,
+// passing the operand bytes that followed the opcode.
+//
+uint16_t get_operand_addr_IND_ZERO_PAGE_X(struct m6502 *proc, uint16_t operand) { // ($hh, X)
+    unsigned short addr = operand + proc->x;
+    return read_mem_u16(proc, addr);
+}
+
+uint16_t get_operand_addr_ZERO_PAGE(struct m6502 *proc, uint16_t operand) { // $hh
+    return operand;
+}
+
+uint16_t get_operand_addr_ABSOLUTE(struct m6502 *proc, uint16_t operand) { // $hhhh
+    return operand;
+}
+
+uint16_t get_operand_addr_IND_ZERO_PAGE_Y(struct m6502 *proc, uint16_t operand) { // ($hh), y
+    return read_mem_u16(proc, operand) + proc->y;
+}
+
+uint16_t get_operand_addr_ZERO_PAGE_X(struct m6502 *proc, uint16_t operand) { // $hh, X
+    return operand + proc->x;
+}
+
+uint16_t get_operand_addr_ZERO_PAGE_Y(struct m6502 *proc, uint16_t operand) { // $hh, Y
+    return operand + proc->y;
+}
+
+uint16_t get_operand_addr_ABSOLUTE_X(struct m6502 *proc, uint16_t operand) { // $hhhh, X
+    return operand + proc->x;
+}
+
+uint16_t get_operand_addr_ABSOLUTE_Y(struct m6502 *proc, uint16_t operand) { // $hhhh, Y
+    return operand + proc->y;
+}
+
+uint16_t get_operand_addr_INDIRECT(struct m6502 *proc, uint16_t operand) { // ($hhhh)
+    return read_mem_u16(proc, operand);
 }
 
 void set_nz_flags(struct m6502 *proc, uint8_t value) {
-    proc->n = (value >> 7) & 1;
-    proc->z = (value & 0xff) == 0;
+    proc->nz_result = value;
 }
 
-void inst_INVALID(struct m6502 *proc, enum address_mode mode) {
-    proc->halt = 1;
+void inst_INVALID(struct m6502 *proc) {
+    proc->halt = STOP_INVALID;
 }
 
-void inst_BRK(struct m6502 *proc, enum address_mode mode) {
-    proc->halt = 1;
+void inst_BRK(struct m6502 *proc) {
+    proc->halt = STOP_BRK;
 }
 
-void inst_NOP(struct m6502 *proc, enum address_mode mode) {
+void inst_NOP(struct m6502 *proc) {
 }
 
 //
 // Arithmetic
+// The read-modify-write instructions (shifts, INC, DEC) take the old value
+// and return the new one. The generated handler stores it back to the
+// accumulator or memory.
 //
-#define UNARY_OP(__op__) \
-   if (mode == IMPLIED) { \
-        uint8_t old_val = proc->a; \
-        uint8_t new_val = __op__; \
-        proc->a = new_val; \
-        set_nz_flags(proc, new_val); \
-    } else { \
-        uint16_t addr = get_operand_addr(proc, mode); \
-        uint8_t old_val = read_mem_u8(proc, addr); \
-        uint8_t new_val = __op__; \
-        set_nz_flags(proc, new_val); \
-        write_mem_u8(proc, addr, new_val); \
-    }
-
-void inst_LSR(struct m6502 *proc, enum address_mode mode) {
-    UNARY_OP((old_val >> 1); proc->c = old_val & 1);
+uint8_t inst_LSR(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = old_val >> 1;
+    proc->c_result = (old_val & 1) << 8;
+    set_nz_flags(proc, new_val);
+    return new_val;
 }
 
-void inst_ASL(struct m6502 *proc, enum address_mode mode) {
-    UNARY_OP((old_val << 1); proc->c = (old_val >> 7) & 1);
+uint8_t inst_ASL(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = old_val << 1;
+    proc->c_result = old_val << 1;
+    set_nz_flags(proc, new_val);
+    return new_val;
 }
 
-void inst_ROL(struct m6502 *proc, enum address_mode mode) {
-    UNARY_OP((old_val << 1) | proc->c; proc->c = (old_val >> 7) & 1);
+uint8_t inst_ROL(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = (old_val << 1) | get_flag(proc, FLAG_C);
+    proc->c_result = old_val << 1;
+    set_nz_flags(proc, new_val);
+    return new_val;
 }
 
-void inst_ROR(struct m6502 *proc, enum address_mode mode) {
-    UNARY_OP((old_val >> 1) | (proc->c << 7); proc->c = old_val & 1);
+uint8_t inst_ROR(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = (old_val >> 1) | (get_flag(proc, FLAG_C) << 7);
+    proc->c_result = (old_val & 1) << 8;
+    set_nz_flags(proc, new_val);
+    return new_val;
 }
 
-void inst_EOR(struct m6502 *proc, enum address_mode mode) {
-    proc->a ^= get_operand_value(proc, mode);
+void inst_EOR(struct m6502 *proc, uint8_t value) {
+    proc->a ^= value;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_ORA(struct m6502 *proc, enum address_mode mode) {
-    proc->a |= get_operand_value(proc, mode);
+void inst_ORA(struct m6502 *proc, uint8_t value) {
+    proc->a |= value;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_AND(struct m6502 *proc, enum address_mode mode) {
-    proc->a &= get_operand_value(proc, mode);
+void inst_AND(struct m6502 *proc, uint8_t value) {
+    proc->a &= value;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_BIT(struct m6502 *proc, enum address_mode mode) {
-    uint8_t m = get_operand_value(proc, mode);
-    proc->n = (m >> 7) & 1;
-    proc->v = (m >> 6) & 1;
-    proc->z = (m & proc->a) == 0;
+void inst_BIT(struct m6502 *proc, uint8_t m) {
+    // N comes from the operand rather than the result, so it goes in the
+    // high byte.
+    proc->nz_result = (uint8_t) (m & proc->a) | ((m & 0x80) << 8);
+    proc->v_result = m << 1;
 }
 
 uint8_t add(struct m6502 *proc, uint8_t op1, uint8_t op2) {
-    uint16_t uresult = op1 + op2 + proc->c;
-    set_nz_flags(proc, uresult);
+    uint16_t uresult = op1 + op2 + get_flag(proc, FLAG_C);
+
+    // Bit 8 is clear in the low byte, so this doesn't affect N.
+    proc->nz_result = uresult;
 
     // Carry occurs when an unsigned value does not fit in the
-    // register. e.g. 208 + 144 = 352
-    proc->c = (uresult >> 8) & 1;
+    // register. e.g. 208 + 144 = 352. It ends up in bit 8 of the result.
+    proc->c_result = uresult;
 
     // Overflow indicates a signed arithmetic operation has wrapped
     // around, inverting the sign. It can only occur when the signs
     // of the two operands are the same and the result has a different
     // sign. e.g. in 8 bit Two's complement:
     // -48 + -112 = 96 and 80 + 80 = -96.
-    int sign1 = op1 >> 7;
-    int sign2 = op2 >> 7;
-    int result_sign = (uresult >> 7) & 1;
-    proc->v = sign1 == sign2 && sign1 != result_sign;
+    // Bit 7 of this is set when both operands differ in sign from the
+    // result.
+    proc->v_result = (op1 ^ uresult) & (op2 ^ uresult);
 
     return uresult & 0xff;
 }
 
-void inst_CMP(struct m6502 *proc, enum address_mode mode) {
-    proc->c = 1;
-    add(proc, proc->a, get_operand_value(proc, mode) ^ 0xff);
+void inst_CMP(struct m6502 *proc, uint8_t value) {
+    proc->c_result = 0x100;
+    add(proc, proc->a, value ^ 0xff);
 }
 
-void inst_CPX(struct m6502 *proc, enum address_mode mode) {
-    proc->c = 1;
-    add(proc, proc->x, get_operand_value(proc, mode) ^ 0xff);
+void inst_CPX(struct m6502 *proc, uint8_t value) {
+    proc->c_result = 0x100;
+    add(proc, proc->x, value ^ 0xff);
 }
 
-void inst_CPY(struct m6502 *proc, enum address_mode mode) {
-    proc->c = 1;
-    add(proc, proc->y, get_operand_value(proc, mode) ^ 0xff);
+void inst_CPY(struct m6502 *proc, uint8_t value) {
+    proc->c_result = 0x100;
+    add(proc, proc->y, value ^ 0xff);
 }
 
-void inst_ADC(struct m6502 *proc, enum address_mode mode) {
-    proc->a = add(proc, proc->a, get_operand_value(proc, mode));
+void inst_ADC(struct m6502 *proc, uint8_t value) {
+    proc->a = add(proc, proc->a, value);
 }
 
-void inst_SBC(struct m6502 *proc, enum address_mode mode) {
-    proc->a = add(proc, proc->a, get_operand_value(proc, mode) ^ 0xff);
+void inst_SBC(struct m6502 *proc, uint8_t value) {
+    proc->a = add(proc, proc->a, value ^ 0xff);
 }
 
-void inst_INC(struct m6502 *proc, enum address_mode mode) {
-    uint16_t addr = get_operand_addr(proc, mode);
-    uint8_t new_val = read_mem_u8(proc, addr) + 1;
+uint8_t inst_INC(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = old_val + 1;
     set_nz_flags(proc, new_val);
-    write_mem_u8(proc, addr, new_val);
+    return new_val;
 }
 
-void inst_DEC(struct m6502 *proc, enum address_mode mode) {
-    uint16_t addr = get_operand_addr(proc, mode);
-    uint8_t new_val = read_mem_u8(proc, addr) - 1;
+uint8_t inst_DEC(struct m6502 *proc, uint8_t old_val) {
+    uint8_t new_val = old_val - 1;
     set_nz_flags(proc, new_val);
-    write_mem_u8(proc, addr, new_val);
+    return new_val;
 }
 
-void inst_INX(struct m6502 *proc, enum address_mode mode) {
+void inst_INX(struct m6502 *proc) {
     set_nz_flags(proc, ++proc->x);
 }
 
-void inst_DEX(struct m6502 *proc, enum address_mode mode) {
+void inst_DEX(struct m6502 *proc) {
     set_nz_flags(proc, --proc->x);
 }
 
-void inst_INY(struct m6502 *proc, enum address_mode mode) {
+void inst_INY(struct m6502 *proc) {
     set_nz_flags(proc, ++proc->y);
 }
 
-void inst_DEY(struct m6502 *proc, enum address_mode mode) {
+void inst_DEY(struct m6502 *proc) {
     set_nz_flags(proc, --proc->y);
 }
 
 //
 // Register moves
 //
-void inst_LDA(struct m6502 *proc, enum address_mode mode) {
-    proc->a = get_operand_value(proc, mode);
+void inst_LDA(struct m6502 *proc, uint8_t value) {
+    proc->a = value;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_STA(struct m6502 *proc, enum address_mode mode) {
-    write_mem_u8(proc, get_operand_addr(proc, mode), proc->a);
+void inst_STA(struct m6502 *proc, uint16_t addr) {
+    write_mem_u8(proc, addr, proc->a);
 }
 
-void inst_LDX(struct m6502 *proc, enum address_mode mode) {
-    proc->x = get_operand_value(proc, mode);
+void inst_LDX(struct m6502 *proc, uint8_t value) {
+    proc->x = value;
     set_nz_flags(proc, proc->x);
 }
 
-void inst_STX(struct m6502 *proc, enum address_mode mode) {
-    write_mem_u8(proc, get_operand_addr(proc, mode), proc->x);
+void inst_STX(struct m6502 *proc, uint16_t addr) {
+    write_mem_u8(proc, addr, proc->x);
 }
 
-void inst_LDY(struct m6502 *proc, enum address_mode mode) {
-    proc->y = get_operand_value(proc, mode);
+void inst_LDY(struct m6502 *proc, uint8_t value) {
+    proc->y = value;
     set_nz_flags(proc, proc->y);
 }
 
-void inst_STY(struct m6502 *proc, enum address_mode mode) {
-    write_mem_u8(proc, get_operand_addr(proc, mode), proc->y);
+void inst_STY(struct m6502 *proc, uint16_t addr) {
+    write_mem_u8(proc, addr, proc->y);
 }
 
-void inst_TXS(struct m6502 *proc, enum address_mode mode) {
+void inst_TXS(struct m6502 *proc) {
     proc->s = proc->x;
     set_nz_flags(proc, proc->s);
 }
 
-void inst_TSX(struct m6502 *proc, enum address_mode mode) {
+void inst_TSX(struct m6502 *proc) {
     proc->x = proc->s;
     set_nz_flags(proc, proc->x);
 }
 
-void inst_TAX(struct m6502 *proc, enum address_mode mode) {
+void inst_TAX(struct m6502 *proc) {
     proc->x = proc->a;
     set_nz_flags(proc, proc->x);
 }
 
-void inst_TXA(struct m6502 *proc, enum address_mode mode) {
+void inst_TXA(struct m6502 *proc) {
     proc->a = proc->x;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_TAY(struct m6502 *proc, enum address_mode mode) {
+void inst_TAY(struct m6502 *proc) {
     proc->y = proc->a;
     set_nz_flags(proc, proc->y);
 }
 
-void inst_TYA(struct m6502 *proc, enum address_mode mode) {
+void inst_TYA(struct m6502 *proc) {
     proc->a = proc->y;
     set_nz_flags(proc, proc->a);
 }
 
-void inst_PHA(struct m6502 *proc, enum address_mode mode) {
+void inst_PHA(struct m6502 *proc) {
     write_mem_u8(proc, proc->s-- + 0x100, proc->a);
 }
 
-void inst_PLA(struct m6502 *proc, enum address_mode mode) {
+void inst_PLA(struct m6502 *proc) {
     proc->a = read_mem_u8(proc, ++proc->s + 0x100);
     set_nz_flags(proc, proc->a);
 }
 
-void inst_PHP(struct m6502 *proc, enum address_mode mode) {
-    // XXX not implemented: push flags on the stack
-    assert(0);
+// The B flag isn't a real register bit: PHP always pushes it as set, and
+// PLP/RTI leave it alone.
+void inst_PHP(struct m6502 *proc) {
+    write_mem_u8(proc, proc->s-- + 0x100, get_status(proc) | FLAG_B);
+}
+
+static void pull_status(struct m6502 *proc) {
+    uint8_t status = read_mem_u8(proc, ++proc->s + 0x100);
+    set_status(proc, (status & ~FLAG_B) | (proc->p & FLAG_B));
 }
 
-void inst_PLP(struct m6502 *proc, enum address_mode mode) {
-    // XXX not implemented, pop flags from the stack.
-    assert(0);
+void inst_PLP(struct m6502 *proc) {
+    pull_status(proc);
 }
 
 //
 // Setting/clearing flags
 //
-void inst_SEC(struct m6502 *proc, enum address_mode mode) {
-    proc->c = 1;
+void inst_SEC(struct m6502 *proc) {
+    proc->c_result = 0x100;
 }
 
-void inst_CLC(struct m6502 *proc, enum address_mode mode) {
-    proc->c = 0;
+void inst_CLC(struct m6502 *proc) {
+    proc->c_result = 0;
 }
 
-void inst_SED(struct m6502 *proc, enum address_mode mode) {
-    proc->d = 1;
+void inst_SED(struct m6502 *proc) {
+    proc->p |= FLAG_D;
 }
 
-void inst_CLD(struct m6502 *proc, enum address_mode mode) {
-    proc->d = 0;
+void inst_CLD(struct m6502 *proc) {
+    proc->p &= ~FLAG_D;
 }
 
-void inst_SEI(struct m6502 *proc, enum address_mode mode) {
-    proc->i = 1;
+void inst_SEI(struct m6502 *proc) {
+    proc->p |= FLAG_I;
 }
 
-void inst_CLI(struct m6502 *proc, enum address_mode mode) {
-    proc->i = 0;
+void inst_CLI(struct m6502 *proc) {
+    proc->p &= ~FLAG_I;
 }
 
-void inst_CLV(struct m6502 *proc, enum address_mode mode) {
-    proc->v = 0;
+void inst_CLV(struct m6502 *proc) {
+    proc->v_result = 0;
 }
 
 //
 // Branch
+// The operand is the signed offset byte.
 //
-void inst_BCS(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (proc->c) {
-        proc->pc += offset;
-    }
+static void take_branch(struct m6502 *proc, uint8_t offset) {
+    uint16_t target = proc->pc + (int8_t) offset;
+
+    // One extra cycle if taken, two if it goes to another page.
+    proc->cycles += 1 + ((target ^ proc->pc) > 0xff);
+    proc->pc = target;
 }
 
-void inst_BCC(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (!proc->c) {
-        proc->pc += offset;
+void inst_BCS(struct m6502 *proc, uint8_t offset) {
+    if (get_flag(proc, FLAG_C)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BVS(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (proc->v) {
-        proc->pc += offset;
+void inst_BCC(struct m6502 *proc, uint8_t offset) {
+    if (!get_flag(proc, FLAG_C)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BVC(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (!proc->v) {
-        proc->pc += offset;
+void inst_BVS(struct m6502 *proc, uint8_t offset) {
+    if (get_flag(proc, FLAG_V)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BMI(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (proc->n) {
-        proc->pc += offset;
+void inst_BVC(struct m6502 *proc, uint8_t offset) {
+    if (!get_flag(proc, FLAG_V)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BPL(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (!proc->n) {
-        proc->pc += offset;
+void inst_BMI(struct m6502 *proc, uint8_t offset) {
+    if (get_flag(proc, FLAG_N)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BEQ(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (proc->z) {
-        proc->pc += offset;
+void inst_BPL(struct m6502 *proc, uint8_t offset) {
+    if (!get_flag(proc, FLAG_N)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_BNE(struct m6502 *proc, enum address_mode mode) {
-    int8_t offset = read_mem_u8(proc, proc->pc++);
-    if (!proc->z) {
-        proc->pc += offset;
+void inst_BEQ(struct m6502 *proc, uint8_t offset) {
+    if (get_flag(proc, FLAG_Z)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_JMP(struct m6502 *proc, enum address_mode mode) {
-    if (mode == ABSOLUTE) {
-        proc->pc = read_mem_u16(proc, proc->pc);
-    } else {
-        // Indirect
-        proc->pc = read_mem_u16(proc, read_mem_u16(proc, proc->pc));
+void inst_BNE(struct m6502 *proc, uint8_t offset) {
+    if (!get_flag(proc, FLAG_Z)) {
+        take_branch(proc, offset);
     }
 }
 
-void inst_JSR(struct m6502 *proc, enum address_mode mode) {
-    uint16_t target = read_mem_u16(proc, proc->pc);
-    proc->pc += 2;
+void inst_JMP(struct m6502 *proc, uint16_t target) {
+    proc->pc = target;
+}
+
+void inst_JSR(struct m6502 *proc, uint16_t target) {
     write_mem_u8(proc, proc->s-- + 0x100, proc->pc >> 8);
     write_mem_u8(proc, proc->s-- + 0x100, proc->pc & 0xff);
     proc->pc = target;
+#ifdef ENABLE_PROFILE
+    if (proc->profile) {
+        profile_call(proc, target);
+    }
+#endif
 }
 
-void inst_RTS(struct m6502 *proc, enum address_mode mode) {
+void inst_RTS(struct m6502 *proc) {
+#ifdef ENABLE_PROFILE
+    if (proc->profile) {
+        profile_return(proc);
+    }
+#endif
+
     uint16_t ra = read_mem_u8(proc, ++proc->s + 0x100);
     ra = ra | (read_mem_u8(proc, ++proc->s + 0x100) << 8);
     proc->pc = ra;
 }
 
-void inst_RTI(struct m6502 *proc, enum address_mode mode) {
-    assert(0); // Not implemented
+void inst_RTI(struct m6502 *proc) {
+    pull_status(proc);
+    uint16_t ra = read_mem_u8(proc, ++proc->s + 0x100);
+    ra = ra | (read_mem_u8(proc, ++proc->s + 0x100) << 8);
+    proc->pc = ra;
 }
 
-void run_emulator(struct m6502 *proc, int single_step) {
-    proc->halt = 0;
-    while (!proc->halt) {
-        int opcode = read_mem_u8(proc, proc->pc++);
-        const struct instruction *inst = &INSTRUCTIONS[opcode];
-        inst->func(proc, inst->mode);
-        if (single_step) {
+#define INSTRUCTION_HANDLERS
+#include "instructions.h"
+
+static const struct decoded_inst *decode_inst(struct m6502 *proc, uint16_t pc) {
+    uint8_t opcode = read_mem(proc, pc, 0);
+    const struct instruction *inst = &INSTRUCTIONS[opcode];
+    uint16_t operand = 0;
+    if (inst->length > 1) {
+        operand = read_mem(proc, pc + 1, 0);
+    }
+
+    if (inst->length > 2) {
+        operand |= read_mem(proc, pc + 2, 0) << 8;
+    }
+
+    struct decoded_inst **page = &proc->decode_cache[pc >> PAGE_SHIFT];
+    if (*page == EMPTY_DECODE_PAGE) {
+        *page = calloc(PAGE_SIZE, sizeof(struct decoded_inst));
+    }
+
+    struct decoded_inst *di = &(*page)[pc % PAGE_SIZE];
+    di->func = inst->func;
+    di->operand = operand;
+    di->opcode = opcode;
+    di->length = inst->length;
+    di->generation = proc->decode_generation;
+
+    // The operand may extend into the next page.
+    mark_code_page(proc, pc >> PAGE_SHIFT);
+    mark_code_page(proc, (uint16_t) (pc + inst->length - 1) >> PAGE_SHIFT);
+
+    return di;
+}
+
+static inline const struct decoded_inst *fetch_inst(struct m6502 *proc) {
+    const struct decoded_inst *di = get_decoded(proc, proc->pc);
+    if (di->generation == proc->decode_generation) {
+        return di;
+    }
+
+    return decode_inst(proc, proc->pc);
+}
+
+// Interpret a single instruction without the per-call setup in
+// run_instructions. The JIT uses this for code it hasn't translated.
+// Returns nonzero if the emulator stopped.
+int execute_inst(struct m6502 *proc) {
+    const struct decoded_inst *di = fetch_inst(proc);
+    return di->func(proc, di->operand);
+}
+
+static enum stop_reason finish_run(struct m6502 *proc, uint64_t executed) {
+    proc->instructions += executed;
+    if (proc->halt && proc->console->length) {
+        flush_console(proc->console);
+    }
+
+    return proc->halt ? proc->halt : STOP_BUDGET;
+}
+
+#ifdef ENABLE_PROFILE
+#define PROFILING(proc) ((proc)->profile != NULL)
+#else
+#define PROFILING(proc) 0
+#endif
+
+// Count reaching a breakpoint if its condition is true, and return
+// whether to stop there.
+static int breakpoint_hit(struct m6502 *proc, uint16_t addr) {
+    struct breakpoint *breakpoint = find_breakpoint(proc, addr);
+    if (!eval_condition(proc, &breakpoint->condition)) {
+        return 0;
+    }
+
+    breakpoint->hits++;
+    if (breakpoint->ignore) {
+        breakpoint->ignore--;
+        return 0;
+    }
+
+    return 1;
+}
+
+// run_instructions, checking for breakpoints and watchpoints and recording
+// or counting each instruction. This is separate so that debugging, tracing, and
+// profiling cost nothing per instruction when they are off.
+static enum stop_reason run_instrumented(struct m6502 *proc,
+                                         uint64_t budget) {
+    struct trace *trace = proc->trace;
+    uint64_t remaining = budget;
+    while (remaining) {
+        if (is_breakpoint(proc, proc->pc)) {
+            if (proc->pc != proc->breakpoint_pc
+                    && breakpoint_hit(proc, proc->pc)) {
+                proc->breakpoint_pc = proc->pc;
+                proc->halt = STOP_BREAKPOINT;
+                break;
+            }
+        }
+
+        proc->breakpoint_pc = -1;
+        uint16_t pc = proc->pc;
+        const struct decoded_inst *di = fetch_inst(proc);
+#ifdef ENABLE_PROFILE
+        struct profile *profile = proc->profile;
+        int call = 0;
+        uint64_t cycles = proc->cycles;
+        if (profile) {
+            profile->opcodes[di->opcode]++;
+            profile->addresses[proc->pc]++;
+            call = profile->current_call;
+        }
+#endif
+
+        struct trace_record *record = NULL;
+        if (trace) {
+            record = next_trace_record(trace);
+            record->pc = proc->pc;
+            record->opcode = di->opcode;
+            record->operand = di->operand;
+        }
+
+        remaining--;
+        int stopped = di->func(proc, di->operand);
+#ifdef ENABLE_PROFILE
+        if (profile) {
+            // Charged to the subroutine it started in, so a JSR counts
+            // for the caller
+            profile->calls[call].instructions++;
+            profile->calls[call].cycles += proc->cycles - cycles;
+        }
+#endif
+
+        if (record) {
+            record->status = get_status(proc);
+            record->a = proc->a;
+            record->x = proc->x;
+            record->y = proc->y;
+            record->s = proc->s;
+            commit_trace_record(trace);
+        }
+
+        // Reads don't make handlers return nonzero, so check halt for a
+        // read watchpoint.
+        if (stopped || proc->halt) {
+            if (proc->halt == STOP_WATCHPOINT) {
+                proc->watch_hit.pc = pc;
+            }
+
+            break;
+        }
+    }
+
+    if (trace) {
+        publish_trace(trace);
+    }
+
+    return finish_run(proc, budget - remaining);
+}
+
+//
+// Run until an instruction stops the emulator, or budget instructions
+// have been executed. Stopping can be resumed by calling this again.
+// Unlike run_emulator, this doesn't flush the decode cache, so callers
+// that modify guest memory directly must call flush_decode_cache first.
+//
+// The budget is counted down in a local, and only the handlers that can
+// stop the emulator (stores, BRK, invalid opcodes) cause proc->halt to
+// be checked, so a watchdog or time slice costs one decrement and branch
+// per instruction.
+//
+#ifdef THREADED_DISPATCH
+
+//
+// Computed goto dispatch (a GCC/clang extension). Each opcode gets its own
+// label, with the handler call inlined and the fetch/dispatch of the next
+// instruction replicated at the end. This avoids the call/return and
+// gives the branch predictor a separate indirect jump per opcode to learn
+// from, instead of the single shared one in the loop below.
+//
+enum stop_reason run_instructions(struct m6502 *proc, uint64_t budget) {
+#define LABEL_ADDR(opcode, mnemonic, mode) &&label_##opcode,
+    static const void * const DISPATCH_TABLE[256] = {
+        FOR_EACH_OPCODE(LABEL_ADDR)
+    };
+#undef LABEL_ADDR
+
+    const struct decoded_inst *di;
+    uint64_t remaining = budget;
+
+#define DISPATCH_NEXT() \
+    di = fetch_inst(proc); \
+    goto *DISPATCH_TABLE[di->opcode];
+
+    proc->halt = STOP_NONE;
+    if (remaining == 0) {
+        return STOP_BUDGET;
+    }
+
+    if (proc->trace || PROFILING(proc) || proc->breakpoints
+            || proc->num_watchpoints) {
+        return run_instrumented(proc, budget);
+    }
+
+#ifdef ENABLE_JIT
+    if (proc->jit) {
+        remaining = jit_run(proc, remaining);
+        return finish_run(proc, budget - remaining);
+    }
+#endif
+
+    DISPATCH_NEXT()
+
+#define HANDLER(opcode, mnemonic, mode) \
+    label_##opcode: \
+        remaining--; \
+        if (op_##opcode(proc, di->operand) || remaining == 0) { \
+            return finish_run(proc, budget - remaining); \
+        } \
+        DISPATCH_NEXT()
+
+    FOR_EACH_OPCODE(HANDLER)
+#undef HANDLER
+#undef DISPATCH_NEXT
+}
+
+#else
+
+enum stop_reason run_instructions(struct m6502 *proc, uint64_t budget) {
+    uint64_t remaining = budget;
+
+    proc->halt = STOP_NONE;
+    if (proc->trace || PROFILING(proc) || proc->breakpoints
+            || proc->num_watchpoints) {
+        return run_instrumented(proc, budget);
+    }
+
+#ifdef ENABLE_JIT
+    if (proc->jit && remaining) {
+        remaining = jit_run(proc, remaining);
+        return finish_run(proc, budget - remaining);
+    }
+#endif
+
+    while (remaining) {
+        const struct decoded_inst *di = fetch_inst(proc);
+        remaining--;
+        if (di->func(proc, di->operand)) {
             break;
         }
     }
+
+    return finish_run(proc, budget - remaining);
+}
+
+#endif
+
+// Run until the emulator stops or at least budget cycles have elapsed.
+// This may overshoot by up to one instruction, as it doesn't stop part
+// way through one. It is built on run_instructions, with instruction
+// budgets that can't exceed the remaining cycles, so there is no extra
+// work per instruction.
+enum stop_reason run_cycles(struct m6502 *proc, uint64_t budget) {
+    uint64_t end = proc->cycles + budget;
+    while (proc->cycles < end) {
+        uint64_t instructions = (end - proc->cycles) / MAX_INST_CYCLES;
+        enum stop_reason reason = run_instructions(proc,
+            instructions ? instructions : 1);
+        if (reason != STOP_BUDGET) {
+            return reason;
+        }
+    }
+
+    return STOP_BUDGET;
+}
+
+void run_emulator(struct m6502 *proc, int single_step) {
+    // The caller may have modified memory directly since the last call.
+    flush_decode_cache(proc);
+    run_instructions(proc, single_step ? 1 : UINT64_MAX);
+}
+
+// Stop before executing the instruction at addr. While any breakpoints
+// are set, run_instructions uses the slower loop in run_instrumented,
+// which checks for them. A new breakpoint has no condition and no ignore
+// count; set them with find_breakpoint. Setting one that already exists
+// leaves it as is. Returns 0 on success, or -1 if out of memory.
+int set_breakpoint(struct m6502 *proc, uint16_t addr) {
+    if (is_breakpoint(proc, addr)) {
+        return 0;
+    }
+
+    if (proc->breakpoints == NULL) {
+        proc->breakpoints = calloc(MEM_SIZE / 32, sizeof(uint32_t));
+        if (proc->breakpoints == NULL) {
+            return -1;
+        }
+    }
+
+    if (proc->num_breakpoints == proc->max_breakpoints) {
+        int max_breakpoints = proc->max_breakpoints
+            ? proc->max_breakpoints * 2 : 8;
+        struct breakpoint *list = realloc(proc->breakpoint_list,
+            max_breakpoints * sizeof(struct breakpoint));
+        if (list == NULL) {
+            return -1;
+        }
+
+        proc->breakpoint_list = list;
+        proc->max_breakpoints = max_breakpoints;
+    }
+
+    struct breakpoint *breakpoint
+        = &proc->breakpoint_list[proc->num_breakpoints++];
+    breakpoint->addr = addr;
+    breakpoint->condition.length = 0;
+    breakpoint->condition.text[0] = '\0';
+    breakpoint->hits = 0;
+    breakpoint->ignore = 0;
+    proc->breakpoints[addr / 32] |= 1u << (addr % 32);
+    return 0;
+}
+
+// Returns NULL if there is no breakpoint at addr. The result is only
+// valid until the next call to set_breakpoint or clear_breakpoint.
+struct breakpoint *find_breakpoint(struct m6502 *proc, uint16_t addr) {
+    for (int i = 0; i < proc->num_breakpoints; i++) {
+        if (proc->breakpoint_list[i].addr == addr) {
+            return &proc->breakpoint_list[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns 0 on success, or -1 if there is no breakpoint at addr. Removing
+// the last one goes back to the fast loop.
+int clear_breakpoint(struct m6502 *proc, uint16_t addr) {
+    if (!is_breakpoint(proc, addr)) {
+        return -1;
+    }
+
+    proc->breakpoints[addr / 32] &= ~(1u << (addr % 32));
+    struct breakpoint *breakpoint = find_breakpoint(proc, addr);
+    *breakpoint = proc->breakpoint_list[--proc->num_breakpoints];
+    if (proc->num_breakpoints == 0) {
+        free(proc->breakpoints);
+        free(proc->breakpoint_list);
+        proc->breakpoints = NULL;
+        proc->breakpoint_list = NULL;
+        proc->max_breakpoints = 0;
+    }
+
+    return 0;
+}
+
+static void update_watch_pages(struct m6502 *proc) {
+    memset(proc->read_watch_pages, 0, sizeof(proc->read_watch_pages));
+    memset(proc->write_watch_pages, 0, sizeof(proc->write_watch_pages));
+    for (int i = 0; i < proc->num_watchpoints; i++) {
+        const struct watchpoint *watch = &proc->watchpoints[i];
+        for (int page = watch->start >> PAGE_SHIFT;
+                page <= watch->end >> PAGE_SHIFT; page++) {
+            if (watch->flags & WATCH_READ) {
+                proc->read_watch_pages[page >> 5] |= 1u << (page & 31);
+            }
+
+            if (watch->flags & WATCH_WRITE) {
+                proc->write_watch_pages[page >> 5] |= 1u << (page & 31);
+            }
+        }
+    }
+
+    // Also rebuilds the page maps, and makes the JIT look up read_map
+    // again.
+    flush_decode_cache(proc);
+}
+
+// Stop after an instruction reads (WATCH_READ) or writes (WATCH_WRITE)
+// any address from start to end inclusive, with the details in
+// proc->watch_hit. Instruction fetches don't count as reads. Only the
+// pages the range covers leave the page table's fast path, but while any
+// watchpoints are set, run_instructions uses run_instrumented to report
+// which instruction made the access. Returns 0 on success, or -1 with
+// errno set to EINVAL for an empty range or no flags, or ENOSPC if there
+// are already MAX_WATCHPOINTS.
+int add_watchpoint(struct m6502 *proc, uint16_t start, uint16_t end,
+                   int flags) {
+    flags &= WATCH_READ | WATCH_WRITE;
+    if (end < start || flags == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (proc->num_watchpoints == MAX_WATCHPOINTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct watchpoint *watch = &proc->watchpoints[proc->num_watchpoints++];
+    watch->start = start;
+    watch->end = end;
+    watch->flags = flags;
+    update_watch_pages(proc);
+    return 0;
+}
+
+// Remove the watchpoints that start at the given address. Returns 0 on
+// success, or -1 if there are none.
+int remove_watchpoint(struct m6502 *proc, uint16_t start) {
+    int count = 0;
+    for (int i = 0; i < proc->num_watchpoints; i++) {
+        if (proc->watchpoints[i].start != start) {
+            proc->watchpoints[count++] = proc->watchpoints[i];
+        }
+    }
+
+    if (count == proc->num_watchpoints) {
+        return -1;
+    }
+
+    proc->num_watchpoints = count;
+    update_watch_pages(proc);
+    return 0;
 }
 
 void init_proc(struct m6502 *proc) {
@@ -452,15 +1523,204 @@ void init_proc(struct m6502 *proc) {
     proc->x = 0;
     proc->y = 0;
     proc->s = 0xff;
-    proc->pc = 0; // XXX reset vector
-    proc->n = 0;
-    proc->v = 0;
-    proc->b = 0;
-    proc->d = 0;
-    proc->i = 0;
-    proc->z = 0;
-    proc->c = 0;
+    proc->pc = 0; // See reset_proc
+    proc->nz_result = 1;
+    proc->c_result = 0;
+    proc->v_result = 0;
+    proc->p = 0;
     proc->memory = calloc(MEM_SIZE, 1);
+    proc->halt = STOP_NONE;
+    proc->instructions = 0;
+    proc->cycles = 0;
+    proc->exit_on_mmio = 0;
+    proc->console = open_console(STDOUT_FILENO,
+        isatty(STDOUT_FILENO) ? CONSOLE_FLUSH_NEWLINE : 0);
+    reset_decode_cache(proc);
+    proc->jit = NULL;
+    proc->trace = NULL;
+#ifdef ENABLE_PROFILE
+    proc->profile = NULL;
+#endif
+    proc->breakpoints = NULL;
+    proc->breakpoint_list = NULL;
+    proc->num_breakpoints = 0;
+    proc->max_breakpoints = 0;
+    proc->breakpoint_pc = -1;
+    proc->num_watchpoints = 0;
+    memset(proc->read_watch_pages, 0, sizeof(proc->read_watch_pages));
+    memset(proc->write_watch_pages, 0, sizeof(proc->write_watch_pages));
+    proc->track_dirty = 0;
+    proc->checkpoint_id = 0;
+    memset(proc->pages, 0, sizeof(proc->pages));
+    map_memory(proc, 0, NUM_PAGES, proc->memory, 0);
+    map_handlers(proc, 0, NUM_PAGES, NULL, NULL, NULL);
+    map_handlers(proc, CONSOLE_OUT >> PAGE_SHIFT, 1, NULL, console_write,
+        NULL);
+}
+
+// Share a RAM page with another user, marking it to be copied on the next
+// write. Returns NULL if the page isn't RAM. The first time, the page is
+// moved into shared memory, so the caller must flush the decode cache
+// (and with it, the JIT) rather than just updating the page map.
+static struct shared_page *share_page(struct m6502 *proc, int page,
+                                      int *moved) {
+    struct page_mapping *mapping = &proc->pages[page];
+    if (mapping->memory == NULL || (mapping->flags & MAP_READ_ONLY)) {
+        return NULL;
+    }
+
+    if (mapping->shared == NULL) {
+        struct shared_page *shared = malloc(sizeof(struct shared_page));
+        shared->refcount = 1;
+        memcpy(shared->data, mapping->memory, PAGE_SIZE);
+        mapping->shared = shared;
+        mapping->memory = shared->data;
+        *moved = 1;
+    }
+
+    mapping->flags |= MAP_COPY_ON_WRITE;
+    __atomic_add_fetch(&mapping->shared->refcount, 1, __ATOMIC_RELAXED);
+    return mapping->shared;
+}
+
+// Make child a copy of parent, for example to run many variations from a
+// checkpoint. Rather than copying memory, both share it, and a page is
+// only copied when one of them first writes to it. ROM is shared as is.
+// The child has the same device handlers, with the same contexts, and
+// starts without the JIT. Its memory field is NULL; access its memory with
+// read_mem_u8 and write_mem_u8. This changes parent's page mappings the
+// same way, so parent must not be running, and parent->memory is no
+// longer used either. Release both with free_proc.
+void fork_proc(struct m6502 *child, struct m6502 *parent) {
+    int moved = 0;
+    for (int page = 0; page < NUM_PAGES; page++) {
+        share_page(parent, page, &moved);
+    }
+
+    flush_decode_cache(parent);
+    *child = *parent;
+    child->memory = NULL;
+    reset_decode_cache(child);
+    child->jit = NULL;
+    child->trace = NULL;
+#ifdef ENABLE_PROFILE
+    child->profile = NULL;
+#endif
+    child->console = open_console(parent->console->fd,
+        parent->console->flags);
+    child->breakpoints = NULL;
+    child->breakpoint_list = NULL;
+    child->num_breakpoints = 0;
+    child->max_breakpoints = 0;
+    child->breakpoint_pc = -1;
+    child->num_watchpoints = 0;
+    memset(child->read_watch_pages, 0, sizeof(child->read_watch_pages));
+    memset(child->write_watch_pages, 0, sizeof(child->write_watch_pages));
+    flush_decode_cache(child);
+}
+
+// Record the state of a processor, so restore_snapshot can go back to it.
+// This is cheap enough to do often: it copies the registers and takes a
+// reference to each RAM page. As with fork_proc, proc->memory is no longer
+// used afterwards. Release it with free_snapshot.
+void take_snapshot(struct m6502 *proc, struct snapshot *snapshot) {
+    int moved = 0;
+    for (int page = 0; page < NUM_PAGES; page++) {
+        snapshot->pages[page] = share_page(proc, page, &moved);
+        update_page_map(proc, page);
+    }
+
+    if (moved) {
+        flush_decode_cache(proc);
+    }
+
+    snapshot->instructions = proc->instructions;
+    snapshot->cycles = proc->cycles;
+    snapshot->s = proc->s;
+    snapshot->pc = proc->pc;
+    snapshot->nz_result = proc->nz_result;
+    snapshot->c_result = proc->c_result;
+    snapshot->a = proc->a;
+    snapshot->x = proc->x;
+    snapshot->y = proc->y;
+    snapshot->v_result = proc->v_result;
+    snapshot->p = proc->p;
+}
+
+// Put a processor back in the state it was in when the snapshot was taken.
+// Its memory map must not have changed since then. Device handlers aren't
+// part of the snapshot, so they keep any state they have. Changed pages
+// are marked dirty for save_delta.
+void restore_snapshot(struct m6502 *proc, const struct snapshot *snapshot) {
+    for (int page = 0; page < NUM_PAGES; page++) {
+        struct page_mapping *mapping = &proc->pages[page];
+        struct shared_page *shared = snapshot->pages[page];
+        if (shared == NULL || mapping->shared == shared) {
+            continue;
+        }
+
+        if (mapping->shared) {
+            release_page(mapping->shared);
+        }
+
+        __atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
+        mapping->shared = shared;
+        mapping->memory = shared->data;
+        mapping->flags |= MAP_COPY_ON_WRITE;
+        if (proc->track_dirty) {
+            proc->dirty_pages[page >> 5] |= 1u << (page & 31);
+        }
+    }
+
+    proc->instructions = snapshot->instructions;
+    proc->cycles = snapshot->cycles;
+    proc->s = snapshot->s;
+    proc->pc = snapshot->pc;
+    proc->nz_result = snapshot->nz_result;
+    proc->c_result = snapshot->c_result;
+    proc->a = snapshot->a;
+    proc->x = snapshot->x;
+    proc->y = snapshot->y;
+    proc->v_result = snapshot->v_result;
+    proc->p = snapshot->p;
+    proc->halt = STOP_NONE;
+    flush_decode_cache(proc);
+}
+
+void free_snapshot(struct snapshot *snapshot) {
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (snapshot->pages[page]) {
+            release_page(snapshot->pages[page]);
+        }
+    }
+}
+
+// Release the memory of a processor from init_proc or fork_proc.
+void free_proc(struct m6502 *proc) {
+    stop_trace(proc);
+    close_console(proc->console);
+#ifdef ENABLE_JIT
+    jit_disable(proc);
+#endif
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (proc->pages[page].shared) {
+            release_page(proc->pages[page].shared);
+        }
+    }
+
+#ifdef ENABLE_PROFILE
+    stop_profile(proc);
+#endif
+    free(proc->breakpoints);
+    free(proc->breakpoint_list);
+    free_decode_cache(proc);
+    free(proc->memory);
+}
+
+// Start at the address in the reset vector. This is separate from
+// init_proc because the vector is normally in the program image.
+void reset_proc(struct m6502 *proc) {
+    proc->pc = read_mem_u16(proc, RESET_VECTOR);
 }
 
 void dump_regs(struct m6502 *proc) {
@@ -470,85 +1730,98 @@ void dump_regs(struct m6502 *proc) {
     printf("S %02x\n", proc->s & 0xffff);
     printf("PC %04x\n", proc->pc);
     printf("      NVBDIZC\n");
-    printf("Flags %d%d%d%d%d%d%d\n", proc->n, proc->v, proc->b, proc->d,
-        proc->i, proc->z, proc->c);
+    printf("Flags %d%d%d%d%d%d%d\n", get_flag(proc, FLAG_N),
+        get_flag(proc, FLAG_V), get_flag(proc, FLAG_B), get_flag(proc, FLAG_D),
+        get_flag(proc, FLAG_I), get_flag(proc, FLAG_Z), get_flag(proc, FLAG_C));
+}
+
+// Write the assembly for an instruction at addr, e.g. "LDA $12, X". The
+// operand holds the bytes after the opcode, low byte first.
+void format_inst(char *buf, size_t size, uint16_t addr, uint8_t opcode,
+                 uint16_t operand) {
+    const struct instruction *inst = &INSTRUCTIONS[opcode];
+    switch (inst->mode) {
+        case ABSOLUTE:
+            snprintf(buf, size, "%s $%04x", inst->mnemonic, operand);
+            break;
+        case ABSOLUTE_X:
+            snprintf(buf, size, "%s $%04x, X", inst->mnemonic, operand);
+            break;
+        case ABSOLUTE_Y:
+            snprintf(buf, size, "%s $%04x, Y", inst->mnemonic, operand);
+            break;
+        case IMPLIED:
+            snprintf(buf, size, "%s ", inst->mnemonic);
+            break;
+        case IND_ZERO_PAGE_X:
+            snprintf(buf, size, "%s ($%02x, X)", inst->mnemonic, operand);
+            break;
+        case IND_ZERO_PAGE_Y:
+            snprintf(buf, size, "%s ($%02x), Y", inst->mnemonic, operand);
+            break;
+        case IMMEDIATE:
+            snprintf(buf, size, "%s #$%02x", inst->mnemonic, operand);
+            break;
+        case ZERO_PAGE_X:
+            snprintf(buf, size, "%s $%02x, X", inst->mnemonic, operand);
+            break;
+        case ZERO_PAGE_Y:
+            snprintf(buf, size, "%s $%02x, Y", inst->mnemonic, operand);
+            break;
+        case ZERO_PAGE:
+            snprintf(buf, size, "%s $%02x", inst->mnemonic, operand);
+            break;
+        case INDIRECT:
+            snprintf(buf, size, "%s ($%04x)", inst->mnemonic, operand);
+            break;
+        case RELATIVE:
+            snprintf(buf, size, "%s %04x", inst->mnemonic,
+                (uint16_t) (addr + 2 + (int8_t) operand));
+            break;
+    }
+}
+
+// This goes by the addressing mode rather than the length in INSTRUCTIONS,
+// which is 1 for undefined opcodes, to show what operand they would have.
+static int operand_length(enum address_mode mode) {
+    switch (mode) {
+        case IMPLIED:
+            return 0;
+        case ABSOLUTE:
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+        case INDIRECT:
+            return 2;
+        default:
+            return 1;
+    }
 }
 
 int disassemble(struct m6502 *proc, uint16_t base_addr, int length) {
     uint16_t addr = base_addr;
     while (addr < base_addr + length) {
         int start_addr = addr;
-        uint8_t opcode = proc->memory[addr++];
-        const struct instruction *inst = &INSTRUCTIONS[opcode];
-        char operands[64];
-        switch (inst->mode) {
-            case ABSOLUTE:
-                snprintf(operands, sizeof(operands), "$%04x",
-                    proc->memory[addr] | (proc->memory[addr + 1] << 8));
-                addr += 2;
-                break;
-            case ABSOLUTE_X:
-                snprintf(operands, sizeof(operands), "$%04x, X",
-                    proc->memory[addr] | (proc->memory[addr + 1] << 8));
-                addr += 2;
-                break;
-            case ABSOLUTE_Y:
-                snprintf(operands, sizeof(operands), "$%04x, Y",
-                    proc->memory[addr] | (proc->memory[addr + 1] << 8));
-                addr += 2;
-                break;
-            case IMPLIED:
-                strcpy(operands, "");
-                break;
-            case IND_ZERO_PAGE_X:
-                snprintf(operands, sizeof(operands), "($%02x, X)",
-                    proc->memory[addr++]);
-                break;
-            case IND_ZERO_PAGE_Y:
-                snprintf(operands, sizeof(operands), "($%02x), Y",
-                    proc->memory[addr++]);
-                break;
-            case IMMEDIATE:
-                snprintf(operands, sizeof(operands), "#$%02x",
-                    proc->memory[addr++]);
-                break;
-            case ZERO_PAGE_X:
-                snprintf(operands, sizeof(operands), "$%02x, X",
-                    proc->memory[addr++]);
-                break;
-            case ZERO_PAGE_Y:
-                snprintf(operands, sizeof(operands), "$%02x, Y",
-                    proc->memory[addr++]);
-                break;
-            case ZERO_PAGE:
-                snprintf(operands, sizeof(operands), "$%02x",
-                    proc->memory[addr++]);
-                break;
-            case INDIRECT:
-                snprintf(operands, sizeof(operands), "($%04x)",
-                    proc->memory[addr] | (proc->memory[addr + 1] << 8));
-                addr += 2;
-                break;
-            case RELATIVE:
-                snprintf(operands, sizeof(operands), "%04x",
-                    addr + 1 + (int8_t) proc->memory[addr]);
-                addr++;
-                break;
+        uint8_t opcode = peek_mem_u8(proc, addr++);
+        int operand_bytes = operand_length(INSTRUCTIONS[opcode].mode);
+        uint16_t operand = 0;
+        for (int i = 0; i < operand_bytes; i++) {
+            operand |= peek_mem_u8(proc, addr++) << (8 * i);
         }
 
         char line[128];
         snprintf(line, sizeof(line), "%c%04x", start_addr == proc->pc ? '>' : ' ', start_addr);
         for (int i = start_addr; i < addr; i++) {
             snprintf(line + strlen(line), sizeof(line) - strlen(line), " %02x",
-                proc->memory[i]);
+                peek_mem_u8(proc, i));
         }
 
         while (strlen(line) < 20) {
             strcat(line, " ");
         }
 
-        snprintf(line + strlen(line), sizeof(line) - strlen(line),
-            " %s %s", inst->mnemonic, operands);
+        strcat(line, " ");
+        format_inst(line + strlen(line), sizeof(line) - strlen(line),
+            start_addr, opcode, operand);
         printf("%s\n", line);
     }
 
@@ -561,12 +1834,12 @@ void dump_memory(struct m6502 *proc, uint16_t base_addr, int length) {
     for (int row_offset = 0; row_offset < length; row_offset += 16) {
         printf("%04x ", base_addr + row_offset);
         for (int i = 0; i < BYTES_PER_ROW; i++) {
-            printf("%02x ", proc->memory[base_addr + row_offset + i]);
+            printf("%02x ", peek_mem_u8(proc, base_addr + row_offset + i));
         }
 
         printf("    ");
         for (int i = 0; i < BYTES_PER_ROW; i++) {
-            uint8_t val = proc->memory[base_addr + row_offset + i];
+            uint8_t val = peek_mem_u8(proc, base_addr + row_offset + i);
             if (val >= 32 && val <= 127) {
                 printf("%c", val);
             } else {
@@ -17,9 +17,106 @@
 #ifndef __6502_CORE_H
 #define __6502_CORE_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "6502-condition.h"
 
 #define MEM_SIZE 0x10000
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define NUM_PAGES (MEM_SIZE >> PAGE_SHIFT)
+
+// Writing a byte to this address prints it.
+#define CONSOLE_OUT 0xfffa
+
+// Address of the initial program counter (see reset_proc)
+#define RESET_VECTOR 0xfffc
+
+// Flags for map_memory and load_image
+#define MAP_READ_ONLY 1
+
+// Set in page_mapping flags by fork_proc for pages that are shared with
+// another processor and must be copied before they are written.
+#define MAP_COPY_ON_WRITE 2
+
+// Status register bits
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_UNUSED 0x20 // Always reads as 1
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+// Why run_instructions returned. While the emulator is running,
+// proc->halt is STOP_NONE; anything that stops it sets the reason there.
+enum stop_reason {
+    STOP_NONE,
+    STOP_BUDGET,    // Executed the requested number of instructions
+    STOP_BRK,
+    STOP_INVALID,   // Undefined opcode
+    STOP_MMIO,      // I/O write with exit_on_mmio set
+    STOP_BREAKPOINT,    // About to execute an instruction with a breakpoint
+    STOP_WATCHPOINT     // Accessed a watched address (see watch_hit)
+};
+
+struct m6502;
+struct console;
+struct decoded_inst;
+struct jit_state;
+struct shared_page;
+struct symbol;
+struct trace;
+
+// Device handlers for a page. They return 1 if they handled the access,
+// or 0 to have it go to the page's memory, which allows a device to
+// occupy only part of a page.
+typedef int (*mem_read_handler)(struct m6502 *proc, uint16_t addr,
+                                uint8_t *value, void *context);
+typedef int (*mem_write_handler)(struct m6502 *proc, uint16_t addr,
+                                 uint8_t value, void *context);
+
+struct page_mapping {
+    uint8_t *memory;    // Host memory for the page, NULL if unmapped
+    int flags;
+    struct shared_page *shared; // Reference counted memory (see fork_proc)
+    mem_read_handler read;
+    mem_write_handler write;
+    void *context;
+};
+
+// A breakpoint's settings (see set_breakpoint). It stops when reached
+// with the condition true, once ignore is zero. Running instructions
+// again to go back in time (see 6502-history.c) doesn't count.
+struct breakpoint {
+    uint16_t addr;
+    struct condition condition;
+    uint64_t hits;      // Times reached with the condition true
+    uint64_t ignore;    // Hits left to run through without stopping
+};
+
+#define MAX_WATCHPOINTS 16
+
+// Flags for add_watchpoint
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+
+struct watchpoint {
+    uint16_t start;
+    uint16_t end;   // Inclusive
+    int flags;
+};
+
+// The access that stopped the emulator with STOP_WATCHPOINT. Writes are
+// completed first, so the instruction has finished and pc is after it.
+struct watch_hit {
+    uint16_t pc;        // The instruction that made the access
+    uint16_t addr;
+    int flags;          // WATCH_READ or WATCH_WRITE
+    uint8_t old_value;  // For reads, both are the value read
+    uint8_t new_value;
+};
 
 struct m6502 {
     int8_t a;
@@ -28,21 +125,253 @@ struct m6502 {
     uint16_t s;
     uint16_t pc;
 
-    // flags
-    uint8_t n : 1;
-    uint8_t v : 1;
-    uint8_t b : 1;
-    uint8_t d : 1;
-    uint8_t i : 1;
-    uint8_t z : 1;
-    uint8_t c : 1;
+    // N, Z, C, and V are evaluated lazily from the results that set them
+    // (use get_flag/set_flag to access them):
+    //   nz_result  Z if the low byte is zero, N if bit 7 of either byte is
+    //              set (which allows N and Z to be set at the same time)
+    //   c_result   C is bit 8
+    //   v_result   V is bit 7
+    // The rest of the flags are kept in their status register positions
+    // in p. The N, Z, C, and V bits of p are unused.
+    uint16_t nz_result;
+    uint16_t c_result;
+    uint8_t v_result;
+    uint8_t p;
 
     uint8_t *memory;
     int halt;
+    uint64_t instructions;  // Total executed by run_instructions
+    uint64_t cycles;        // Emulated clock cycles
+
+    // If set, writes to the console port stop the emulator with STOP_MMIO
+    // rather than being printed, and are left here for the caller.
+    int exit_on_mmio;
+    uint16_t mmio_addr;
+    uint8_t mmio_value;
+
+    // Where writes to the console port go (see 6502-console.h). init_proc
+    // opens one on standard output. Callers can replace it, e.g. to
+    // collect the output in memory, and must close the old one.
+    struct console *console;
+
+    // Page table. Accesses to a page use the host memory in read_map or
+    // write_map directly if it is set. Otherwise they go through the page
+    // mapping, which may call device handlers, ignore writes to ROM, copy
+    // shared pages, or invalidate cached code. ram_map is like write_map,
+    // but also has RAM pages that hold cached code. Use
+    // map_memory/map_handlers to change these.
+    uint8_t *read_map[NUM_PAGES];
+    uint8_t *write_map[NUM_PAGES];
+    uint8_t *ram_map[NUM_PAGES];
+    struct page_mapping pages[NUM_PAGES];
+
+    // Cache of decoded instructions, one array of PAGE_SIZE entries per
+    // page, allocated when code first runs there. code_pages has a bit
+    // set for each page that holds the bytes of a cached instruction, so
+    // writes to it can invalidate them. Those pages are removed from
+    // write_map.
+    struct decoded_inst *decode_cache[NUM_PAGES];
+    uint32_t decode_generation;
+    uint32_t code_pages[NUM_PAGES / 32];
+
+    // Pages written since clear_dirty_pages, one bit per page, if
+    // track_dirty is set.
+    uint32_t dirty_pages[NUM_PAGES / 32];
+    int track_dirty;
+
+    // Identifies the last save state written or loaded, which a delta
+    // state must follow (see save_delta).
+    uint64_t checkpoint_id;
+
+    // Translated code, if the JIT is enabled (see 6502-jit.c). NULL runs
+    // everything through the interpreter.
+    struct jit_state *jit;
+
+    // If set, every instruction is recorded (see start_trace)
+    struct trace *trace;
+
+    // One bit per address to stop at before executing, or NULL if there
+    // are no breakpoints (see set_breakpoint), so most addresses are
+    // checked without looking at breakpoint_list. After stopping at one,
+    // breakpoint_pc is its address, so running again starts by executing
+    // that instruction rather than stopping again. Otherwise it is -1.
+    uint32_t *breakpoints;
+    struct breakpoint *breakpoint_list;
+    int num_breakpoints;
+    int max_breakpoints;
+    int breakpoint_pc;
+
+    // Address ranges to stop at when accessed (see add_watchpoint).
+    // read_watch_pages and write_watch_pages have a bit set for each page
+    // a watchpoint covers. Those are kept out of read_map or write_map, so
+    // other pages don't pay for checking the ranges.
+    struct watchpoint watchpoints[MAX_WATCHPOINTS];
+    int num_watchpoints;
+    uint32_t read_watch_pages[NUM_PAGES / 32];
+    uint32_t write_watch_pages[NUM_PAGES / 32];
+    struct watch_hit watch_hit;
+
+#ifdef ENABLE_PROFILE
+    // If set, executions and memory accesses are counted (see
+    // start_profile)
+    struct profile *profile;
+#endif
+};
+
+#ifdef ENABLE_PROFILE
+// A subroutine called by way of a particular path of other subroutines,
+// in the call tree built by JSR and RTS (see 6502-profile.c). Counts are
+// only for the subroutine itself, not the ones it calls.
+struct call_node {
+    uint16_t addr;
+    int parent;         // Index in calls, -1 for the root
+    int first_child;    // -1 if none
+    int next_sibling;
+    uint64_t calls;
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+// A JSR that hasn't returned yet, with the stack pointer after it pushed
+// the return address
+struct call_frame {
+    uint8_t s;
+    int node;
+};
+
+#define MAX_CALL_DEPTH 256
+
+// Execution counts, collected when built with PROFILE=1. Page reads and
+// writes are data accesses; instruction fetches aren't counted.
+struct profile {
+    uint64_t opcodes[256];
+    uint64_t addresses[MEM_SIZE];
+    uint64_t page_reads[NUM_PAGES];
+    uint64_t page_writes[NUM_PAGES];
+
+    // Call tree. The root, at index 0, is whatever was running when
+    // profiling started.
+    struct call_node *calls;
+    int num_calls;
+    int max_calls;
+    int current_call;
+    struct call_frame call_stack[MAX_CALL_DEPTH];
+    int call_depth;
+
+    // Names for addresses, sorted by address (see load_symbols)
+    struct symbol *symbols;
+    int num_symbols;
 };
 
+#endif
+
+// The registers, counts, and RAM of a processor at some point, to go back
+// to later (see take_snapshot). RAM pages are shared with the processor
+// the same way as with fork_proc, so this only costs memory for pages
+// that change afterwards.
+struct snapshot {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint16_t s;
+    uint16_t pc;
+    uint16_t nz_result;
+    uint16_t c_result;
+    int8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t v_result;
+    uint8_t p;
+    struct shared_page *pages[NUM_PAGES];   // NULL if not RAM
+};
+
+static inline int is_breakpoint(const struct m6502 *proc, uint16_t addr) {
+    return proc->breakpoints
+        && (proc->breakpoints[addr / 32] >> (addr % 32)) & 1;
+}
+
+static inline int get_flag(const struct m6502 *proc, int flag) {
+    switch (flag) {
+        case FLAG_C: return proc->c_result >> 8;
+        case FLAG_Z: return (proc->nz_result & 0xff) == 0;
+        case FLAG_I:
+        case FLAG_D:
+        case FLAG_B:
+            return (proc->p & flag) != 0;
+        case FLAG_V: return proc->v_result >> 7;
+        case FLAG_N: return ((proc->nz_result | (proc->nz_result >> 8)) >> 7) & 1;
+        default: return 0;
+    }
+}
+
+static inline void set_flag(struct m6502 *proc, int flag, int value) {
+    value = value != 0;
+    switch (flag) {
+        case FLAG_C: proc->c_result = value << 8; break;
+        case FLAG_Z:
+            proc->nz_result = (get_flag(proc, FLAG_N) << 15) | !value;
+            break;
+        case FLAG_I:
+        case FLAG_D:
+        case FLAG_B:
+            proc->p = (proc->p & ~flag) | (value ? flag : 0);
+            break;
+        case FLAG_V: proc->v_result = value << 7; break;
+        case FLAG_N:
+            proc->nz_result = (value << 15) | !get_flag(proc, FLAG_Z);
+            break;
+    }
+}
+
+// The status register as pushed on the stack, packed into one byte.
+static inline uint8_t get_status(const struct m6502 *proc) {
+    return (proc->p & (FLAG_I | FLAG_D | FLAG_B)) | FLAG_UNUSED
+        | ((proc->nz_result | (proc->nz_result >> 8)) & FLAG_N)
+        | ((proc->v_result >> 1) & FLAG_V)
+        | (((proc->nz_result & 0xff) == 0) << 1)
+        | (proc->c_result >> 8);
+}
+
+static inline void set_status(struct m6502 *proc, uint8_t status) {
+    proc->p = status & (FLAG_I | FLAG_D | FLAG_B);
+    proc->nz_result = ((status & FLAG_N) << 8) | !(status & FLAG_Z);
+    proc->c_result = (status & FLAG_C) << 8;
+    proc->v_result = (status & FLAG_V) << 1;
+}
+
 void init_proc(struct m6502 *proc);
-void run_emulator(struct m6502 *proc, int steps);
+void fork_proc(struct m6502 *child, struct m6502 *parent);
+void free_proc(struct m6502 *proc);
+void take_snapshot(struct m6502 *proc, struct snapshot *snapshot);
+void restore_snapshot(struct m6502 *proc, const struct snapshot *snapshot);
+void free_snapshot(struct snapshot *snapshot);
+void reset_proc(struct m6502 *proc);
+int load_image(struct m6502 *proc, const char *filename, uint16_t load_addr,
+               int flags);
+int save_state(struct m6502 *proc, const char *filename);
+int save_delta(struct m6502 *proc, const char *filename);
+int load_state(struct m6502 *proc, const char *filename);
+void run_emulator(struct m6502 *proc, int single_step);
+enum stop_reason run_instructions(struct m6502 *proc, uint64_t budget);
+enum stop_reason run_cycles(struct m6502 *proc, uint64_t budget);
+void flush_decode_cache(struct m6502 *proc);
+void mark_code_page(struct m6502 *proc, int page);
+void clear_dirty_pages(struct m6502 *proc);
+int set_breakpoint(struct m6502 *proc, uint16_t addr);
+int clear_breakpoint(struct m6502 *proc, uint16_t addr);
+struct breakpoint *find_breakpoint(struct m6502 *proc, uint16_t addr);
+int add_watchpoint(struct m6502 *proc, uint16_t start, uint16_t end,
+                   int flags);
+int remove_watchpoint(struct m6502 *proc, uint16_t start);
+void map_memory(struct m6502 *proc, int first_page, int num_pages,
+                uint8_t *memory, int flags);
+void map_handlers(struct m6502 *proc, int first_page, int num_pages,
+                  mem_read_handler read, mem_write_handler write,
+                  void *context);
+int execute_inst(struct m6502 *proc);
+uint8_t read_mem_u8(struct m6502 *proc, uint16_t addr);
+void write_mem_u8(struct m6502 *proc, uint16_t addr, uint8_t val);
+void format_inst(char *buf, size_t size, uint16_t addr, uint8_t opcode,
+                 uint16_t operand);
 int disassemble(struct m6502 *proc, uint16_t base_addr, int length);
 void dump_memory(struct m6502 *proc, uint16_t base_addr, int length);
 void dump_regs(struct m6502 *proc);
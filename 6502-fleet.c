@@ -0,0 +1,211 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Runs many independent processors on a pool of threads. Instances don't
+// share any state, so any thread can run any instance, as long as only one
+// does at a time.
+//
+// Each worker has a queue of instances. It runs the one at the front for a
+// slice, then puts it at the back if it hasn't stopped. A worker whose
+// queue is empty takes an instance from the back of another worker's
+// queue. When there is nothing to take, every unfinished instance is
+// being run by some other worker, which will keep running it, so the
+// worker exits.
+//
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "6502-console.h"
+#include "6502-fleet.h"
+
+struct run_queue {
+    pthread_mutex_t lock;
+    int *entries;   // Circular buffer of instance indices
+    int head;
+    int count;
+    int capacity;
+};
+
+struct worker {
+    pthread_t thread;
+    struct run_queue queue;
+    struct fleet_run *run;
+    int index;
+};
+
+struct fleet_run {
+    struct fleet_instance *instances;
+    struct worker *workers;
+    int num_workers;
+    uint64_t slice;
+    uint64_t max_instructions;
+};
+
+void init_instance(struct fleet_instance *instance, const char *name) {
+    init_proc(&instance->proc);
+    close_console(instance->proc.console);
+    instance->proc.console = open_console(-1, 0);
+    instance->name = name;
+    instance->result = STOP_NONE;
+}
+
+// fork_proc opens the child's console like the parent's, so it captures
+// its own output too.
+void fork_instance(struct fleet_instance *instance,
+                   struct fleet_instance *parent, const char *name) {
+    fork_proc(&instance->proc, &parent->proc);
+    instance->name = name;
+    instance->result = STOP_NONE;
+}
+
+void free_instance(struct fleet_instance *instance) {
+    free_proc(&instance->proc);
+}
+
+// A queue never holds more than all of the instances, so it can't fill.
+static void push_back(struct run_queue *queue, int index) {
+    pthread_mutex_lock(&queue->lock);
+    queue->entries[(queue->head + queue->count++) % queue->capacity] = index;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Returns -1 if the queue is empty.
+static int pop_front(struct run_queue *queue) {
+    int index = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        index = queue->entries[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return index;
+}
+
+// Taking from the back leaves the owner the instances it is about to
+// run, which are more likely to still be in its cache.
+static int pop_back(struct run_queue *queue) {
+    int index = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        index = queue->entries[(queue->head + queue->count) % queue->capacity];
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return index;
+}
+
+static int steal(struct worker *worker) {
+    struct fleet_run *run = worker->run;
+    for (int i = 1; i < run->num_workers; i++) {
+        struct worker *victim
+            = &run->workers[(worker->index + i) % run->num_workers];
+        int index = pop_back(&victim->queue);
+        if (index >= 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *worker = arg;
+    struct fleet_run *run = worker->run;
+    while (1) {
+        int index = pop_front(&worker->queue);
+        if (index < 0) {
+            index = steal(worker);
+            if (index < 0) {
+                break;
+            }
+        }
+
+        struct fleet_instance *instance = &run->instances[index];
+        uint64_t budget = run->slice;
+        if (run->max_instructions) {
+            if (instance->proc.instructions >= run->max_instructions) {
+                instance->result = STOP_BUDGET;
+                continue;
+            }
+
+            uint64_t left = run->max_instructions
+                - instance->proc.instructions;
+            if (left < budget) {
+                budget = left;
+            }
+        }
+
+        enum stop_reason reason = run_instructions(&instance->proc, budget);
+        if (reason == STOP_BUDGET) {
+            push_back(&worker->queue, index);
+        } else {
+            instance->result = reason;
+        }
+    }
+
+    return NULL;
+}
+
+void run_fleet(struct fleet_instance *instances, int num_instances,
+               int num_threads, uint64_t slice, uint64_t max_instructions) {
+    struct fleet_run run;
+    run.instances = instances;
+    run.workers = calloc(num_threads, sizeof(struct worker));
+    run.num_workers = num_threads;
+    run.slice = slice;
+    run.max_instructions = max_instructions;
+
+    for (int i = 0; i < num_threads; i++) {
+        struct worker *worker = &run.workers[i];
+        worker->run = &run;
+        worker->index = i;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        worker->queue.entries = calloc(num_instances, sizeof(int));
+        worker->queue.capacity = num_instances;
+    }
+
+    for (int i = 0; i < num_instances; i++) {
+        if (instances[i].result == STOP_NONE) {
+            push_back(&run.workers[i % num_threads].queue, i);
+        }
+    }
+
+    // If a thread can't be created, the others will take its instances.
+    int *started = calloc(num_threads, sizeof(int));
+    for (int i = 1; i < num_threads; i++) {
+        started[i] = pthread_create(&run.workers[i].thread, NULL,
+            worker_thread, &run.workers[i]) == 0;
+    }
+
+    worker_thread(&run.workers[0]);
+    for (int i = 1; i < num_threads; i++) {
+        if (started[i]) {
+            pthread_join(run.workers[i].thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_destroy(&run.workers[i].queue.lock);
+        free(run.workers[i].queue.entries);
+    }
+
+    free(started);
+    free(run.workers);
+}
@@ -0,0 +1,50 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_FLEET_H
+#define __6502_FLEET_H
+
+#include "6502-core.h"
+
+// One of many independent processors run by run_fleet.
+struct fleet_instance {
+    struct m6502 proc;
+    const char *name;           // For the caller, e.g. the image filename
+    enum stop_reason result;    // STOP_NONE until the instance finishes
+};
+
+// Initialize the processor, with a console that keeps its output in
+// memory (read it with console_output). The caller then loads a program
+// into instance->proc.
+void init_instance(struct fleet_instance *instance, const char *name);
+
+// Start an instance as a copy of parent, which hasn't been run yet, that
+// shares its memory (see fork_proc). It captures its own console output.
+void fork_instance(struct fleet_instance *instance,
+                   struct fleet_instance *parent, const char *name);
+
+// Release the processor, including the captured output.
+void free_instance(struct fleet_instance *instance);
+
+// Run every instance until it stops, on num_threads threads, including
+// the calling one. Each thread takes turns running its instances for
+// slice instructions at a time, and takes instances from other threads
+// when it runs out. If max_instructions is not zero, instances that
+// execute that many instructions are stopped with STOP_BUDGET.
+void run_fleet(struct fleet_instance *instances, int num_instances,
+               int num_threads, uint64_t slice, uint64_t max_instructions);
+
+#endif
@@ -0,0 +1,274 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Time travel for the monitor. Execution is deterministic, so any earlier
+// state can be reached by restoring the last snapshot before it and
+// running forward. Snapshots are taken when the instruction count reaches
+// a multiple of the interval, so this never runs more than interval
+// instructions. A snapshot shares RAM pages with the processor (see
+// take_snapshot), so it only costs memory for the pages written before
+// the next one.
+//
+// This relies on nothing other than instructions changing the processor
+// between snapshots. Callers that change it otherwise use restart_history.
+//
+
+#include <stdlib.h>
+#include "6502-history.h"
+
+static struct snapshot *get_snapshot(struct history *history, int index) {
+    return &history->snapshots[(history->first + index) % history->capacity];
+}
+
+// The last snapshot at or before the given count, or NULL if there isn't
+// one.
+static struct snapshot *find_snapshot(struct history *history,
+                                      uint64_t instructions) {
+    for (int i = history->count - 1; i >= 0; i--) {
+        struct snapshot *snapshot = get_snapshot(history, i);
+        if (snapshot->instructions <= instructions) {
+            return snapshot;
+        }
+    }
+
+    return NULL;
+}
+
+// Snapshots are kept in order, so only take one past the newest. Earlier
+// ones are either already there, or were dropped to make room.
+static void add_snapshot(struct history *history, struct m6502 *proc) {
+    if (history->count > 0 && get_snapshot(history, history->count - 1)
+            ->instructions >= proc->instructions) {
+        return;
+    }
+
+    if (history->count == history->capacity) {
+        free_snapshot(get_snapshot(history, 0));
+        history->first = (history->first + 1) % history->capacity;
+        history->count--;
+    }
+
+    take_snapshot(proc, get_snapshot(history, history->count++));
+}
+
+void init_history(struct history *history, uint64_t interval,
+                  int max_snapshots) {
+    history->capacity = max_snapshots > 0 ? max_snapshots : 1;
+    history->snapshots = calloc(history->capacity, sizeof(struct snapshot));
+    history->first = 0;
+    history->count = 0;
+    history->interval = interval > 0 ? interval : 1;
+    history->furthest = 0;
+    history->replaying = 0;
+}
+
+void free_history(struct history *history) {
+    clear_history(history);
+    free(history->snapshots);
+}
+
+void clear_history(struct history *history) {
+    for (int i = 0; i < history->count; i++) {
+        free_snapshot(get_snapshot(history, i));
+    }
+
+    history->first = 0;
+    history->count = 0;
+    history->furthest = 0;
+}
+
+void restart_history(struct history *history, struct m6502 *proc) {
+    while (history->count > 0 && get_snapshot(history, history->count - 1)
+            ->instructions >= proc->instructions) {
+        free_snapshot(get_snapshot(history, --history->count));
+    }
+
+    history->furthest = proc->instructions;
+    add_snapshot(history, proc);
+}
+
+enum stop_reason run_history(struct history *history, struct m6502 *proc,
+                             uint64_t budget) {
+    uint64_t end = proc->instructions + budget;
+    if (end < proc->instructions) {
+        end = UINT64_MAX;
+    }
+
+    while (1) {
+        uint64_t now = proc->instructions;
+        if (now % history->interval == 0) {
+            add_snapshot(history, proc);
+        }
+
+        if (now == end) {
+            return STOP_BUDGET;
+        }
+
+        // Stop at the next snapshot, the end, and where instructions
+        // start being new.
+        uint64_t stop = now - now % history->interval + history->interval;
+        if (now < history->furthest && history->furthest < stop) {
+            stop = history->furthest;
+        }
+
+        if (end < stop) {
+            stop = end;
+        }
+
+        history->replaying = now < history->furthest;
+        enum stop_reason reason = run_instructions(proc, stop - now);
+        history->replaying = 0;
+        if (proc->instructions > history->furthest) {
+            history->furthest = proc->instructions;
+        }
+
+        if (reason != STOP_BUDGET) {
+            return reason;
+        }
+    }
+}
+
+// Going back in time runs instructions again, which isn't reaching
+// breakpoints: it mustn't count hits or use up ignore counts. Hiding the
+// bitmap runs through them with the fast loop.
+static uint32_t *hide_breakpoints(struct m6502 *proc) {
+    uint32_t *breakpoints = proc->breakpoints;
+    proc->breakpoints = NULL;
+    return breakpoints;
+}
+
+// Arriving at a breakpoint this way is like stopping at it, so running
+// again starts by executing the instruction there.
+static void show_breakpoints(struct m6502 *proc, uint32_t *breakpoints) {
+    proc->breakpoints = breakpoints;
+    proc->breakpoint_pc = is_breakpoint(proc, proc->pc) ? proc->pc : -1;
+}
+
+static int seek(struct history *history, struct m6502 *proc,
+                uint64_t instructions) {
+    struct snapshot *snapshot = find_snapshot(history, instructions);
+    if (snapshot == NULL) {
+        return -1;
+    }
+
+    // Start from the current state if it is closer
+    if (instructions < proc->instructions
+            || snapshot->instructions > proc->instructions) {
+        restore_snapshot(proc, snapshot);
+    }
+
+    // Other stops, e.g. watchpoints, are run through too. halt is left
+    // set if the last instruction stopped.
+    proc->halt = STOP_NONE;
+    while (proc->instructions < instructions) {
+        uint64_t before = proc->instructions;
+        run_history(history, proc, instructions - before);
+        if (proc->instructions == before) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int seek_history(struct history *history, struct m6502 *proc,
+                 uint64_t instructions) {
+    uint32_t *breakpoints = hide_breakpoints(proc);
+    int result = seek(history, proc, instructions);
+    show_breakpoints(proc, breakpoints);
+    return result;
+}
+
+// Whether the processor is about to execute an instruction the search in
+// reverse_to is looking for: the one at addr, or if addr is -1, one with
+// a breakpoint whose condition is true. Ignore counts aren't checked, as
+// they only apply going forward. breakpoints is the hidden bitmap.
+static int is_target(struct m6502 *proc, int addr,
+                     const uint32_t *breakpoints) {
+    uint16_t pc = proc->pc;
+    if (addr >= 0) {
+        return pc == addr;
+    }
+
+    return breakpoints && (breakpoints[pc / 32] >> (pc % 32)) & 1
+        && eval_condition(proc, &find_breakpoint(proc, pc)->condition);
+}
+
+static int reverse_to(struct history *history, struct m6502 *proc,
+                      int addr, const uint32_t *breakpoints) {
+    if (history->count == 0) {
+        return -1;
+    }
+
+    // Search back one interval at a time, stepping through each to find
+    // the last time it reached the target.
+    uint64_t end = proc->instructions;
+    for (int i = history->count - 1; i >= 0; i--) {
+        struct snapshot *snapshot = get_snapshot(history, i);
+        if (snapshot->instructions >= end) {
+            continue;
+        }
+
+        restore_snapshot(proc, snapshot);
+        int found = 0;
+        uint64_t found_at = 0;
+        history->replaying = 1;
+        while (proc->instructions < end) {
+            if (is_target(proc, addr, breakpoints)) {
+                found = 1;
+                found_at = proc->instructions;
+            }
+
+            uint64_t before = proc->instructions;
+            run_instructions(proc, 1);
+            if (proc->instructions == before) {
+                break;
+            }
+        }
+
+        history->replaying = 0;
+        if (found) {
+            return seek(history, proc, found_at);
+        }
+
+        end = snapshot->instructions;
+    }
+
+    rewind_history(history, proc);
+    return -1;
+}
+
+int reverse_to_address(struct history *history, struct m6502 *proc,
+                       uint16_t addr) {
+    uint32_t *breakpoints = hide_breakpoints(proc);
+    int result = reverse_to(history, proc, addr, breakpoints);
+    show_breakpoints(proc, breakpoints);
+    return result;
+}
+
+int reverse_to_breakpoint(struct history *history, struct m6502 *proc) {
+    uint32_t *breakpoints = hide_breakpoints(proc);
+    int result = reverse_to(history, proc, -1, breakpoints);
+    show_breakpoints(proc, breakpoints);
+    return result;
+}
+
+void rewind_history(struct history *history, struct m6502 *proc) {
+    if (history->count > 0) {
+        restore_snapshot(proc, get_snapshot(history, 0));
+    }
+}
@@ -0,0 +1,82 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_HISTORY_H
+#define __6502_HISTORY_H
+
+#include "6502-core.h"
+
+// Snapshots of a processor taken as it runs, to go back to an earlier
+// point (see 6502-history.c).
+struct history {
+    struct snapshot *snapshots; // Circular buffer, oldest first
+    int first;
+    int count;
+    int capacity;
+    uint64_t interval;  // Instructions between snapshots
+
+    // The most instructions the processor has run. Anything before this
+    // is being run again, which device handlers can check with replaying
+    // to avoid repeating output.
+    uint64_t furthest;
+    int replaying;
+};
+
+// Take a snapshot every interval instructions, keeping at most
+// max_snapshots. Going back costs running up to interval instructions,
+// and only as far back as the oldest snapshot kept.
+void init_history(struct history *history, uint64_t interval,
+                  int max_snapshots);
+void free_history(struct history *history);
+
+// Forget all snapshots, e.g. after loading a different state.
+void clear_history(struct history *history);
+
+// Call after changing the processor other than by running it, e.g.
+// setting memory or registers. Anything after this point no longer
+// follows from it, so it is forgotten, and a snapshot of the current
+// state is taken.
+void restart_history(struct history *history, struct m6502 *proc);
+
+// Like run_instructions, also taking snapshots.
+enum stop_reason run_history(struct history *history, struct m6502 *proc,
+                             uint64_t budget);
+
+// Go to the state after the given number of instructions, earlier or
+// later than now. Stops along the way (e.g. watchpoints) are run
+// through, and breakpoints are passed without counting as hits. Returns 0
+// on success, or -1 if it is before the oldest snapshot or the processor
+// stopped making progress. Running from a breakpoint it ends at executes
+// that instruction rather than stopping there. proc->halt is the reason
+// the instruction before the new state stopped, e.g. STOP_WATCHPOINT, or
+// STOP_NONE if it didn't.
+int seek_history(struct history *history, struct m6502 *proc,
+                 uint64_t instructions);
+
+// Go back to the last time the processor was about to execute the
+// instruction at addr. If it didn't in the history kept, go to the oldest
+// snapshot and return -1.
+int reverse_to_address(struct history *history, struct m6502 *proc,
+                       uint16_t addr);
+
+// Like reverse_to_address, for the last time it was about to execute an
+// instruction with a breakpoint whose condition is true.
+int reverse_to_breakpoint(struct history *history, struct m6502 *proc);
+
+// Go back to the oldest snapshot.
+void rewind_history(struct history *history, struct m6502 *proc);
+
+#endif
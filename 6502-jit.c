@@ -0,0 +1,1249 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Basic block translator to x86-64.
+//
+// jit_run interprets one instruction at a time, counting how often each
+// address is reached. Once an address gets hot, the straight line code
+// starting there is translated into a native block, which ends at the
+// first branch, jump, or instruction the translator doesn't handle. Blocks
+// exit back to jit_run with the next guest PC. When that PC is a constant
+// (branch targets, fall through), the exit jump is later patched to go
+// straight to the next block (chaining), so hot loops stay in native code.
+//
+// While a block runs, guest registers live in host callee-saved registers:
+//   rbx  struct m6502 *
+//   r12  A
+//   r13  X
+//   r14  Y
+//   rbp  N/Z, in the same form as nz_result in struct m6502
+//   r15  C (0 or 1)
+//   [rsp] V
+// and two more are used for accounting:
+//   r8   remaining instruction budget
+//   r9   cycles since entering native code
+// These are caller-saved, so they are preserved around calls out of
+// translated code.
+// Other flags aren't touched by translated code.
+//
+// Each block starts by checking that the instruction budget passed to
+// jit_run covers all of its instructions, and otherwise exits to have
+// them interpreted. Every exit subtracts the number of instructions that
+// actually ran on the path to it, so the count stays exact, and adds
+// their cycles. Only page crossing penalties for indexed reads are
+// counted as the block runs; the rest are known when translating.
+//
+// Loads and stores look up the page table, and call read_mem_u8 or
+// write_mem_u8 for pages that can't be accessed directly: devices, ROM,
+// and pages holding translated code. If a store modifies a translated
+// byte, all blocks are discarded and the current one exits. As long as
+// every page reads directly from proc->memory (the usual case), loads
+// skip the lookup.
+//
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "6502-jit.h"
+#include "instructions.h"
+
+#define CODE_BUFFER_SIZE 0x400000
+#define MAX_BLOCK_CODE 0x4000
+#define MAX_BLOCK_INSTS 64
+#define MAX_CHAIN_SLOTS 0x10000
+#define HOT_THRESHOLD 32
+#define EXIT_INTERPRET 0xffffffffu
+
+enum host_reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    NO_INDEX = -1
+};
+
+#define REG_PROC RBX
+#define REG_A R12
+#define REG_X R13
+#define REG_Y R14
+#define REG_NZ RBP
+#define REG_C R15
+#define REG_BUDGET R8
+#define REG_CYCLES R9
+
+// Stack frame set up by the entry stub
+#define FRAME_V 0
+#define FRAME_REGS 8
+#define FRAME_FLUSHED 16
+#define FRAME_SIZE 24
+
+// x86 opcodes. Two byte opcodes have the 0x0f escape in the high byte.
+#define X86_OR8 0x08
+#define X86_ADD 0x01
+#define X86_OR 0x09
+#define X86_AND 0x21
+#define X86_SUB 0x29
+#define X86_XOR 0x31
+#define X86_CMP 0x39
+#define X86_TEST 0x85
+#define X86_MOV_STORE8 0x88
+#define X86_MOV_STORE 0x89
+#define X86_MOV_LOAD 0x8b
+#define X86_MOVZX8 0x0fb6
+#define X86_MOVZX16 0x0fb7
+
+// Extensions in the reg field of group opcodes
+#define EXT_ADD 0
+#define EXT_ADC 2
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_XOR 6
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+#define EXT_INC 0
+#define EXT_DEC 1
+#define EXT_CALL 2
+#define EXT_JMP 4
+
+// Condition codes for jcc
+#define CC_C 0x2
+#define CC_NC 0x3
+#define CC_Z 0x4
+#define CC_NZ 0x5
+
+enum jit_op {
+    OP_UNSUPPORTED,
+    OP_LDA, OP_LDX, OP_LDY, OP_STA, OP_STX, OP_STY,
+    OP_ADC, OP_SBC, OP_CMP, OP_CPX, OP_CPY,
+    OP_AND, OP_ORA, OP_EOR, OP_BIT,
+    OP_ASL, OP_LSR, OP_ROL, OP_ROR, OP_INC, OP_DEC,
+    OP_INX, OP_INY, OP_DEX, OP_DEY,
+    OP_TAX, OP_TXA, OP_TAY, OP_TYA, OP_TSX, OP_TXS,
+    OP_PHA, OP_PLA, OP_CLC, OP_SEC, OP_CLV, OP_NOP,
+    OP_BCC, OP_BCS, OP_BEQ, OP_BNE, OP_BMI, OP_BPL, OP_BVC, OP_BVS,
+    OP_JMP, OP_JSR, OP_RTS,
+    NUM_JIT_OPS
+};
+
+static const char * const OP_NAMES[NUM_JIT_OPS] = {
+    NULL,
+    "LDA", "LDX", "LDY", "STA", "STX", "STY",
+    "ADC", "SBC", "CMP", "CPX", "CPY",
+    "AND", "ORA", "EOR", "BIT",
+    "ASL", "LSR", "ROL", "ROR", "INC", "DEC",
+    "INX", "INY", "DEX", "DEY",
+    "TAX", "TXA", "TAY", "TYA", "TSX", "TXS",
+    "PHA", "PLA", "CLC", "SEC", "CLV", "NOP",
+    "BCC", "BCS", "BEQ", "BNE", "BMI", "BPL", "BVC", "BVS",
+    "JMP", "JSR", "RTS"
+};
+
+// Guest registers while they are outside the host registers.
+struct jit_regs {
+    uint32_t a;
+    uint32_t x;
+    uint32_t y;
+    uint32_t nz;
+    uint32_t c;
+    uint32_t v;
+    uint64_t budget;
+};
+
+// A block exit that jumps to a constant guest PC, which can be patched to
+// jump directly to the block for that PC once it exists.
+struct chain_slot {
+    uint8_t *jump;
+    uint16_t target_pc;
+};
+
+typedef uint64_t (*jit_entry_func)(struct m6502 *proc, const void *block,
+    struct jit_regs *regs);
+
+struct jit_state {
+    uint8_t *code;
+    uint8_t *code_ptr;
+    uint8_t *blocks_start;
+    jit_entry_func enter;
+    uint8_t *exit_stub;
+    unsigned int flush_count;
+
+    uint8_t ops[256];
+    void *blocks[MEM_SIZE];
+    uint8_t counts[MEM_SIZE];
+    uint32_t code_bytes[MEM_SIZE / 32];
+    uint16_t block_pcs[MEM_SIZE];
+    int num_blocks;
+    struct chain_slot slots[MAX_CHAIN_SLOTS];
+    int num_slots;
+    int direct_reads;
+
+    // Guest instructions in the current block that have completed when
+    // the code being emitted runs, and their base cycles. inst_cycles is
+    // the part of that for the instruction being translated.
+    int insts_done;
+    int cycles_done;
+    int inst_cycles;
+};
+
+//
+// Instruction encoding
+//
+static void emit8(struct jit_state *jit, uint8_t value) {
+    *jit->code_ptr++ = value;
+}
+
+static void emit32(struct jit_state *jit, uint32_t value) {
+    memcpy(jit->code_ptr, &value, sizeof(value));
+    jit->code_ptr += sizeof(value);
+}
+
+static void emit64(struct jit_state *jit, uint64_t value) {
+    memcpy(jit->code_ptr, &value, sizeof(value));
+    jit->code_ptr += sizeof(value);
+}
+
+// The REX prefix is needed for 64-bit operands and registers r8-r15. It
+// must also be present to address spl/bpl/sil/dil as byte registers
+// (without it, those encodings mean ah/ch/dh/bh).
+static void emit_rex(struct jit_state *jit, int wide, int reg, int index,
+                     int base, int byte_regs) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >= 8) << 2)
+        | ((index >= 8) << 1) | (base >= 8);
+    if (rex != 0x40 || byte_regs) {
+        emit8(jit, rex);
+    }
+}
+
+static void emit_opcode(struct jit_state *jit, unsigned int opcode) {
+    if (opcode > 0xff) {
+        emit8(jit, opcode >> 8);
+    }
+
+    emit8(jit, opcode & 0xff);
+}
+
+// opcode reg, rm (both registers). reg may be an opcode extension.
+static void emit_op_rr(struct jit_state *jit, int wide, unsigned int opcode,
+                       int reg, int rm, int byte_regs) {
+    emit_rex(jit, wide, reg, NO_INDEX, rm, byte_regs);
+    emit_opcode(jit, opcode);
+    emit8(jit, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// opcode reg, [base + index + disp]. Always uses a 32-bit displacement,
+// which avoids the special cases for rbp/r13 as a base.
+static void emit_op_rm(struct jit_state *jit, int wide, unsigned int opcode,
+                       int reg, int base, int index, int32_t disp,
+                       int byte_regs) {
+    emit_rex(jit, wide, reg, index, base, byte_regs);
+    emit_opcode(jit, opcode);
+    if (index == NO_INDEX && (base & 7) != RSP) {
+        emit8(jit, 0x80 | (reg & 7) << 3 | (base & 7));
+    } else {
+        emit8(jit, 0x84 | (reg & 7) << 3);
+        emit8(jit, ((index == NO_INDEX ? RSP : index) & 7) << 3 | (base & 7));
+    }
+
+    emit32(jit, disp);
+}
+
+static void emit_mov_rr(struct jit_state *jit, int dest, int src) {
+    emit_op_rr(jit, 0, X86_MOV_STORE, src, dest, 0);
+}
+
+static void emit_alu_rr(struct jit_state *jit, unsigned int opcode, int dest,
+                        int src) {
+    emit_op_rr(jit, 0, opcode, src, dest, 0);
+}
+
+// Zero extend the low byte of src into dest
+static void emit_movzx8(struct jit_state *jit, int dest, int src) {
+    emit_op_rr(jit, 0, X86_MOVZX8, dest, src, 1);
+}
+
+static void emit_alu_ri(struct jit_state *jit, int ext, int dest,
+                        int32_t imm) {
+    if (imm >= -128 && imm <= 127) {
+        emit_op_rr(jit, 0, 0x83, ext, dest, 0);
+        emit8(jit, imm);
+    } else {
+        emit_op_rr(jit, 0, 0x81, ext, dest, 0);
+        emit32(jit, imm);
+    }
+}
+
+static void emit_shift_ri(struct jit_state *jit, int ext, int dest, int amount) {
+    emit_op_rr(jit, 0, 0xc1, ext, dest, 0);
+    emit8(jit, amount);
+}
+
+static void emit_mov_ri(struct jit_state *jit, int dest, uint32_t imm) {
+    emit_rex(jit, 0, 0, NO_INDEX, dest, 0);
+    emit8(jit, 0xb8 + (dest & 7));
+    emit32(jit, imm);
+}
+
+static void emit_test_ri(struct jit_state *jit, int reg, uint32_t imm) {
+    emit_op_rr(jit, 0, 0xf7, 0, reg, 0);
+    emit32(jit, imm);
+}
+
+static void emit_call(struct jit_state *jit, const void *func) {
+    emit_rex(jit, 1, 0, NO_INDEX, RAX, 0);
+    emit8(jit, 0xb8);
+    emit64(jit, (uint64_t) (uintptr_t) func);
+    emit_op_rr(jit, 0, 0xff, EXT_CALL, RAX, 0);
+}
+
+static void emit_push(struct jit_state *jit, int reg) {
+    emit_rex(jit, 0, 0, NO_INDEX, reg, 0);
+    emit8(jit, 0x50 + (reg & 7));
+}
+
+static void emit_pop(struct jit_state *jit, int reg) {
+    emit_rex(jit, 0, 0, NO_INDEX, reg, 0);
+    emit8(jit, 0x58 + (reg & 7));
+}
+
+// Jumps return the location of their 32-bit displacement, to be filled in
+// with set_jump_target.
+static uint8_t *emit_jcc(struct jit_state *jit, int cc) {
+    emit8(jit, 0x0f);
+    emit8(jit, 0x80 + cc);
+    uint8_t *disp = jit->code_ptr;
+    emit32(jit, 0);
+    return disp;
+}
+
+static uint8_t *emit_jmp(struct jit_state *jit) {
+    emit8(jit, 0xe9);
+    uint8_t *disp = jit->code_ptr;
+    emit32(jit, 0);
+    return disp;
+}
+
+static void set_jump_target(uint8_t *disp, const uint8_t *target) {
+    int32_t offset = target - (disp + 4);
+    memcpy(disp, &offset, sizeof(offset));
+}
+
+static void set_jump_here(struct jit_state *jit, uint8_t *disp) {
+    set_jump_target(disp, jit->code_ptr);
+}
+
+//
+// Entry and exit stubs, shared by all blocks.
+//
+// uint64_t enter(struct m6502 *proc, const void *block, struct jit_regs *regs)
+//
+// Blocks leave through the exit stub with the next guest PC in eax and
+// the (1 based) chain slot in edx, zero if it can't be chained, or
+// EXIT_INTERPRET if the instruction at that PC must be interpreted. Both
+// are returned to jit_run in a single value.
+//
+static void emit_stubs(struct jit_state *jit) {
+    static const int SAVED_REGS[] = { RBX, RBP, R12, R13, R14, R15 };
+    static const int GUEST_REGS[] = { REG_A, REG_X, REG_Y, REG_NZ, REG_C };
+
+    jit->enter = (jit_entry_func) jit->code_ptr;
+    for (int i = 0; i < 6; i++) {
+        emit_push(jit, SAVED_REGS[i]);
+    }
+
+    emit_op_rr(jit, 1, 0x83, EXT_SUB, RSP, 0);
+    emit8(jit, FRAME_SIZE);
+    emit_op_rm(jit, 1, X86_MOV_STORE, RDX, RSP, NO_INDEX, FRAME_REGS, 0);
+    emit_op_rr(jit, 1, X86_MOV_STORE, RDI, REG_PROC, 0);
+    for (int i = 0; i < 5; i++) {
+        emit_op_rm(jit, 0, X86_MOV_LOAD, GUEST_REGS[i], RDX, NO_INDEX,
+            i * sizeof(uint32_t), 0);
+    }
+
+    emit_op_rm(jit, 0, X86_MOV_LOAD, RAX, RDX, NO_INDEX,
+        offsetof(struct jit_regs, v), 0);
+    emit_op_rm(jit, 0, X86_MOV_STORE8, RAX, RSP, NO_INDEX, FRAME_V, 1);
+    emit_op_rm(jit, 1, X86_MOV_LOAD, REG_BUDGET, RDX, NO_INDEX,
+        offsetof(struct jit_regs, budget), 0);
+    emit_alu_rr(jit, X86_XOR, REG_CYCLES, REG_CYCLES);
+    emit_op_rr(jit, 0, 0xff, EXT_JMP, RSI, 0);
+
+    jit->exit_stub = jit->code_ptr;
+    emit_op_rm(jit, 1, X86_MOV_LOAD, RCX, RSP, NO_INDEX, FRAME_REGS, 0);
+    for (int i = 0; i < 5; i++) {
+        emit_op_rm(jit, 0, X86_MOV_STORE, GUEST_REGS[i], RCX, NO_INDEX,
+            i * sizeof(uint32_t), 0);
+    }
+
+    emit_op_rm(jit, 0, X86_MOVZX8, RSI, RSP, NO_INDEX, FRAME_V, 0);
+    emit_op_rm(jit, 0, X86_MOV_STORE, RSI, RCX, NO_INDEX,
+        offsetof(struct jit_regs, v), 0);
+    emit_op_rm(jit, 1, X86_MOV_STORE, REG_BUDGET, RCX, NO_INDEX,
+        offsetof(struct jit_regs, budget), 0);
+    emit_op_rm(jit, 1, X86_ADD, REG_CYCLES, REG_PROC, NO_INDEX,
+        offsetof(struct m6502, cycles), 0);
+    emit_op_rr(jit, 1, 0xc1, EXT_SHL, RDX, 0);
+    emit8(jit, 32);
+    emit_op_rr(jit, 1, X86_OR, RDX, RAX, 0);
+    emit_op_rr(jit, 1, 0x83, EXT_ADD, RSP, 0);
+    emit8(jit, FRAME_SIZE);
+    for (int i = 5; i >= 0; i--) {
+        emit_pop(jit, SAVED_REGS[i]);
+    }
+
+    emit8(jit, 0xc3);   // ret
+}
+
+//
+// Guest instruction translation
+//
+static void emit_charge_budget(struct jit_state *jit, int count, int cycles) {
+    if (count) {
+        emit_op_rr(jit, 1, 0x81, EXT_SUB, REG_BUDGET, 0);
+        emit32(jit, count);
+    }
+
+    if (cycles) {
+        emit_op_rr(jit, 1, 0x81, EXT_ADD, REG_CYCLES, 0);
+        emit32(jit, cycles);
+    }
+}
+
+// Exit before the instruction at pc, which hasn't started.
+static void emit_side_exit(struct jit_state *jit, uint16_t pc) {
+    emit_charge_budget(jit, jit->insts_done - 1,
+        jit->cycles_done - jit->inst_cycles);
+    emit_mov_ri(jit, RAX, pc);
+    emit_mov_ri(jit, RDX, EXIT_INTERPRET);
+    set_jump_target(emit_jmp(jit), jit->exit_stub);
+}
+
+static void emit_exit(struct jit_state *jit, uint16_t pc, int chain) {
+    emit_charge_budget(jit, jit->insts_done, jit->cycles_done);
+    emit_mov_ri(jit, RAX, pc);
+    if (chain && jit->num_slots < MAX_CHAIN_SLOTS) {
+        struct chain_slot *slot = &jit->slots[jit->num_slots++];
+        emit_mov_ri(jit, RDX, jit->num_slots);
+        slot->jump = emit_jmp(jit);
+        slot->target_pc = pc;
+        set_jump_target(slot->jump, jit->exit_stub);
+    } else {
+        emit_alu_rr(jit, X86_XOR, RDX, RDX);
+        set_jump_target(emit_jmp(jit), jit->exit_stub);
+    }
+}
+
+static void emit_load_memory_base(struct jit_state *jit) {
+    emit_op_rm(jit, 1, X86_MOV_LOAD, RDX, REG_PROC, NO_INDEX,
+        offsetof(struct m6502, memory), 0);
+}
+
+// rdx = the host memory for the page containing ecx in read_map or
+// write_map, setting ZF if there is none.
+static void emit_page_lookup(struct jit_state *jit, int map_offset) {
+    emit_mov_rr(jit, RDX, RCX);
+    emit_shift_ri(jit, EXT_SHR, RDX, PAGE_SHIFT);
+    emit_shift_ri(jit, EXT_SHL, RDX, 3);
+    emit_op_rm(jit, 1, X86_MOV_LOAD, RDX, REG_PROC, RDX, map_offset, 0);
+    emit_op_rr(jit, 1, X86_TEST, RDX, RDX, 0);
+}
+
+// dest = the guest byte at ecx. Clobbers rdx and rdi.
+static void emit_read_ecx(struct jit_state *jit, int dest) {
+    if (jit->direct_reads) {
+        emit_load_memory_base(jit);
+        emit_op_rm(jit, 0, X86_MOVZX8, dest, RDX, RCX, 0, 0);
+        return;
+    }
+
+    emit_page_lookup(jit, offsetof(struct m6502, read_map));
+    uint8_t *slow_path = emit_jcc(jit, CC_Z);
+    emit_movzx8(jit, RDI, RCX);
+    emit_op_rm(jit, 0, X86_MOVZX8, dest, RDX, RDI, 0, 0);
+    uint8_t *done = emit_jmp(jit);
+
+    set_jump_here(jit, slow_path);
+    emit_push(jit, RCX);
+    emit_push(jit, RSI);
+    emit_push(jit, REG_BUDGET);
+    emit_push(jit, REG_CYCLES);
+    emit_op_rr(jit, 1, X86_MOV_STORE, REG_PROC, RDI, 0);
+    emit_mov_rr(jit, RSI, RCX);
+    emit_call(jit, read_mem_u8);
+    emit_pop(jit, REG_CYCLES);
+    emit_pop(jit, REG_BUDGET);
+    emit_pop(jit, RSI);
+    emit_pop(jit, RCX);
+    emit_movzx8(jit, dest, RAX);
+    set_jump_here(jit, done);
+}
+
+// ecx = the 16-bit pointer at guest address ecx, as read_mem_u16 reads
+// it. Clobbers eax, rdx, rsi, and rdi.
+static void emit_read_pointer_ecx(struct jit_state *jit) {
+    if (jit->direct_reads) {
+        emit_load_memory_base(jit);
+        emit_op_rm(jit, 0, X86_MOVZX8, RAX, RDX, RCX, 0, 0);
+        emit_op_rm(jit, 0, X86_MOVZX8, RCX, RDX, RCX, 1, 0);
+    } else {
+        emit_read_ecx(jit, RSI);
+        emit_alu_ri(jit, EXT_ADD, RCX, 1);
+        emit_op_rr(jit, 0, X86_MOVZX16, RCX, RCX, 0);
+        emit_read_ecx(jit, RCX);
+        emit_mov_rr(jit, RAX, RSI);
+    }
+
+    emit_shift_ri(jit, EXT_SHL, RCX, 8);
+    emit_alu_rr(jit, X86_OR, RCX, RAX);
+}
+
+// Same as the index addition in get_operand_addr_*: wraps at 16 bits.
+static void emit_index_ecx(struct jit_state *jit, int index_reg) {
+    emit_alu_rr(jit, X86_ADD, RCX, index_reg);
+    emit_op_rr(jit, 0, X86_MOVZX16, RCX, RCX, 0);
+}
+
+// ecx = the effective address, as computed by get_operand_addr_<mode>.
+// Clobbers eax, rdx, rsi, and rdi.
+static void emit_operand_addr(struct jit_state *jit, enum address_mode mode,
+                              uint16_t operand) {
+    switch (mode) {
+        case ZERO_PAGE:
+        case ABSOLUTE:
+            emit_mov_ri(jit, RCX, operand);
+            break;
+
+        case ZERO_PAGE_X:
+        case ABSOLUTE_X:
+            emit_mov_ri(jit, RCX, operand);
+            emit_index_ecx(jit, REG_X);
+            break;
+
+        case ZERO_PAGE_Y:
+        case ABSOLUTE_Y:
+            emit_mov_ri(jit, RCX, operand);
+            emit_index_ecx(jit, REG_Y);
+            break;
+
+        case IND_ZERO_PAGE_X:
+            emit_mov_ri(jit, RCX, operand);
+            emit_index_ecx(jit, REG_X);
+            emit_read_pointer_ecx(jit);
+            break;
+
+        case IND_ZERO_PAGE_Y:
+            emit_mov_ri(jit, RCX, operand);
+            emit_read_pointer_ecx(jit);
+            emit_index_ecx(jit, REG_Y);
+            break;
+
+        default:
+            abort();
+    }
+}
+
+// Count the extra cycle if adding index_reg to the address in ecx carried
+// into the high byte, which is when the low byte ends up below it.
+static void emit_page_cross_check(struct jit_state *jit, int index_reg) {
+    emit_movzx8(jit, RDX, RCX);
+    emit_alu_rr(jit, X86_CMP, RDX, index_reg);
+    emit_op_rr(jit, 1, 0x83, EXT_ADC, REG_CYCLES, 0);
+    emit8(jit, 0);
+}
+
+// eax = the operand value for an instruction that reads it.
+static void emit_operand_value(struct jit_state *jit, enum address_mode mode,
+                               uint16_t operand) {
+    if (mode == IMMEDIATE) {
+        emit_mov_ri(jit, RAX, operand);
+    } else {
+        emit_operand_addr(jit, mode, operand);
+        if (mode == ABSOLUTE_X) {
+            emit_page_cross_check(jit, REG_X);
+        } else if (mode == ABSOLUTE_Y || mode == IND_ZERO_PAGE_Y) {
+            emit_page_cross_check(jit, REG_Y);
+        }
+
+        emit_read_ecx(jit, RAX);
+    }
+}
+
+// Returns nonzero if the block must exit, either because translated code
+// was discarded or because the write stopped the emulator.
+static int jit_write_slow(struct m6502 *proc, uint16_t addr, uint8_t val) {
+    unsigned int flush_count = proc->jit->flush_count;
+    write_mem_u8(proc, addr, val);
+    return proc->jit->flush_count != flush_count || proc->halt;
+}
+
+// Guest byte at ecx = al. If the page can't be written directly, call
+// write_mem_u8. If the block needs to exit after that, go to next_pc, or
+// if exit_on_flush is zero, record it in the frame to be checked by the
+// caller. Clobbers rdx and rdi.
+static void emit_write_ecx(struct jit_state *jit, uint16_t next_pc,
+                           int exit_on_flush) {
+    emit_page_lookup(jit, offsetof(struct m6502, write_map));
+    uint8_t *slow_path = emit_jcc(jit, CC_Z);
+    emit_movzx8(jit, RDI, RCX);
+    emit_op_rm(jit, 0, X86_MOV_STORE8, RAX, RDX, RDI, 0, 1);
+    uint8_t *done = emit_jmp(jit);
+
+    set_jump_here(jit, slow_path);
+    emit_push(jit, REG_BUDGET);
+    emit_push(jit, REG_CYCLES);
+    emit_op_rr(jit, 1, X86_MOV_STORE, REG_PROC, RDI, 0);
+    emit_mov_rr(jit, RSI, RCX);
+    emit_mov_rr(jit, RDX, RAX);
+    emit_call(jit, jit_write_slow);
+    emit_pop(jit, REG_CYCLES);
+    emit_pop(jit, REG_BUDGET);
+    if (exit_on_flush) {
+        emit_alu_rr(jit, X86_TEST, RAX, RAX);
+        uint8_t *not_flushed = emit_jcc(jit, CC_Z);
+        emit_exit(jit, next_pc, 0);
+        set_jump_here(jit, not_flushed);
+    } else {
+        emit_op_rm(jit, 0, X86_OR8, RAX, RSP, NO_INDEX, FRAME_FLUSHED, 1);
+    }
+
+    set_jump_here(jit, done);
+}
+
+static void emit_set_nz(struct jit_state *jit, int reg) {
+    emit_mov_rr(jit, REG_NZ, reg);
+}
+
+// ecx = ((s + offset) & 0xffff) + 0x100, wrapped to 16 bits, matching the
+// pointer arithmetic in inst_PHA/inst_PLA/inst_JSR/inst_RTS.
+static void emit_stack_addr(struct jit_state *jit, int offset) {
+    emit_op_rm(jit, 0, X86_MOVZX16, RCX, REG_PROC, NO_INDEX,
+        offsetof(struct m6502, s), 0);
+    if (offset) {
+        emit_alu_ri(jit, EXT_ADD, RCX, offset);
+        emit_op_rr(jit, 0, X86_MOVZX16, RCX, RCX, 0);
+    }
+
+    emit_alu_ri(jit, EXT_ADD, RCX, 0x100);
+    emit_op_rr(jit, 0, X86_MOVZX16, RCX, RCX, 0);
+}
+
+static void emit_adjust_s(struct jit_state *jit, int ext) {
+    emit8(jit, 0x66);
+    emit_op_rm(jit, 0, 0xff, ext, REG_PROC, NO_INDEX,
+        offsetof(struct m6502, s), 0);
+}
+
+// Same as add() in 6502-core.c: op1 + eax + C. Sets N/Z, C, and V, and
+// leaves the result in dest (if it isn't NO_INDEX).
+static void emit_add(struct jit_state *jit, int op1, int dest) {
+    emit_mov_rr(jit, RCX, op1);
+    emit_alu_rr(jit, X86_ADD, RCX, RAX);
+    emit_alu_rr(jit, X86_ADD, RCX, REG_C);
+
+    // V = (op1 ^ result) & (op2 ^ result) & 0x80
+    emit_mov_rr(jit, RDX, op1);
+    emit_alu_rr(jit, X86_XOR, RDX, RCX);
+    emit_alu_rr(jit, X86_XOR, RAX, RCX);
+    emit_alu_rr(jit, X86_AND, RDX, RAX);
+    emit_shift_ri(jit, EXT_SHR, RDX, 7);
+    emit_alu_ri(jit, EXT_AND, RDX, 1);
+    emit_op_rm(jit, 0, X86_MOV_STORE8, RDX, RSP, NO_INDEX, FRAME_V, 1);
+
+    emit_movzx8(jit, REG_NZ, RCX);
+    if (dest != NO_INDEX) {
+        emit_mov_rr(jit, dest, REG_NZ);
+    }
+
+    emit_shift_ri(jit, EXT_SHR, RCX, 8);
+    emit_mov_rr(jit, REG_C, RCX);
+}
+
+static void emit_compare(struct jit_state *jit, int reg) {
+    emit_mov_ri(jit, REG_C, 1);
+    emit_alu_ri(jit, EXT_XOR, RAX, 0xff);
+    emit_add(jit, reg, NO_INDEX);
+}
+
+// eax = op(eax) for the read-modify-write instructions, setting flags.
+static void emit_rmw(struct jit_state *jit, enum jit_op op) {
+    switch (op) {
+        case OP_ASL:
+            emit_mov_rr(jit, REG_C, RAX);
+            emit_shift_ri(jit, EXT_SHR, REG_C, 7);
+            emit_shift_ri(jit, EXT_SHL, RAX, 1);
+            emit_movzx8(jit, RAX, RAX);
+            break;
+
+        case OP_LSR:
+            emit_mov_rr(jit, REG_C, RAX);
+            emit_alu_ri(jit, EXT_AND, REG_C, 1);
+            emit_shift_ri(jit, EXT_SHR, RAX, 1);
+            break;
+
+        case OP_ROL:
+            emit_mov_rr(jit, RDX, RAX);
+            emit_shift_ri(jit, EXT_SHR, RDX, 7);
+            emit_shift_ri(jit, EXT_SHL, RAX, 1);
+            emit_alu_rr(jit, X86_OR, RAX, REG_C);
+            emit_movzx8(jit, RAX, RAX);
+            emit_mov_rr(jit, REG_C, RDX);
+            break;
+
+        case OP_ROR:
+            emit_mov_rr(jit, RDX, RAX);
+            emit_alu_ri(jit, EXT_AND, RDX, 1);
+            emit_shift_ri(jit, EXT_SHR, RAX, 1);
+            emit_mov_rr(jit, RSI, REG_C);
+            emit_shift_ri(jit, EXT_SHL, RSI, 7);
+            emit_alu_rr(jit, X86_OR, RAX, RSI);
+            emit_mov_rr(jit, REG_C, RDX);
+            break;
+
+        case OP_INC:
+            emit_op_rr(jit, 0, 0xff, EXT_INC, RAX, 0);
+            emit_movzx8(jit, RAX, RAX);
+            break;
+
+        case OP_DEC:
+            emit_op_rr(jit, 0, 0xff, EXT_DEC, RAX, 0);
+            emit_movzx8(jit, RAX, RAX);
+            break;
+
+        default:
+            abort();
+    }
+
+    emit_set_nz(jit, RAX);
+}
+
+static void emit_inc_dec_reg(struct jit_state *jit, int reg, int ext) {
+    emit_op_rr(jit, 0, 0xff, ext, reg, 0);
+    emit_movzx8(jit, reg, reg);
+    emit_set_nz(jit, reg);
+}
+
+static void emit_transfer(struct jit_state *jit, int dest, int src) {
+    emit_mov_rr(jit, dest, src);
+    emit_set_nz(jit, dest);
+}
+
+// Sets the host flags so the jcc condition returned is true when the
+// branch is taken.
+static int emit_branch_test(struct jit_state *jit, enum jit_op op) {
+    switch (op) {
+        case OP_BCC:
+        case OP_BCS:
+            emit_alu_rr(jit, X86_TEST, REG_C, REG_C);
+            return op == OP_BCS ? CC_NZ : CC_Z;
+
+        case OP_BEQ:
+        case OP_BNE:
+            emit_test_ri(jit, REG_NZ, 0xff);
+            return op == OP_BEQ ? CC_Z : CC_NZ;
+
+        case OP_BMI:
+        case OP_BPL:
+            emit_mov_rr(jit, RAX, REG_NZ);
+            emit_shift_ri(jit, EXT_SHR, RAX, 8);
+            emit_alu_rr(jit, X86_OR, RAX, REG_NZ);
+            emit_test_ri(jit, RAX, 0x80);
+            return op == OP_BMI ? CC_NZ : CC_Z;
+
+        case OP_BVC:
+        case OP_BVS:
+            emit_op_rm(jit, 0, 0x80, EXT_CMP, RSP, NO_INDEX, FRAME_V, 0);
+            emit8(jit, 0);
+            return op == OP_BVS ? CC_NZ : CC_Z;
+
+        default:
+            abort();
+    }
+}
+
+static int reads_operand(enum jit_op op) {
+    switch (op) {
+        case OP_LDA: case OP_LDX: case OP_LDY:
+        case OP_ADC: case OP_SBC: case OP_CMP: case OP_CPX: case OP_CPY:
+        case OP_AND: case OP_ORA: case OP_EOR: case OP_BIT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int is_store(enum jit_op op) {
+    return op == OP_STA || op == OP_STX || op == OP_STY;
+}
+
+static int is_rmw(enum jit_op op) {
+    return op >= OP_ASL && op <= OP_DEC;
+}
+
+static int is_branch(enum jit_op op) {
+    return op >= OP_BCC && op <= OP_BVS;
+}
+
+// Translate one instruction. Returns 1 if it ends the block.
+static int emit_instruction(struct jit_state *jit, enum jit_op op,
+                            enum address_mode mode, uint16_t operand,
+                            uint16_t next_pc) {
+    static const int STORE_REGS[] = { REG_A, REG_X, REG_Y };
+
+    if (reads_operand(op)) {
+        emit_operand_value(jit, mode, operand);
+        switch (op) {
+            case OP_LDA: emit_transfer(jit, REG_A, RAX); break;
+            case OP_LDX: emit_transfer(jit, REG_X, RAX); break;
+            case OP_LDY: emit_transfer(jit, REG_Y, RAX); break;
+            case OP_ADC: emit_add(jit, REG_A, REG_A); break;
+            case OP_SBC:
+                emit_alu_ri(jit, EXT_XOR, RAX, 0xff);
+                emit_add(jit, REG_A, REG_A);
+                break;
+            case OP_CMP: emit_compare(jit, REG_A); break;
+            case OP_CPX: emit_compare(jit, REG_X); break;
+            case OP_CPY: emit_compare(jit, REG_Y); break;
+            case OP_AND:
+                emit_alu_rr(jit, X86_AND, REG_A, RAX);
+                emit_set_nz(jit, REG_A);
+                break;
+            case OP_ORA:
+                emit_alu_rr(jit, X86_OR, REG_A, RAX);
+                emit_set_nz(jit, REG_A);
+                break;
+            case OP_EOR:
+                emit_alu_rr(jit, X86_XOR, REG_A, RAX);
+                emit_set_nz(jit, REG_A);
+                break;
+            case OP_BIT:
+                // N and V come from the operand, Z from operand & A. N
+                // goes in the high byte so Z can be set at the same time.
+                emit_mov_rr(jit, RCX, RAX);
+                emit_shift_ri(jit, EXT_SHR, RCX, 6);
+                emit_alu_ri(jit, EXT_AND, RCX, 1);
+                emit_op_rm(jit, 0, X86_MOV_STORE8, RCX, RSP, NO_INDEX,
+                    FRAME_V, 1);
+                emit_mov_rr(jit, REG_NZ, RAX);
+                emit_alu_rr(jit, X86_AND, REG_NZ, REG_A);
+                emit_alu_ri(jit, EXT_AND, RAX, 0x80);
+                emit_shift_ri(jit, EXT_SHL, RAX, 8);
+                emit_alu_rr(jit, X86_OR, REG_NZ, RAX);
+                break;
+            default:
+                abort();
+        }
+
+        return 0;
+    }
+
+    if (is_store(op)) {
+        emit_operand_addr(jit, mode, operand);
+        emit_mov_rr(jit, RAX, STORE_REGS[op - OP_STA]);
+        emit_write_ecx(jit, next_pc, 1);
+        return 0;
+    }
+
+    if (is_rmw(op)) {
+        if (mode == IMPLIED) {
+            emit_mov_rr(jit, RAX, REG_A);
+            emit_rmw(jit, op);
+            emit_mov_rr(jit, REG_A, RAX);
+        } else {
+            emit_operand_addr(jit, mode, operand);
+            emit_read_ecx(jit, RAX);
+            emit_rmw(jit, op);
+            emit_write_ecx(jit, next_pc, 1);
+        }
+
+        return 0;
+    }
+
+    if (is_branch(op)) {
+        uint16_t target = next_pc + (int8_t) operand;
+        int cc = emit_branch_test(jit, op);
+        uint8_t *taken = emit_jcc(jit, cc);
+        emit_exit(jit, next_pc, 1);
+        set_jump_here(jit, taken);
+        jit->cycles_done += 1 + ((target ^ next_pc) > 0xff);
+        emit_exit(jit, target, 1);
+        return 1;
+    }
+
+    switch (op) {
+        case OP_INX: emit_inc_dec_reg(jit, REG_X, EXT_INC); break;
+        case OP_INY: emit_inc_dec_reg(jit, REG_Y, EXT_INC); break;
+        case OP_DEX: emit_inc_dec_reg(jit, REG_X, EXT_DEC); break;
+        case OP_DEY: emit_inc_dec_reg(jit, REG_Y, EXT_DEC); break;
+        case OP_TAX: emit_transfer(jit, REG_X, REG_A); break;
+        case OP_TXA: emit_transfer(jit, REG_A, REG_X); break;
+        case OP_TAY: emit_transfer(jit, REG_Y, REG_A); break;
+        case OP_TYA: emit_transfer(jit, REG_A, REG_Y); break;
+        case OP_TSX:
+            emit_op_rm(jit, 0, X86_MOVZX8, REG_X, REG_PROC, NO_INDEX,
+                offsetof(struct m6502, s), 0);
+            emit_set_nz(jit, REG_X);
+            break;
+        case OP_TXS:
+            emit8(jit, 0x66);
+            emit_op_rm(jit, 0, X86_MOV_STORE, REG_X, REG_PROC, NO_INDEX,
+                offsetof(struct m6502, s), 0);
+            emit_set_nz(jit, REG_X);
+            break;
+        case OP_CLC: emit_alu_rr(jit, X86_XOR, REG_C, REG_C); break;
+        case OP_SEC: emit_mov_ri(jit, REG_C, 1); break;
+        case OP_CLV:
+            emit_op_rm(jit, 0, 0xc6, 0, RSP, NO_INDEX, FRAME_V, 0);
+            emit8(jit, 0);
+            break;
+        case OP_NOP:
+            break;
+
+        case OP_PHA:
+            emit_stack_addr(jit, 0);
+            emit_adjust_s(jit, EXT_DEC);
+            emit_mov_rr(jit, RAX, REG_A);
+            emit_write_ecx(jit, next_pc, 1);
+            break;
+
+        case OP_PLA:
+            emit_adjust_s(jit, EXT_INC);
+            emit_stack_addr(jit, 0);
+            emit_read_ecx(jit, REG_A);
+            emit_set_nz(jit, REG_A);
+            break;
+
+        case OP_JMP:
+            emit_exit(jit, operand, 1);
+            return 1;
+
+        case OP_JSR: {
+            // A write that requires the block to exit is recorded in the
+            // frame, because the block is going to exit anyway.
+            emit_stack_addr(jit, 0);
+            emit_op_rm(jit, 0, 0xc6, 0, RSP, NO_INDEX, FRAME_FLUSHED, 0);
+            emit8(jit, 0);
+            emit_adjust_s(jit, EXT_DEC);
+            emit_mov_ri(jit, RAX, next_pc >> 8);
+            emit_write_ecx(jit, next_pc, 0);
+            emit_stack_addr(jit, 0);
+            emit_adjust_s(jit, EXT_DEC);
+            emit_mov_ri(jit, RAX, next_pc & 0xff);
+            emit_write_ecx(jit, next_pc, 0);
+
+            // Chaining to a block that has just been discarded isn't
+            // safe.
+            emit_op_rm(jit, 0, 0x80, EXT_CMP, RSP, NO_INDEX, FRAME_FLUSHED, 0);
+            emit8(jit, 0);
+            uint8_t *not_flushed = emit_jcc(jit, CC_Z);
+            emit_exit(jit, operand, 0);
+            set_jump_here(jit, not_flushed);
+            emit_exit(jit, operand, 1);
+            return 1;
+        }
+
+        case OP_RTS:
+            emit_adjust_s(jit, EXT_INC);
+            emit_stack_addr(jit, 0);
+            emit_read_ecx(jit, RSI);
+            emit_adjust_s(jit, EXT_INC);
+            emit_stack_addr(jit, 0);
+            emit_read_ecx(jit, RAX);
+            emit_shift_ri(jit, EXT_SHL, RAX, 8);
+            emit_alu_rr(jit, X86_OR, RAX, RSI);
+            emit_charge_budget(jit, jit->insts_done, jit->cycles_done);
+            emit_alu_rr(jit, X86_XOR, RDX, RDX);
+            set_jump_target(emit_jmp(jit), jit->exit_stub);
+            return 1;
+
+        default:
+            abort();
+    }
+
+    return 0;
+}
+
+static int operand_bytes(enum address_mode mode) {
+    switch (mode) {
+        case IMPLIED:
+            return 0;
+        case ABSOLUTE:
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+        case INDIRECT:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Work out which opcodes can be translated. Combinations that the
+// generated handlers treat as invalid (e.g. STA #imm) are left to the
+// interpreter.
+static enum jit_op lookup_op(const struct instruction *inst) {
+    enum jit_op op = OP_UNSUPPORTED;
+    for (int i = 1; i < NUM_JIT_OPS; i++) {
+        if (strcmp(inst->mnemonic, OP_NAMES[i]) == 0) {
+            op = i;
+            break;
+        }
+    }
+
+    if (op == OP_UNSUPPORTED || inst->mode == INDIRECT
+            || inst->length != 1 + operand_bytes(inst->mode)) {
+        return OP_UNSUPPORTED;
+    }
+
+    int implied_ok = !reads_operand(op) && !is_store(op)
+        && !is_branch(op) && op != OP_JMP && op != OP_JSR
+        && op != OP_INC && op != OP_DEC;
+    if (inst->mode == IMPLIED && !implied_ok) {
+        return OP_UNSUPPORTED;
+    }
+
+    if (inst->mode == IMMEDIATE && !reads_operand(op)) {
+        return OP_UNSUPPORTED;
+    }
+
+    return op;
+}
+
+static void mark_translated(struct m6502 *proc, uint16_t addr) {
+    proc->jit->code_bytes[addr >> 5] |= 1u << (addr & 31);
+    mark_code_page(proc, addr >> PAGE_SHIFT);
+}
+
+// Code is only translated from pages that can be read without side
+// effects.
+static int code_readable(struct m6502 *proc, uint16_t pc) {
+    return proc->read_map[pc >> PAGE_SHIFT]
+        && proc->read_map[(uint16_t) (pc + 2) >> PAGE_SHIFT];
+}
+
+static int all_reads_direct(struct m6502 *proc) {
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (proc->read_map[page] != proc->memory + page * PAGE_SIZE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void drop_blocks(struct jit_state *jit) {
+    for (int i = 0; i < jit->num_blocks; i++) {
+        jit->blocks[jit->block_pcs[i]] = NULL;
+        jit->counts[jit->block_pcs[i]] = 0;
+    }
+
+    jit->num_blocks = 0;
+    jit->num_slots = 0;
+    jit->code_ptr = jit->blocks_start;
+    memset(jit->code_bytes, 0, sizeof(jit->code_bytes));
+    jit->flush_count++;
+}
+
+static void *compile_block(struct m6502 *proc, uint16_t start_pc) {
+    struct jit_state *jit = proc->jit;
+    if (jit->code_ptr + MAX_BLOCK_CODE > jit->code + CODE_BUFFER_SIZE) {
+        drop_blocks(jit);
+    }
+
+    uint8_t *block = jit->code_ptr;
+    uint16_t pc = start_pc;
+
+    // The length of the block is filled in at the end.
+    jit->insts_done = 1;
+    jit->cycles_done = 0;
+    jit->inst_cycles = 0;
+    emit_op_rr(jit, 1, 0x81, EXT_CMP, REG_BUDGET, 0);
+    uint8_t *block_length = jit->code_ptr;
+    emit32(jit, 0);
+    uint8_t *budget_ok = emit_jcc(jit, CC_NC);
+    emit_side_exit(jit, pc);
+    set_jump_here(jit, budget_ok);
+
+    int count;
+    for (count = 0; ; count++) {
+        const struct instruction *inst = &INSTRUCTIONS[0];
+        enum jit_op op = OP_UNSUPPORTED;
+        uint16_t operand = 0;
+        if (code_readable(proc, pc)) {
+            uint8_t opcode = read_mem_u8(proc, pc);
+            inst = &INSTRUCTIONS[opcode];
+            op = jit->ops[opcode];
+            if (inst->length > 1) {
+                operand = read_mem_u8(proc, pc + 1);
+            }
+
+            if (inst->length > 2) {
+                operand |= read_mem_u8(proc, pc + 2) << 8;
+            }
+        }
+
+        if (op == OP_UNSUPPORTED || count == MAX_BLOCK_INSTS
+                || pc + inst->length > MEM_SIZE) {
+            if (count == 0) {
+                jit->code_ptr = block;
+                return NULL;
+            }
+
+            jit->insts_done = count;
+            jit->inst_cycles = 0;
+            emit_exit(jit, pc, 1);
+            break;
+        }
+
+        for (int i = 0; i < inst->length; i++) {
+            mark_translated(proc, pc + i);
+        }
+
+        uint16_t next_pc = pc + inst->length;
+        jit->insts_done = count + 1;
+        jit->inst_cycles = inst->cycles;
+        jit->cycles_done += inst->cycles;
+        if (emit_instruction(jit, op, inst->mode, operand, next_pc)) {
+            count++;
+            break;
+        }
+
+        pc = next_pc;
+    }
+
+    uint32_t length = count;
+    memcpy(block_length, &length, sizeof(length));
+
+    jit->blocks[start_pc] = block;
+    jit->block_pcs[jit->num_blocks++] = start_pc;
+    return block;
+}
+
+static void link_block(struct jit_state *jit, int slot_index) {
+    struct chain_slot *slot = &jit->slots[slot_index];
+    const uint8_t *target = jit->blocks[slot->target_pc];
+    if (target) {
+        set_jump_target(slot->jump, target);
+    }
+}
+
+// Run until the emulator stops or budget instructions have executed.
+// Returns the unused part of the budget.
+uint64_t jit_run(struct m6502 *proc, uint64_t budget) {
+    struct jit_state *jit = proc->jit;
+    struct jit_regs regs;
+
+    while (budget && !proc->halt) {
+        uint16_t pc = proc->pc;
+        void *block = jit->blocks[pc];
+        if (block == NULL && jit->counts[pc] < HOT_THRESHOLD
+                && ++jit->counts[pc] == HOT_THRESHOLD) {
+            block = compile_block(proc, pc);
+        }
+
+        if (block == NULL) {
+            execute_inst(proc);
+            budget--;
+            continue;
+        }
+
+        regs.a = (uint8_t) proc->a;
+        regs.x = proc->x;
+        regs.y = proc->y;
+        regs.nz = proc->nz_result;
+        regs.c = proc->c_result >> 8;
+        regs.v = proc->v_result >> 7;
+        regs.budget = budget;
+        uint64_t result = jit->enter(proc, block, &regs);
+        budget = regs.budget;
+        proc->a = regs.a;
+        proc->x = regs.x;
+        proc->y = regs.y;
+        proc->nz_result = regs.nz;
+        proc->c_result = regs.c << 8;
+        proc->v_result = regs.v << 7;
+        proc->pc = (uint16_t) result;
+
+        uint32_t slot = result >> 32;
+        if (slot == EXIT_INTERPRET) {
+            // Otherwise a block starting here would exit straight back.
+            if (budget) {
+                execute_inst(proc);
+                budget--;
+            }
+        } else if (slot) {
+            link_block(jit, slot - 1);
+        }
+    }
+
+    return budget;
+}
+
+// Called when guest memory is written in a page containing code.
+// Returns 1 if translated code was discarded.
+int jit_invalidate(struct m6502 *proc, uint16_t addr) {
+    struct jit_state *jit = proc->jit;
+    if ((jit->code_bytes[addr >> 5] >> (addr & 31)) & 1) {
+        drop_blocks(jit);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Called when the decode cache is flushed, which includes any change to
+// the page mappings.
+void jit_flush(struct m6502 *proc) {
+    struct jit_state *jit = proc->jit;
+    drop_blocks(jit);
+    memset(jit->counts, 0, sizeof(jit->counts));
+    jit->direct_reads = all_reads_direct(proc);
+}
+
+int jit_enable(struct m6502 *proc) {
+    if (proc->jit) {
+        return 0;
+    }
+
+    struct jit_state *jit = calloc(1, sizeof(struct jit_state));
+    if (jit == NULL) {
+        return -1;
+    }
+
+    jit->code = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return -1;
+    }
+
+    jit->code_ptr = jit->code;
+    emit_stubs(jit);
+    jit->blocks_start = jit->code_ptr;
+    for (int i = 0; i < 256; i++) {
+        jit->ops[i] = lookup_op(&INSTRUCTIONS[i]);
+    }
+
+    jit->direct_reads = all_reads_direct(proc);
+    proc->jit = jit;
+    return 0;
+}
+
+void jit_disable(struct m6502 *proc) {
+    if (proc->jit) {
+        munmap(proc->jit->code, CODE_BUFFER_SIZE);
+        free(proc->jit);
+        proc->jit = NULL;
+    }
+}
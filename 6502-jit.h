@@ -0,0 +1,29 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_JIT_H
+#define __6502_JIT_H
+
+#include "6502-core.h"
+
+// Returns 0 on success, -1 if the host doesn't allow executable memory.
+int jit_enable(struct m6502 *proc);
+void jit_disable(struct m6502 *proc);
+uint64_t jit_run(struct m6502 *proc, uint64_t budget);
+void jit_flush(struct m6502 *proc);
+int jit_invalidate(struct m6502 *proc, uint16_t addr);
+
+#endif
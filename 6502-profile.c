@@ -0,0 +1,409 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Reports the counts collected by the core when built with PROFILE=1. The
+// counting itself is in run_instructions and the memory access functions,
+// so that it compiles to nothing otherwise.
+//
+// JSR and RTS also keep a call stack on the host, to charge instructions
+// to the path of calls that led to them. Guest code doesn't always return
+// the way it was called: it may pull the return address to return to its
+// caller's caller, reset the stack pointer to recover from an error, or
+// push an address and RTS to it as a jump table. So the stack pointer is
+// what matches an RTS to its JSR. A JSR frame is finished once the stack
+// pointer is back above its return address, and an RTS that doesn't pull
+// the return address of any frame isn't a return.
+//
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "6502-profile.h"
+#include "instructions.h"
+
+struct ranked {
+    uint64_t count;
+    int index;
+};
+
+static const char * const MODE_NAMES[] = {
+    [ABSOLUTE] = "absolute",
+    [ABSOLUTE_X] = "absolute, X",
+    [ABSOLUTE_Y] = "absolute, Y",
+    [IMMEDIATE] = "immediate",
+    [IMPLIED] = "implied",
+    [INDIRECT] = "indirect",
+    [IND_ZERO_PAGE_X] = "(zero page, X)",
+    [IND_ZERO_PAGE_Y] = "(zero page), Y",
+    [RELATIVE] = "relative",
+    [ZERO_PAGE] = "zero page",
+    [ZERO_PAGE_X] = "zero page, X",
+    [ZERO_PAGE_Y] = "zero page, Y"
+};
+
+static void free_symbols(struct profile *profile) {
+    for (int i = 0; i < profile->num_symbols; i++) {
+        free(profile->symbols[i].name);
+    }
+
+    free(profile->symbols);
+    profile->symbols = NULL;
+    profile->num_symbols = 0;
+}
+
+// Returns -1 if there isn't enough memory.
+static int add_call_node(struct profile *profile, uint16_t addr, int parent) {
+    if (profile->num_calls == profile->max_calls) {
+        int max_calls = profile->max_calls ? profile->max_calls * 2 : 64;
+        struct call_node *calls = realloc(profile->calls,
+            max_calls * sizeof(struct call_node));
+        if (calls == NULL) {
+            return -1;
+        }
+
+        profile->calls = calls;
+        profile->max_calls = max_calls;
+    }
+
+    int index = profile->num_calls++;
+    struct call_node *node = &profile->calls[index];
+    memset(node, 0, sizeof(struct call_node));
+    node->addr = addr;
+    node->parent = parent;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    if (parent >= 0) {
+        node->next_sibling = profile->calls[parent].first_child;
+        profile->calls[parent].first_child = index;
+    }
+
+    return index;
+}
+
+int start_profile(struct m6502 *proc) {
+    struct profile *profile = proc->profile;
+    if (profile == NULL) {
+        profile = calloc(1, sizeof(struct profile));
+        if (profile == NULL) {
+            return -1;
+        }
+    } else {
+        // Keep the symbols
+        struct symbol *symbols = profile->symbols;
+        int num_symbols = profile->num_symbols;
+        free(profile->calls);
+        memset(profile, 0, sizeof(struct profile));
+        profile->symbols = symbols;
+        profile->num_symbols = num_symbols;
+    }
+
+    if (add_call_node(profile, proc->pc, -1) < 0) {
+        free_symbols(profile);
+        free(profile);
+        proc->profile = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    proc->profile = profile;
+    return 0;
+}
+
+void stop_profile(struct m6502 *proc) {
+    if (proc->profile) {
+        free_symbols(proc->profile);
+        free(proc->profile->calls);
+        free(proc->profile);
+        proc->profile = NULL;
+    }
+}
+
+static int find_call(struct profile *profile, int parent, uint16_t addr) {
+    for (int child = profile->calls[parent].first_child; child >= 0;
+            child = profile->calls[child].next_sibling) {
+        if (profile->calls[child].addr == addr) {
+            return child;
+        }
+    }
+
+    return add_call_node(profile, addr, parent);
+}
+
+static void set_current_call(struct profile *profile) {
+    profile->current_call = profile->call_depth
+        ? profile->call_stack[profile->call_depth - 1].node : 0;
+}
+
+// Called after the return address is pushed
+void profile_call(struct m6502 *proc, uint16_t target) {
+    struct profile *profile = proc->profile;
+    uint8_t s = proc->s;
+    while (profile->call_depth > 0
+            && profile->call_stack[profile->call_depth - 1].s <= s) {
+        profile->call_depth--;
+    }
+
+    set_current_call(profile);
+    if (profile->call_depth == MAX_CALL_DEPTH) {
+        return;
+    }
+
+    int node = find_call(profile, profile->current_call, target);
+    if (node < 0) {
+        return;
+    }
+
+    profile->calls[node].calls++;
+    struct call_frame *frame = &profile->call_stack[profile->call_depth++];
+    frame->s = s;
+    frame->node = node;
+    profile->current_call = node;
+}
+
+// Called before the return address is pulled
+void profile_return(struct m6502 *proc) {
+    struct profile *profile = proc->profile;
+    uint8_t s = proc->s;
+    while (profile->call_depth > 0
+            && profile->call_stack[profile->call_depth - 1].s < s) {
+        profile->call_depth--;
+    }
+
+    if (profile->call_depth > 0
+            && profile->call_stack[profile->call_depth - 1].s == s) {
+        profile->call_depth--;
+    }
+
+    set_current_call(profile);
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    return ((const struct symbol *) a)->addr
+        - ((const struct symbol *) b)->addr;
+}
+
+int load_symbols(struct m6502 *proc, const char *filename) {
+    struct profile *profile = proc->profile;
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    free_symbols(profile);
+    int max_symbols = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char name[128];
+        unsigned int addr;
+        if (sscanf(line, "%127s %x", name, &addr) != 2 || name[0] == '-') {
+            continue;
+        }
+
+        if (profile->num_symbols == max_symbols) {
+            max_symbols = max_symbols ? max_symbols * 2 : 64;
+            struct symbol *symbols = realloc(profile->symbols,
+                max_symbols * sizeof(struct symbol));
+            if (symbols == NULL) {
+                fclose(file);
+                errno = ENOMEM;
+                return -1;
+            }
+
+            profile->symbols = symbols;
+        }
+
+        struct symbol *symbol = &profile->symbols[profile->num_symbols++];
+        symbol->addr = addr;
+        symbol->name = strdup(name);
+    }
+
+    fclose(file);
+    qsort(profile->symbols, profile->num_symbols, sizeof(struct symbol),
+        compare_symbols);
+    return 0;
+}
+
+// buf must have room for an address
+static const char *symbol_name(const struct profile *profile, uint16_t addr,
+                               char *buf, size_t size) {
+    int low = 0;
+    int high = profile->num_symbols - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (profile->symbols[mid].addr == addr) {
+            return profile->symbols[mid].name;
+        } else if (profile->symbols[mid].addr < addr) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    snprintf(buf, size, "$%04x", addr);
+    return buf;
+}
+
+void write_folded(struct m6502 *proc, FILE *file, int use_cycles) {
+    const struct profile *profile = proc->profile;
+    int path[MAX_CALL_DEPTH + 1];
+    for (int i = 0; i < profile->num_calls; i++) {
+        const struct call_node *node = &profile->calls[i];
+        uint64_t value = use_cycles ? node->cycles : node->instructions;
+        if (value == 0) {
+            continue;
+        }
+
+        int depth = 0;
+        for (int call = i; call >= 0; call = profile->calls[call].parent) {
+            path[depth++] = call;
+        }
+
+        while (depth-- > 0) {
+            char buf[8];
+            fprintf(file, "%s%c", symbol_name(profile,
+                profile->calls[path[depth]].addr, buf, sizeof(buf)),
+                depth ? ';' : ' ');
+        }
+
+        fprintf(file, "%" PRIu64 "\n", value);
+    }
+}
+
+static int compare_ranked(const void *a, const void *b) {
+    const struct ranked *ra = a;
+    const struct ranked *rb = b;
+    if (ra->count != rb->count) {
+        return ra->count < rb->count ? 1 : -1;
+    }
+
+    return ra->index - rb->index;
+}
+
+// Sort the nonzero counts, largest first. Returns how many there are, up
+// to max, and the sum of all of them in total.
+static int rank_counts(const uint64_t *counts, int num_counts,
+                       struct ranked *ranked, int max, uint64_t *total) {
+    int num_ranked = 0;
+    *total = 0;
+    for (int i = 0; i < num_counts; i++) {
+        if (counts[i]) {
+            ranked[num_ranked].count = counts[i];
+            ranked[num_ranked++].index = i;
+            *total += counts[i];
+        }
+    }
+
+    qsort(ranked, num_ranked, sizeof(struct ranked), compare_ranked);
+    return num_ranked < max ? num_ranked : max;
+}
+
+// Print the subroutines that used the most cycles, including the ones they
+// called. A subroutine may be in the call tree many times, for each path
+// that called it, so those are added up, except where it called itself.
+static void print_subroutines(const struct profile *profile,
+                              struct ranked *ranked, int count) {
+    int num_calls = profile->num_calls;
+    uint64_t *inclusive = malloc(num_calls * sizeof(uint64_t));
+    for (int i = 0; i < num_calls; i++) {
+        inclusive[i] = profile->calls[i].cycles;
+    }
+
+    // Children always come after their parents
+    for (int i = num_calls - 1; i > 0; i--) {
+        inclusive[profile->calls[i].parent] += inclusive[i];
+    }
+
+    uint64_t *cycles = calloc(MEM_SIZE, sizeof(uint64_t));
+    uint64_t *self = calloc(MEM_SIZE, sizeof(uint64_t));
+    uint64_t *calls = calloc(MEM_SIZE, sizeof(uint64_t));
+    for (int i = 0; i < num_calls; i++) {
+        const struct call_node *node = &profile->calls[i];
+        self[node->addr] += node->cycles;
+        calls[node->addr] += node->calls;
+        int recursive = 0;
+        for (int call = node->parent; call >= 0;
+                call = profile->calls[call].parent) {
+            if (profile->calls[call].addr == node->addr) {
+                recursive = 1;
+                break;
+            }
+        }
+
+        if (!recursive) {
+            cycles[node->addr] += inclusive[i];
+        }
+    }
+
+    uint64_t total;
+    int num_ranked = rank_counts(cycles, MEM_SIZE, ranked, count, &total);
+    printf("      cycles   self cycles        calls  subroutine\n");
+    for (int i = 0; i < num_ranked; i++) {
+        int addr = ranked[i].index;
+        char buf[8];
+        printf("%12" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %s\n",
+            cycles[addr], self[addr], calls[addr],
+            symbol_name(profile, addr, buf, sizeof(buf)));
+    }
+
+    free(inclusive);
+    free(cycles);
+    free(self);
+    free(calls);
+}
+
+void print_profile(struct m6502 *proc, int count) {
+    const struct profile *profile = proc->profile;
+    struct ranked *ranked = malloc(MEM_SIZE * sizeof(struct ranked));
+    uint64_t total;
+    int num_ranked = rank_counts(profile->addresses, MEM_SIZE, ranked,
+        count, &total);
+    printf("%" PRIu64 " instructions\n", total);
+    printf("       count      %%  address\n");
+    for (int i = 0; i < num_ranked; i++) {
+        printf("%12" PRIu64 " %5.1f%% ", ranked[i].count,
+            ranked[i].count * 100.0 / total);
+        disassemble(proc, ranked[i].index, 1);
+    }
+
+    num_ranked = rank_counts(profile->opcodes, 256, ranked, count, &total);
+    printf("       count      %%  opcode\n");
+    for (int i = 0; i < num_ranked; i++) {
+        const struct instruction *inst = &INSTRUCTIONS[ranked[i].index];
+        printf("%12" PRIu64 " %5.1f%%  %02x %s %s\n", ranked[i].count,
+            ranked[i].count * 100.0 / total, ranked[i].index,
+            inst->mnemonic, MODE_NAMES[inst->mode]);
+    }
+
+    uint64_t accesses[NUM_PAGES];
+    for (int page = 0; page < NUM_PAGES; page++) {
+        accesses[page] = profile->page_reads[page]
+            + profile->page_writes[page];
+    }
+
+    print_subroutines(profile, ranked, count);
+    num_ranked = rank_counts(accesses, NUM_PAGES, ranked, count, &total);
+    printf("  data reads  data writes  page\n");
+    for (int i = 0; i < num_ranked; i++) {
+        int page = ranked[i].index;
+        printf("%12" PRIu64 " %12" PRIu64 "  %02x00\n",
+            profile->page_reads[page], profile->page_writes[page], page);
+    }
+
+    free(ranked);
+}
@@ -0,0 +1,63 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_PROFILE_H
+#define __6502_PROFILE_H
+
+#include "6502-core.h"
+
+#ifdef ENABLE_PROFILE
+
+#include <stdio.h>
+
+struct symbol {
+    uint16_t addr;
+    char *name;
+};
+
+// Start counting from zero. While counting, run_instructions uses the
+// interpreter, even if the JIT is enabled. Returns 0 on success, or -1
+// with errno set.
+int start_profile(struct m6502 *proc);
+
+// Stop counting and discard the counts.
+void stop_profile(struct m6502 *proc);
+
+// Print the count most executed addresses, disassembled, then the count
+// most executed opcodes, the count subroutines that used the most cycles
+// including their callees, and the count pages with the most data reads
+// and writes. Instruction fetches aren't included in those.
+void print_profile(struct m6502 *proc, int count);
+
+// Write the call tree in the folded stack format that flame graph tools
+// read: a line for each call path, with its subroutines separated by
+// semicolons, followed by the instructions, or cycles if use_cycles is
+// set, spent in the last one.
+void write_folded(struct m6502 *proc, FILE *file, int use_cycles);
+
+// Read names for addresses, to use in place of the address in reports.
+// Each line is a name then a hexadecimal address, as in the symbol files
+// dasm writes with -s. Other lines are skipped. Returns 0 on success, or
+// -1 with errno set.
+int load_symbols(struct m6502 *proc, const char *filename);
+
+// Called by JSR and RTS while profiling, to follow the call tree
+void profile_call(struct m6502 *proc, uint16_t target);
+void profile_return(struct m6502 *proc);
+
+#endif
+
+#endif
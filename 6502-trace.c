@@ -0,0 +1,255 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Records every instruction executed to a file. Filling in a record is a
+// few stores into the ring, and the writer thread does the system calls,
+// so the processor only waits if the writer falls a whole ring behind.
+// Records are handed over in groups (see commit_trace_record), which
+// keeps the processor's thread from touching the shared cache line on
+// every instruction.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "6502-trace.h"
+
+_Static_assert(sizeof(struct trace_record) == 10,
+    "trace record must not have padding");
+_Static_assert(sizeof(struct trace_header) == 16,
+    "trace header must not have padding");
+
+static int write_all(int fd, const void *data, size_t length) {
+    const uint8_t *ptr = data;
+    while (length > 0) {
+        ssize_t written = write(fd, ptr, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        ptr += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// How long the writer waits before writing out whatever records there are
+// while the processor isn't adding many
+#define IDLE_WRITE_NS 100000000
+
+// Wait until half the ring is ready to write, so it is written in large
+// pieces, the trace is done, or some time has passed.
+static void wait_for_records(struct trace *trace, uint64_t tail) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += IDLE_WRITE_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    // The processor's thread checks writer_idle after publishing, so
+    // either it sees this, or this sees what it published.
+    pthread_mutex_lock(&trace->lock);
+    __atomic_store_n(&trace->writer_idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&trace->published, __ATOMIC_SEQ_CST) - tail
+            < TRACE_RING_SIZE / 2
+            && !__atomic_load_n(&trace->done, __ATOMIC_ACQUIRE)) {
+        if (pthread_cond_timedwait(&trace->wake_writer, &trace->lock,
+                &deadline) != 0) {
+            break;
+        }
+    }
+
+    __atomic_store_n(&trace->writer_idle, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+static void *writer_thread(void *arg) {
+    struct trace *trace = arg;
+    uint64_t tail = 0;
+    while (1) {
+        // done is set after the last records are published
+        int done = __atomic_load_n(&trace->done, __ATOMIC_ACQUIRE);
+        uint64_t published = __atomic_load_n(&trace->published,
+            __ATOMIC_ACQUIRE);
+        if (published == tail && done) {
+            break;
+        }
+
+        if (published - tail < TRACE_RING_SIZE / 2 && !done) {
+            wait_for_records(trace, tail);
+            published = __atomic_load_n(&trace->published, __ATOMIC_ACQUIRE);
+            if (published == tail) {
+                continue;
+            }
+        }
+
+        // Write up to the end of the ring, and the rest next time around
+        size_t start = tail & (TRACE_RING_SIZE - 1);
+        size_t count = published - tail;
+        if (start + count > TRACE_RING_SIZE) {
+            count = TRACE_RING_SIZE - start;
+        }
+
+        if (!trace->error && write_all(trace->fd, &trace->ring[start],
+                count * sizeof(struct trace_record)) < 0) {
+            trace->error = errno;
+        }
+
+        tail += count;
+        __atomic_store_n(&trace->tail, tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&trace->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&trace->lock);
+            pthread_cond_signal(&trace->space_free);
+            pthread_mutex_unlock(&trace->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void wake_writer(struct trace *trace) {
+    if (__atomic_load_n(&trace->writer_idle, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&trace->writer_idle, 0, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&trace->lock);
+        pthread_cond_signal(&trace->wake_writer);
+        pthread_mutex_unlock(&trace->lock);
+    }
+}
+
+// Make the records added so far visible to the writer. It is only woken
+// once half the ring is waiting, so it writes in large pieces.
+void publish_trace(struct trace *trace) {
+    __atomic_store_n(&trace->published, trace->head, __ATOMIC_SEQ_CST);
+    if (trace->head - (trace->limit - TRACE_RING_SIZE)
+            >= TRACE_RING_SIZE / 2) {
+        // limit may be out of date
+        trace->limit = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE)
+            + TRACE_RING_SIZE;
+        if (trace->head - (trace->limit - TRACE_RING_SIZE)
+                >= TRACE_RING_SIZE / 2) {
+            wake_writer(trace);
+        }
+    }
+}
+
+void wait_for_trace_space(struct trace *trace) {
+    uint64_t tail = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+    if (trace->head >= tail + TRACE_RING_SIZE) {
+        publish_trace(trace);
+        pthread_mutex_lock(&trace->lock);
+        __atomic_store_n(&trace->waiting, 1, __ATOMIC_SEQ_CST);
+        while (trace->head >= (tail = __atomic_load_n(&trace->tail,
+                __ATOMIC_SEQ_CST)) + TRACE_RING_SIZE) {
+            pthread_cond_wait(&trace->space_free, &trace->lock);
+        }
+
+        __atomic_store_n(&trace->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&trace->lock);
+    }
+
+    trace->limit = tail + TRACE_RING_SIZE;
+}
+
+static void destroy_trace(struct trace *trace) {
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->wake_writer);
+    pthread_cond_destroy(&trace->space_free);
+    free(trace->ring);
+    free(trace);
+}
+
+int start_trace(struct m6502 *proc, const char *filename) {
+    if (proc->trace) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    if (write_all(fd, &header, sizeof(header)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct trace *trace = aligned_alloc(64, (sizeof(struct trace) + 63) & ~63);
+    if (trace == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    memset(trace, 0, sizeof(struct trace));
+    trace->ring = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    trace->limit = TRACE_RING_SIZE;
+    trace->fd = fd;
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->wake_writer, NULL);
+    pthread_cond_init(&trace->space_free, NULL);
+    int result = trace->ring ? pthread_create(&trace->thread, NULL,
+        writer_thread, trace) : ENOMEM;
+    if (result != 0) {
+        destroy_trace(trace);
+        close(fd);
+        errno = result;
+        return -1;
+    }
+
+    proc->trace = trace;
+    return 0;
+}
+
+int stop_trace(struct m6502 *proc) {
+    struct trace *trace = proc->trace;
+    if (trace == NULL) {
+        return 0;
+    }
+
+    publish_trace(trace);
+    __atomic_store_n(&trace->done, 1, __ATOMIC_SEQ_CST);
+    wake_writer(trace);
+    pthread_join(trace->thread, NULL);
+    int error = trace->error;
+    if (close(trace->fd) < 0 && error == 0) {
+        error = errno;
+    }
+
+    destroy_trace(trace);
+    proc->trace = NULL;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef __6502_TRACE_H
+#define __6502_TRACE_H
+
+#include <pthread.h>
+#include "6502-core.h"
+
+//
+// Trace file layout: a struct trace_header, then a struct trace_record for
+// each instruction executed, in order. Fields are little endian.
+//
+#define TRACE_MAGIC "6502TRC"
+#define TRACE_VERSION 1
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// One executed instruction. The registers are the values after it ran.
+struct trace_record {
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t status;     // As pushed on the stack (see get_status)
+    uint16_t operand;   // Bytes after the opcode, low byte first
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t s;
+};
+
+// Records are added by the thread running the processor and written to
+// the file by a thread of its own, through a ring of records. Only the
+// writer changes tail, and only the processor's thread changes head, so
+// neither needs a lock to pass records. The lock is only for one of them
+// to sleep until the other has something for it. The fields each one
+// changes are on their own cache lines so they don't slow each other
+// down.
+#define TRACE_RING_SIZE 0x10000     // Records, a power of two
+
+struct trace {
+    struct trace_record *ring;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake_writer;
+    pthread_cond_t space_free;
+
+    // Used by the processor's thread. head is its own count of records
+    // added, published every so often, and limit is how far it can go
+    // before it has to check tail again.
+    _Alignas(64) uint64_t head;
+    uint64_t limit;
+    uint64_t published;     // Records ready for the writer
+    int waiting;            // Waiting for the writer to free space
+    int done;
+
+    _Alignas(64) uint64_t tail; // Records written to the file
+    int writer_idle;            // Waiting for records
+    int error;
+};
+// Start recording every instruction the processor runs to a file. While
+// it is, run_instructions uses the interpreter, even if the JIT is
+// enabled. Returns 0 on success, or -1 with errno set.
+int start_trace(struct m6502 *proc, const char *filename);
+
+// Write out any records still in the ring and close the file. Returns 0
+// on success, or -1 with errno set if writing any of the trace failed.
+int stop_trace(struct m6502 *proc);
+
+void wait_for_trace_space(struct trace *trace);
+void publish_trace(struct trace *trace);
+
+// Get the next record to fill in. It is added with commit_trace_record.
+static inline struct trace_record *next_trace_record(struct trace *trace) {
+    if (trace->head == trace->limit) {
+        wait_for_trace_space(trace);
+    }
+
+    return &trace->ring[trace->head & (TRACE_RING_SIZE - 1)];
+}
+
+static inline void commit_trace_record(struct trace *trace) {
+    if ((++trace->head & 0xff) == 0) {
+        publish_trace(trace);
+    }
+}
+
+#endif
@@ -0,0 +1,141 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+;
+; Computes the CRC-32 (as used by zlib) of a pseudo-random buffer a bit at
+; a time, several times over.
+;
+
+CONSOLE_OUT = $fffa
+
+BUFFER = $1000
+PAGES = $10
+ROUNDS = 64
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+
+                    jmp start
+
+; Zero page variables, so the code that follows can be any length
+buffer_ptr:         dc.s 0
+crc:                dc.s 0, 0
+bits:               dc.b 0
+seed:               dc.b 1
+round:              dc.b ROUNDS
+
+start:              jsr fill_buffer
+round_loop:         lda #$ff
+                    sta crc
+                    sta crc + 1
+                    sta crc + 2
+                    sta crc + 3
+                    lda #<BUFFER
+                    sta buffer_ptr
+                    lda #>BUFFER
+                    sta buffer_ptr + 1
+                    ldx #PAGES
+                    jsr crc32
+                    dec round
+                    bne round_loop
+
+                    ldx #3
+print_loop:         lda crc,x
+                    eor #$ff
+                    jsr print_hex8
+                    dex
+                    bpl print_loop ; CHECK: 987AE19E
+                    brk
+
+; Fill the buffer from a linear congruential generator
+fill_buffer:        lda #<BUFFER
+                    sta buffer_ptr
+                    lda #>BUFFER
+                    sta buffer_ptr + 1
+                    ldx #PAGES
+                    ldy #0
+fill_loop:          lda seed
+                    asl
+                    asl
+                    clc
+                    adc seed
+                    clc
+                    adc #17
+                    sta seed
+                    sta (buffer_ptr),y
+                    iny
+                    bne fill_loop
+                    inc buffer_ptr + 1
+                    dex
+                    bne fill_loop
+                    rts
+
+; Update crc with X pages at buffer_ptr, least significant bit first
+crc32:              ldy #0
+byte_loop:          lda (buffer_ptr),y
+                    eor crc
+                    sta crc
+                    lda #8
+                    sta bits
+bit_loop:           lsr crc + 3
+                    ror crc + 2
+                    ror crc + 1
+                    ror crc
+                    bcc no_xor
+                    lda crc + 3     ; Polynomial $edb88320
+                    eor #$ed
+                    sta crc + 3
+                    lda crc + 2
+                    eor #$b8
+                    sta crc + 2
+                    lda crc + 1
+                    eor #$83
+                    sta crc + 1
+                    lda crc
+                    eor #$20
+                    sta crc
+no_xor:             dec bits
+                    bne bit_loop
+                    iny
+                    bne byte_loop
+                    inc buffer_ptr + 1
+                    dex
+                    bne byte_loop
+                    rts
+
+; A contains byte 0-255
+print_hex8:         pha
+                    lsr
+                    lsr
+                    lsr
+                    lsr
+                    jsr print_digit
+                    pla
+                    and #$f
+                    jsr print_digit
+                    rts
+
+; Number is in A (0-15)
+print_digit:        cmp #10
+                    bcs letter
+                    adc #48
+                    sta CONSOLE_OUT
+                    rts
+letter:             adc #(65 - 10 - 1)  ; Carry is set
+                    sta CONSOLE_OUT
+                    rts
@@ -0,0 +1,149 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+;
+; Fills a block with memset, copies it with memcpy, and compares the copy
+; with memcmp, with a different fill value each round.
+;
+
+CONSOLE_OUT = $fffa
+
+SOURCE = $2000
+DEST = $6000
+PAGES = $40
+ROUNDS = 1000
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+
+                    jmp start
+
+; Zero page variables, so the code that follows can be any length
+source_ptr:         dc.s 0
+dest_ptr:           dc.s 0
+round:              dc.s ROUNDS
+errors:             dc.b 0
+
+start:              lda #<SOURCE
+                    sta dest_ptr
+                    lda #>SOURCE
+                    sta dest_ptr + 1
+                    ldx #PAGES
+                    lda round
+                    jsr memset
+
+                    lda #<SOURCE
+                    sta source_ptr
+                    lda #>SOURCE
+                    sta source_ptr + 1
+                    lda #<DEST
+                    sta dest_ptr
+                    lda #>DEST
+                    sta dest_ptr + 1
+                    ldx #PAGES
+                    jsr memcpy
+
+                    lda #<SOURCE
+                    sta source_ptr
+                    lda #>SOURCE
+                    sta source_ptr + 1
+                    lda #<DEST
+                    sta dest_ptr
+                    lda #>DEST
+                    sta dest_ptr + 1
+                    ldx #PAGES
+                    jsr memcmp
+
+                    lda round
+                    bne no_borrow
+                    dec round + 1
+no_borrow:          dec round
+                    lda round
+                    ora round + 1
+                    bne start
+
+                    ldx #0
+print_msg:          lda message,x
+                    beq print_errors
+                    sta CONSOLE_OUT
+                    inx
+                    bne print_msg
+print_errors:       lda errors
+                    jsr print_hex8 ; CHECK: errors 00
+                    brk
+
+; Fill X pages at dest_ptr with A
+memset:             ldy #0
+memset_loop:        sta (dest_ptr),y
+                    iny
+                    bne memset_loop
+                    inc dest_ptr + 1
+                    dex
+                    bne memset_loop
+                    rts
+
+; Copy X pages from source_ptr to dest_ptr. They must not overlap.
+memcpy:             ldy #0
+memcpy_loop:        lda (source_ptr),y
+                    sta (dest_ptr),y
+                    iny
+                    bne memcpy_loop
+                    inc source_ptr + 1
+                    inc dest_ptr + 1
+                    dex
+                    bne memcpy_loop
+                    rts
+
+; Count bytes that differ in X pages at source_ptr and dest_ptr
+memcmp:             ldy #0
+memcmp_loop:        lda (source_ptr),y
+                    cmp (dest_ptr),y
+                    beq same
+                    inc errors
+same:               iny
+                    bne memcmp_loop
+                    inc source_ptr + 1
+                    inc dest_ptr + 1
+                    dex
+                    bne memcmp_loop
+                    rts
+
+; A contains byte 0-255
+print_hex8:         pha
+                    lsr
+                    lsr
+                    lsr
+                    lsr
+                    jsr print_digit
+                    pla
+                    and #$f
+                    jsr print_digit
+                    rts
+
+; Number is in A (0-15)
+print_digit:        cmp #10
+                    bcs letter
+                    adc #48
+                    sta CONSOLE_OUT
+                    rts
+letter:             adc #(65 - 10 - 1)  ; Carry is set
+                    sta CONSOLE_OUT
+                    rts
+
+
+message:            dc "errors ", 0
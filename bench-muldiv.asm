@@ -0,0 +1,172 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+;
+; Multiplies each 16 bit number by a constant, divides the low half of the
+; 32 bit product by the high half, and sums the quotients and remainders.
+;
+
+CONSOLE_OUT = $fffa
+
+COUNT = $10000      ; Multiple of 256, at most $10000
+FACTOR = $9e37
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+
+                    jmp start
+
+; Zero page variables, so the code that follows can be any length
+i:                  dc.s 1
+sum:                dc.s 0
+multiplicand:       dc.s 0
+multiplier:         dc.s 0
+product:            dc.s 0, 0
+dividend:           dc.s 0  ; Becomes the quotient
+divisor:            dc.s 0
+remainder:          dc.s 0
+
+start:              lda i
+                    sta multiplicand
+                    lda i + 1
+                    sta multiplicand + 1
+                    lda #<FACTOR
+                    sta multiplier
+                    lda #>FACTOR
+                    sta multiplier + 1
+                    jsr umul16x16
+
+                    lda product
+                    sta dividend
+                    lda product + 1
+                    sta dividend + 1
+                    lda product + 2
+                    ora #1          ; Never divide by zero
+                    sta divisor
+                    lda product + 3
+                    sta divisor + 1
+                    jsr udiv16
+
+                    clc
+                    lda sum
+                    adc dividend
+                    sta sum
+                    lda sum + 1
+                    adc dividend + 1
+                    sta sum + 1
+                    clc
+                    lda sum
+                    adc remainder
+                    sta sum
+                    lda sum + 1
+                    adc remainder + 1
+                    sta sum + 1
+
+                    inc i
+                    bne start
+                    inc i + 1
+                    lda i + 1
+                    cmp #>COUNT
+                    bne start
+
+                    ldx sum + 1
+                    lda sum
+                    jsr print_hex16 ; CHECK: 1038
+                    brk
+
+; Unsigned multiply, 16 bit inputs, 32 bit output in product. Clobbers
+; multiplier.
+umul16x16:          lda #0
+                    sta product + 2
+                    sta product + 3
+                    ldx #16
+mul_loop:           lsr multiplier + 1
+                    ror multiplier
+                    bcc no_add
+
+                    ; Add the multiplicand to the high half of the product
+                    clc
+                    lda product + 2
+                    adc multiplicand
+                    sta product + 2
+                    lda product + 3
+                    adc multiplicand + 1
+                    sta product + 3
+
+no_add:             ror product + 3     ; Shift in the carry from the add
+                    ror product + 2
+                    ror product + 1
+                    ror product
+                    dex
+                    bne mul_loop
+                    rts
+
+; Unsigned divide, 16 bit dividend and divisor. The quotient replaces the
+; dividend.
+udiv16:             lda #0
+                    sta remainder
+                    sta remainder + 1
+                    ldx #16
+div_loop:           asl dividend
+                    rol dividend + 1
+                    rol remainder
+                    rol remainder + 1
+                    lda remainder
+                    sec
+                    sbc divisor
+                    tay
+                    lda remainder + 1
+                    sbc divisor + 1
+                    bcc no_subtract
+                    sta remainder + 1
+                    sty remainder
+                    inc dividend
+no_subtract:        dex
+                    bne div_loop
+                    rts
+
+; X - high byte
+; A - low byte
+print_hex16:        pha
+                    txa
+                    jsr print_hex8
+                    pla
+                    jsr print_hex8
+                    rts
+
+; A contains byte 0-255
+print_hex8:         pha
+                    lsr
+                    lsr
+                    lsr
+                    lsr
+                    jsr print_digit
+                    pla
+                    and #$f
+                    jsr print_digit
+                    rts
+
+; Number is in A (0-15)
+print_digit:        cmp #10
+                    bcs letter
+                    adc #48
+                    sta CONSOLE_OUT
+                    rts
+letter:             adc #(65 - 10 - 1)  ; Carry is set
+                    sta CONSOLE_OUT
+                    rts
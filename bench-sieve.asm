@@ -0,0 +1,154 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+;
+; Counts the primes below 8192 with the sieve of Eratosthenes, repeatedly.
+;
+
+CONSOLE_OUT = $fffa
+
+FLAGS = $2000       ; Nonzero if the index is composite
+LIMIT = $2000       ; Multiple of 256
+ROUNDS = 600
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+
+                    jmp start
+
+; Zero page variables, so the code that follows can be any length
+flag_ptr:           dc.s 0
+prime:              dc.b 0
+count:              dc.s 0
+round:              dc.s ROUNDS
+
+start:              jsr sieve
+                    lda round
+                    bne no_borrow
+                    dec round + 1
+no_borrow:          dec round
+                    lda round
+                    ora round + 1
+                    bne start
+
+                    ldx count + 1
+                    lda count
+                    jsr print_hex16 ; CHECK: 0404
+                    brk
+
+sieve:              lda #<FLAGS
+                    sta flag_ptr
+                    lda #>FLAGS
+                    sta flag_ptr + 1
+                    ldx #>LIMIT
+                    lda #0
+                    tay
+clear_loop:         sta (flag_ptr),y
+                    iny
+                    bne clear_loop
+                    inc flag_ptr + 1
+                    dex
+                    bne clear_loop
+
+                    ; Only primes up to the square root of the limit need to
+                    ; be crossed off, so they all fit in a byte.
+                    lda #2
+                    sta prime
+prime_loop:         ldx prime
+                    lda FLAGS,x
+                    bne next_prime
+
+                    ; Cross off multiples, starting with 2 * prime
+                    txa
+                    asl
+                    adc #<FLAGS     ; Carry is clear, as prime < 128
+                    sta flag_ptr
+                    lda #>FLAGS
+                    adc #0
+                    sta flag_ptr + 1
+                    ldy #0
+multiple_loop:      lda #1
+                    sta (flag_ptr),y
+                    clc
+                    lda flag_ptr
+                    adc prime
+                    sta flag_ptr
+                    bcc multiple_loop
+                    inc flag_ptr + 1
+                    lda flag_ptr + 1
+                    cmp #>(FLAGS + LIMIT)
+                    bne multiple_loop
+
+next_prime:         inc prime
+                    lda prime
+                    cmp #91         ; 91 * 91 > 8192
+                    bne prime_loop
+
+                    ; Count the zero flags, except for 0 and 1
+                    lda #$fe
+                    sta count
+                    lda #$ff
+                    sta count + 1
+                    lda #<FLAGS
+                    sta flag_ptr
+                    lda #>FLAGS
+                    sta flag_ptr + 1
+                    ldx #>LIMIT
+                    ldy #0
+count_loop:         lda (flag_ptr),y
+                    bne composite
+                    inc count
+                    bne composite
+                    inc count + 1
+composite:          iny
+                    bne count_loop
+                    inc flag_ptr + 1
+                    dex
+                    bne count_loop
+                    rts
+
+; X - high byte
+; A - low byte
+print_hex16:        pha
+                    txa
+                    jsr print_hex8
+                    pla
+                    jsr print_hex8
+                    rts
+
+; A contains byte 0-255
+print_hex8:         pha
+                    lsr
+                    lsr
+                    lsr
+                    lsr
+                    jsr print_digit
+                    pla
+                    and #$f
+                    jsr print_digit
+                    rts
+
+; Number is in A (0-15)
+print_digit:        cmp #10
+                    bcs letter
+                    adc #48
+                    sta CONSOLE_OUT
+                    rts
+letter:             adc #(65 - 10 - 1)  ; Carry is set
+                    sta CONSOLE_OUT
+                    rts
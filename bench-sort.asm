@@ -0,0 +1,134 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+;
+; Bubble sorts a 255 byte array of pseudo-random values, checks that it is
+; in order, and repeats with different contents.
+;
+
+CONSOLE_OUT = $fffa
+
+ARRAY = $1000
+ARRAY_LEN = 255
+ROUNDS = 200
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+
+                    lda #ROUNDS
+                    sta round
+round_loop:         jsr fill_array
+                    jsr sort_array
+                    jsr check_array
+                    dec round
+                    bne round_loop
+
+                    ldx #0
+print_msg:          lda message,x
+                    beq print_errors
+                    sta CONSOLE_OUT
+                    inx
+                    bne print_msg
+print_errors:       lda errors
+                    jsr print_hex8 ; CHECK: errors 00
+                    brk
+
+; Fill the array from a linear congruential generator. Its period is 256,
+; so each round starts one value further along than the last.
+fill_array:         ldy #0
+fill_loop:          lda seed
+                    asl
+                    asl
+                    clc
+                    adc seed
+                    clc
+                    adc #17
+                    sta seed
+                    sta ARRAY,y
+                    iny
+                    cpy #ARRAY_LEN
+                    bne fill_loop
+                    rts
+
+sort_array:         ldy #0
+                    ldx #ARRAY_LEN - 1
+                    lda #0
+                    sta swapped
+sort_loop:          lda ARRAY,y
+                    cmp ARRAY+1,y
+                    bcc no_swap
+                    beq no_swap
+
+                    ; Swap these two
+                    pha
+                    lda ARRAY+1,y
+                    sta ARRAY,y
+                    pla
+                    sta ARRAY+1,y
+                    lda #1
+                    sta swapped
+
+no_swap:            iny
+                    dex
+                    bne sort_loop
+
+                    ; Done one pass, check if we are finished
+                    lda swapped
+                    bne sort_array
+                    rts
+
+; Count adjacent pairs that are out of order
+check_array:        ldy #0
+check_loop:         lda ARRAY,y
+                    cmp ARRAY+1,y
+                    bcc in_order
+                    beq in_order
+                    inc errors
+in_order:           iny
+                    cpy #ARRAY_LEN - 1
+                    bne check_loop
+                    rts
+
+; A contains byte 0-255
+print_hex8:         pha
+                    lsr
+                    lsr
+                    lsr
+                    lsr
+                    jsr print_digit
+                    pla
+                    and #$f
+                    jsr print_digit
+                    rts
+
+; Number is in A (0-15)
+print_digit:        cmp #10
+                    bcs letter
+                    adc #48
+                    sta CONSOLE_OUT
+                    rts
+letter:             adc #(65 - 10 - 1)  ; Carry is set
+                    sta CONSOLE_OUT
+                    rts
+
+
+message:            dc "errors ", 0
+seed:               dc.b 1
+round:              dc.b 0
+swapped:            dc.b 0
+errors:             dc.b 0
@@ -14,11 +14,21 @@
 // limitations under the License.
 //
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "6502-console.h"
 #include "6502-core.h"
+#include "6502-fleet.h"
+#include "6502-history.h"
+#include "6502-profile.h"
+#include "6502-trace.h"
+#ifdef ENABLE_JIT
+#include "6502-jit.h"
+#endif
 
 void cmd_help(int argc, const char *argv[]);
 void cmd_registers(int argc, const char *argv[]);
@@ -27,6 +37,23 @@ void cmd_run(int argc, const char *argv[]);
 void cmd_dump_memory(int argc, const char *argv[]);
 void cmd_set_memory(int argc, const char *argv[]);
 void cmd_step(int argc, const char *argv[]);
+void cmd_save(int argc, const char *argv[]);
+void cmd_load(int argc, const char *argv[]);
+void cmd_save_delta(int argc, const char *argv[]);
+void cmd_reverse_step(int argc, const char *argv[]);
+void cmd_reverse_continue(int argc, const char *argv[]);
+void cmd_goto(int argc, const char *argv[]);
+void cmd_breakpoint(int argc, const char *argv[]);
+void cmd_clear_breakpoint(int argc, const char *argv[]);
+void cmd_ignore_breakpoint(int argc, const char *argv[]);
+void cmd_list_breakpoints(int argc, const char *argv[]);
+void cmd_watchpoint(int argc, const char *argv[]);
+void cmd_clear_watchpoint(int argc, const char *argv[]);
+void cmd_list_watchpoints(int argc, const char *argv[]);
+void cmd_trace(int argc, const char *argv[]);
+#ifdef ENABLE_PROFILE
+void cmd_profile(int argc, const char *argv[]);
+#endif
 
 struct debug_command {
     const char *name;
@@ -39,14 +66,59 @@ struct debug_command {
     {"run", "Run program [address]", cmd_run},
     {"dm", "Dump memory [start addr] [length]", cmd_dump_memory},
     {"sm", "Set memory [start addr] [byte1] [byte2]...", cmd_set_memory},
-    {"s", "Single step", cmd_step}
+    {"s", "Single step", cmd_step},
+    {"rs", "Step backwards [count]", cmd_reverse_step},
+    {"rc", "Run backwards to [address] or the last breakpoint",
+        cmd_reverse_continue},
+    {"goto", "Go to the state after <instruction count>", cmd_goto},
+    {"b", "Set a breakpoint at <address> [if <condition>]",
+        cmd_breakpoint},
+    {"bc", "Clear the breakpoint at <address>", cmd_clear_breakpoint},
+    {"bi", "Run through the breakpoint at <address> <count> times",
+        cmd_ignore_breakpoint},
+    {"bl", "List breakpoints", cmd_list_breakpoints},
+    {"w", "Stop when <start addr> [end addr] is accessed [r|w|rw]",
+        cmd_watchpoint},
+    {"wc", "Clear the watchpoint starting at <address>",
+        cmd_clear_watchpoint},
+    {"wl", "List watchpoints", cmd_list_watchpoints},
+    {"trace", "Record instructions to [filename], or stop", cmd_trace},
+#ifdef ENABLE_PROFILE
+    {"prof", "Show the [count] most executed, start/stop counting, "
+        "symbols <file>, or folded <file> [cycles]", cmd_profile},
+#endif
+    {"save", "Save processor state <filename>", cmd_save},
+    {"load", "Restore processor state <filename>", cmd_load},
+    {"delta", "Save changes since the last save or load <filename>",
+        cmd_save_delta}
 };
 
 #define NUM_CMDS ((int) (sizeof(CMDS) / sizeof(struct debug_command)))
 
+// Instructions a fleet instance runs before its thread moves on to the
+// next one
+#define FLEET_SLICE 100000
+
 static struct m6502 proc;
+static struct history history;
+static uint64_t history_interval = 1000000;
+static int history_snapshots = 1024;
 static uint16_t next_disassemble_addr;
 static uint16_t next_dump_addr;
+static int use_jit = 1;
+static int load_addr = 0;
+static int entry = -1;
+static int load_flags = 0;
+
+static const char *STOP_REASONS[] = {
+    "running",
+    "instruction budget",
+    "BRK",
+    "invalid instruction",
+    "I/O write",
+    "breakpoint",
+    "watchpoint"
+};
 
 int parse_number(const char *num) {
     if (num[0] == '$') {
@@ -96,18 +168,197 @@ void cmd_set_memory(int argc, const char *argv[]) {
 
     uint16_t base_addr = parse_number(argv[1]);
     for (int i = 2; i < argc; i++) {
-        proc.memory[base_addr + i - 2] = parse_number(argv[i]) & 0xff;
+        write_mem_u8(&proc, base_addr + i - 2, parse_number(argv[i]) & 0xff);
     }
+
+    restart_history(&history, &proc);
+}
+
+// Describe stopping at a breakpoint, with the instruction it is at, or at
+// a watchpoint, with the access and the instruction that made it. Returns
+// 0 if the reason is neither.
+static int show_debug_stop(enum stop_reason reason) {
+    if (reason == STOP_BREAKPOINT) {
+        printf("Breakpoint\n");
+        disassemble(&proc, proc.pc, 1);
+    } else if (reason == STOP_WATCHPOINT) {
+        const struct watch_hit *hit = &proc.watch_hit;
+        if (hit->flags == WATCH_WRITE) {
+            printf("Watchpoint: wrote $%04x: $%02x -> $%02x\n", hit->addr,
+                hit->old_value, hit->new_value);
+        } else {
+            printf("Watchpoint: read $%04x: $%02x\n", hit->addr,
+                hit->new_value);
+        }
+
+        disassemble(&proc, hit->pc, 1);
+    } else {
+        return 0;
+    }
+
+    return 1;
 }
 
 void cmd_run(int argc, const char *argv[]) {
     if (argc >= 2) {
         proc.pc = parse_number(argv[1]);
+        restart_history(&history, &proc);
     }
 
-    run_emulator(&proc, 0);
-    printf("Halted\n");
-    dump_regs(&proc);
+    enum stop_reason reason = run_history(&history, &proc, UINT64_MAX);
+    if (!show_debug_stop(reason)) {
+        printf("Halted\n");
+        dump_regs(&proc);
+    }
+}
+
+void cmd_breakpoint(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing address\n");
+        return;
+    }
+
+    // The condition was split into words, so put it back together. It is
+    // compiled here, once, rather than each time the breakpoint is hit.
+    struct condition condition;
+    condition.length = 0;
+    condition.text[0] = '\0';
+    if (argc > 2) {
+        if (strcmp(argv[2], "if") != 0 || argc == 3) {
+            printf("Expected if <condition>\n");
+            return;
+        }
+
+        char text[MAX_CONDITION_TEXT * 2] = "";
+        for (int i = 3; i < argc; i++) {
+            if (strlen(text) + strlen(argv[i]) + 2 > sizeof(text)) {
+                printf("Condition is too long\n");
+                return;
+            }
+
+            strcat(text, argv[i]);
+            if (i < argc - 1) {
+                strcat(text, " ");
+            }
+        }
+
+        const char *error;
+        if (compile_condition(&condition, text, &error) < 0) {
+            printf("%s\n", error);
+            return;
+        }
+    }
+
+    uint16_t addr = parse_number(argv[1]);
+    if (set_breakpoint(&proc, addr) < 0) {
+        perror("error setting breakpoint");
+        return;
+    }
+
+    find_breakpoint(&proc, addr)->condition = condition;
+}
+
+void cmd_ignore_breakpoint(int argc, const char *argv[]) {
+    if (argc < 3) {
+        printf("Missing address or count\n");
+        return;
+    }
+
+    struct breakpoint *breakpoint = find_breakpoint(&proc,
+        parse_number(argv[1]));
+    if (breakpoint == NULL) {
+        printf("No breakpoint at that address\n");
+        return;
+    }
+
+    breakpoint->ignore = parse_number(argv[2]);
+}
+
+void cmd_clear_breakpoint(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing address\n");
+        return;
+    }
+
+    if (clear_breakpoint(&proc, parse_number(argv[1])) < 0) {
+        printf("No breakpoint at that address\n");
+    }
+}
+
+void cmd_list_breakpoints(int argc, const char *argv[]) {
+    if (proc.num_breakpoints == 0) {
+        printf("No breakpoints\n");
+        return;
+    }
+
+    for (int addr = 0; addr < MEM_SIZE; addr++) {
+        if (is_breakpoint(&proc, addr)) {
+            const struct breakpoint *breakpoint = find_breakpoint(&proc, addr);
+            disassemble(&proc, addr, 1);
+            if (breakpoint->condition.length) {
+                printf("    if %s\n", breakpoint->condition.text);
+            }
+
+            printf("    hit %" PRIu64 " times", breakpoint->hits);
+            if (breakpoint->ignore) {
+                printf(", ignoring the next %" PRIu64, breakpoint->ignore);
+            }
+
+            printf("\n");
+        }
+    }
+}
+
+static const char *WATCH_TYPES[] = { "", "r", "w", "rw" };
+
+void cmd_watchpoint(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing address\n");
+        return;
+    }
+
+    uint16_t start = parse_number(argv[1]);
+    uint16_t end = start;
+    int flags = WATCH_WRITE;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "r") == 0) {
+            flags = WATCH_READ;
+        } else if (strcmp(argv[i], "w") == 0) {
+            flags = WATCH_WRITE;
+        } else if (strcmp(argv[i], "rw") == 0) {
+            flags = WATCH_READ | WATCH_WRITE;
+        } else {
+            end = parse_number(argv[i]);
+        }
+    }
+
+    if (add_watchpoint(&proc, start, end, flags) < 0) {
+        perror("error setting watchpoint");
+    }
+}
+
+void cmd_clear_watchpoint(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing address\n");
+        return;
+    }
+
+    if (remove_watchpoint(&proc, parse_number(argv[1])) < 0) {
+        printf("No watchpoint at that address\n");
+    }
+}
+
+void cmd_list_watchpoints(int argc, const char *argv[]) {
+    if (proc.num_watchpoints == 0) {
+        printf("No watchpoints\n");
+        return;
+    }
+
+    for (int i = 0; i < proc.num_watchpoints; i++) {
+        const struct watchpoint *watch = &proc.watchpoints[i];
+        printf("$%04x-$%04x %s\n", watch->start, watch->end,
+            WATCH_TYPES[watch->flags]);
+    }
 }
 
 void cmd_help(int argc, const char *argv[]) {
@@ -118,22 +369,179 @@ void cmd_help(int argc, const char *argv[]) {
 }
 
 void cmd_step(int argc, const char *argv[]) {
-    run_emulator(&proc, 1);
+    show_debug_stop(run_history(&history, &proc, 1));
+}
+
+static void show_position() {
+    printf("Instruction %" PRIu64 "\n", proc.instructions);
+    dump_regs(&proc);
+}
+
+void cmd_reverse_step(int argc, const char *argv[]) {
+    uint64_t count = argc >= 2 ? strtoull(argv[1], NULL, 10) : 1;
+    if (count > proc.instructions
+            || seek_history(&history, &proc, proc.instructions - count) < 0) {
+        printf("Not in history\n");
+        return;
+    }
+
+    show_debug_stop(proc.halt);
+    show_position();
+}
+
+void cmd_reverse_continue(int argc, const char *argv[]) {
+    if (argc >= 2) {
+        if (reverse_to_address(&history, &proc, parse_number(argv[1])) < 0) {
+            printf("Reached start of history\n");
+        } else {
+            show_debug_stop(proc.halt);
+        }
+    } else if (reverse_to_breakpoint(&history, &proc) < 0) {
+        printf("Reached start of history\n");
+    } else {
+        show_debug_stop(STOP_BREAKPOINT);
+    }
+
+    show_position();
+}
+
+void cmd_goto(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing instruction count\n");
+        return;
+    }
+
+    if (seek_history(&history, &proc, strtoull(argv[1], NULL, 10)) < 0) {
+        printf("Not in history\n");
+        return;
+    }
+
+    show_debug_stop(proc.halt);
+    show_position();
+}
+
+void cmd_save(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing filename\n");
+        return;
+    }
+
+    if (save_state(&proc, argv[1]) < 0) {
+        perror("error saving state");
+    }
 }
 
-void load_program(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("error opening file");
+void cmd_load(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing filename\n");
+        return;
+    }
+
+    if (load_state(&proc, argv[1]) < 0) {
+        perror("error loading state");
+        return;
+    }
+
+    clear_history(&history);
+    restart_history(&history, &proc);
+    dump_regs(&proc);
+}
+
+void cmd_save_delta(int argc, const char *argv[]) {
+    if (argc < 2) {
+        printf("Missing filename\n");
+        return;
+    }
+
+    if (save_delta(&proc, argv[1]) < 0) {
+        perror("error saving state");
+    }
+}
+
+// Output from instructions that are run again when going back in time
+// was already printed the first time.
+static int monitor_console(struct m6502 *p, uint16_t addr, uint8_t val,
+                           void *context) {
+    if (addr != CONSOLE_OUT) {
+        return 0;
+    }
+
+    if (!history.replaying) {
+        console_put(p->console, val);
+    }
+
+    return 1;
+}
+
+void cmd_trace(int argc, const char *argv[]) {
+    if (argc < 2) {
+        if (stop_trace(&proc) < 0) {
+            perror("error writing trace");
+        }
+    } else if (start_trace(&proc, argv[1]) < 0) {
+        perror("error starting trace");
+    }
+}
+
+#ifdef ENABLE_PROFILE
+void cmd_profile(int argc, const char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "start") == 0) {
+        if (start_profile(&proc) < 0) {
+            perror("error starting profile");
+        }
+    } else if (argc >= 2 && strcmp(argv[1], "stop") == 0) {
+        stop_profile(&proc);
+    } else if (proc.profile == NULL) {
+        printf("Not profiling (use prof start)\n");
+    } else if (argc >= 2 && strcmp(argv[1], "symbols") == 0) {
+        if (argc < 3) {
+            printf("Missing filename\n");
+        } else if (load_symbols(&proc, argv[2]) < 0) {
+            perror("error loading symbols");
+        }
+    } else if (argc >= 2 && strcmp(argv[1], "folded") == 0) {
+        if (argc < 3) {
+            printf("Missing filename\n");
+            return;
+        }
+
+        FILE *file = fopen(argv[2], "w");
+        if (file == NULL) {
+            perror("error writing call graph");
+            return;
+        }
+
+        write_folded(&proc, file, argc >= 4 && strcmp(argv[3], "cycles") == 0);
+        fclose(file);
+    } else {
+        print_profile(&proc, argc >= 2 ? parse_number(argv[1]) : 20);
+    }
+}
+#endif
+
+void start_jit(struct m6502 *p) {
+#ifdef ENABLE_JIT
+    if (use_jit && jit_enable(p) < 0) {
+        fprintf(stderr, "Unable to allocate JIT code buffer, interpreting\n");
+    }
+#endif
+}
+
+void load_program(struct m6502 *p, const char *filename) {
+    if (load_image(p, filename, load_addr, load_flags) < 0) {
+        perror("error loading image");
         exit(1);
     }
 
-    fread(proc.memory, MEM_SIZE, 1, file);
-    fclose(file);
+    if (entry >= 0) {
+        p->pc = entry;
+    } else {
+        reset_proc(p);
+    }
 }
 
 void dispatch_command(char *command) {
-    const int MAX_ARGS = 16;
+    const int MAX_ARGS = 32;    // Breakpoint conditions take several
     const char *argv[MAX_ARGS];
     int argc;
 
@@ -172,21 +580,144 @@ void monitor_loop() {
 
         command[strlen(command) - 1] = '\0'; // strip newline
         dispatch_command(command);
+
+        // Commands like s run without stopping, which doesn't flush
+        flush_console(proc.console);
+    }
+}
+
+// Run num_instances copies of the given images, assigning them in turn,
+// and print what each one did.
+void run_images_in_fleet(char *images[], int num_images, int num_instances,
+                         int num_threads, uint64_t max_instructions,
+                         int stats) {
+    struct fleet_instance *instances = calloc(num_instances,
+        sizeof(struct fleet_instance));
+    if (instances == NULL) {
+        fprintf(stderr, "Unable to allocate instances\n");
+        exit(1);
+    }
+
+    // Load each image once, and fork the rest of its instances from it.
+    // Instances are interpreted: each one would need its own JIT code
+    // buffer, which costs far more than the instance with thousands of
+    // them.
+    for (int i = 0; i < num_instances; i++) {
+        if (i < num_images) {
+            init_instance(&instances[i], images[i]);
+            load_program(&instances[i].proc, instances[i].name);
+        } else {
+            fork_instance(&instances[i], &instances[i % num_images],
+                images[i % num_images]);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_fleet(instances, num_instances, num_threads, FLEET_SLICE,
+        max_instructions);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t total_instructions = 0;
+    for (int i = 0; i < num_instances; i++) {
+        struct fleet_instance *instance = &instances[i];
+        printf("instance %d (%s): %s after %" PRIu64 " instructions\n", i,
+            instance->name, STOP_REASONS[instance->result],
+            instance->proc.instructions);
+        size_t length;
+        const char *output = console_output(instance->proc.console, &length);
+        if (length > 0) {
+            fwrite(output, 1, length, stdout);
+            if (output[length - 1] != '\n') {
+                printf("\n");
+            }
+        }
+
+        dump_regs(&instance->proc);
+        total_instructions += instance->proc.instructions;
+    }
+
+    if (stats) {
+        double seconds = (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%d instances, %" PRIu64 " instructions in %.3f s "
+            "on %d threads (%.2f MIPS)\n", num_instances, total_instructions,
+            seconds, num_threads, total_instructions / seconds / 1e6);
     }
 }
 
 int main(int argc, char *argv[]) {
     int opt;
     int debug = 0;
-
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    int stats = 0;
+    int num_instances = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t max_instructions = 0;
+    const char *trace_file = NULL;
+    int profile = 0;
+    const char *folded_file = NULL;
+    const char *symbol_file = NULL;
+    int line_output = 0;
+
+    while ((opt = getopt(argc, argv, "c:de:f:g:ik:l:m:nprst:x:y:")) != -1) {
         switch (opt) {
+            case 'c':
+                history_interval = strtoull(optarg, NULL, 10);
+                break;
             case 'd':
                 debug = 1;
                 break;
+            case 'e':
+                entry = parse_number(optarg) & 0xffff;
+                break;
+            case 'f':
+                num_instances = parse_number(optarg);
+                break;
+            case 'g':
+                folded_file = optarg;
+                profile = 1;
+                break;
+            case 'i':
+                use_jit = 0;
+                break;
+            case 'k':
+                history_snapshots = parse_number(optarg);
+                break;
+            case 'l':
+                load_addr = parse_number(optarg) & 0xffff;
+                break;
+            case 'm':
+                max_instructions = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                line_output = 1;
+                break;
+            case 'p':
+                profile = 1;
+                break;
+            case 'r':
+                load_flags |= MAP_READ_ONLY;
+                break;
+            case 's':
+                stats = 1;
+                break;
+            case 't':
+                num_threads = parse_number(optarg);
+                break;
+            case 'x':
+                trace_file = optarg;
+                break;
+            case 'y':
+                symbol_file = optarg;
+                break;
             default: /* '?' */
-                fprintf(stderr, "Usage: %s [-d] <binary file>\n",
-                        argv[0]);
+                fprintf(stderr, "Usage: %s [-d] [-i] [-s] [-r] [-p] [-n] "
+                        "[-l load addr] [-e entry addr] [-f instances] "
+                        "[-t threads] "
+                        "[-m max instructions] [-c snapshot interval] "
+                        "[-k max snapshots] [-x trace file] "
+                        "[-g folded call graph file] [-y symbol file] "
+                        "<binary file>...\n", argv[0]);
                 exit(1);
         }
     }
@@ -196,12 +727,85 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (num_instances > 0) {
+        run_images_in_fleet(argv + optind, argc - optind, num_instances,
+            num_threads > 0 ? num_threads : 1, max_instructions, stats);
+        return 0;
+    }
+
     init_proc(&proc);
-    load_program(argv[optind]);
+    if (line_output) {
+        proc.console->flags |= CONSOLE_FLUSH_NEWLINE;
+    }
+
+    start_jit(&proc);
+    load_program(&proc, argv[optind]);
+    if (trace_file && start_trace(&proc, trace_file) < 0) {
+        perror("error starting trace");
+        exit(1);
+    }
+
+    if (symbol_file && !profile) {
+        fprintf(stderr, "Symbols are only used for profiling (-p or -g)\n");
+        exit(1);
+    }
+
+    if (profile) {
+#ifdef ENABLE_PROFILE
+        if (start_profile(&proc) < 0) {
+            perror("error starting profile");
+            exit(1);
+        }
+
+        if (symbol_file && load_symbols(&proc, symbol_file) < 0) {
+            perror("error loading symbols");
+            exit(1);
+        }
+#else
+        fprintf(stderr, "%s needs a build with PROFILE=1\n",
+            folded_file ? "Call graph output" : "Profiling");
+        exit(1);
+#endif
+    }
+
     if (debug) {
+        init_history(&history, history_interval, history_snapshots);
+        map_handlers(&proc, CONSOLE_OUT >> PAGE_SHIFT, 1, NULL,
+            monitor_console, NULL);
+        restart_history(&history, &proc);
         monitor_loop();
     } else {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         run_emulator(&proc, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (stats) {
+            double seconds = (end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9;
+            fprintf(stderr, "%" PRIu64 " instructions, %" PRIu64
+                " cycles in %.3f s (%.2f emulated MHz)\n", proc.instructions,
+                proc.cycles, seconds, proc.cycles / seconds / 1e6);
+        }
+
+#ifdef ENABLE_PROFILE
+        if (folded_file) {
+            FILE *file = fopen(folded_file, "w");
+            if (file == NULL) {
+                perror("error writing call graph");
+                exit(1);
+            }
+
+            write_folded(&proc, file, 0);
+            fclose(file);
+        } else if (proc.profile) {
+            print_profile(&proc, 20);
+        }
+#endif
+    }
+
+    if (stop_trace(&proc) < 0) {
+        perror("error writing trace");
+        return 1;
     }
 
     return 0;
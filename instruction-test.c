@@ -14,9 +14,22 @@
 // limitations under the License.
 //
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "6502-console.h"
 #include "6502-core.h"
+#include "6502-fleet.h"
+#include "6502-history.h"
+#include "6502-profile.h"
+#include "6502-trace.h"
+#ifdef ENABLE_JIT
+#include "6502-jit.h"
+#endif
 
 #define TEST_EQ(x, y) { \
     if ((x) != (y)) { printf("Test failed (line %d): $%x != $%x\n", \
@@ -32,8 +45,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0xc5);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Test Z flag
     proc.memory[0] = 0xa9; // LDA #0
@@ -41,8 +54,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0);
-    TEST_EQ(proc.z, 1);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Immediate addressing mode
     proc.memory[0] = 0xa9; // LDA #$24
@@ -50,8 +63,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x24);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute
     proc.memory[0] = 0xad; // LDA $100
@@ -61,8 +74,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0xa9);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Zero page
     proc.memory[0] = 0xa5; // LDA $20
@@ -71,8 +84,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x52);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute indexed
     proc.memory[0] = 0xbd; // LDA $102,X
@@ -135,8 +148,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.x, 0x24);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute
     proc.memory[0] = 0xae; // LDX $100
@@ -146,8 +159,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0xa9);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Zero page
     proc.memory[0] = 0xa6; // LDX $20
@@ -157,8 +170,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x52);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Zero Page, Y
     proc.memory[0] = 0xb6; // LDX $60,Y
@@ -169,8 +182,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x71);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute, Y
     proc.memory[0] = 0xbe; // LDX $383,Y
@@ -182,8 +195,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x96);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // LDY. This is a group 3 instruction with a different
     // encoding for addressing modes.
@@ -193,8 +206,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.y, 0x24);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute
     proc.memory[0] = 0xac; // LDY $100
@@ -204,8 +217,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.y, 0xa9);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Zero page
     proc.memory[0] = 0xa4; // LDY $20
@@ -215,8 +228,8 @@ void test_ld() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.y, 0x52);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Absolute indexed
     proc.memory[0] = 0xbc; // LDY $101,X
@@ -389,73 +402,73 @@ void test_adc() {
     proc.a = 0x27;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x3a);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Carry in
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.a = 0x27;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x3b);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Carry out, no overflow
     proc.pc = 0;
     proc.memory[0] = 0x69; // ADC #192
     proc.memory[1] = 192;
     proc.a = 127;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 63);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Carry out, overflow
     proc.pc = 0;
     proc.memory[0] = 0x69; // ADC #192
     proc.memory[1] = 192;
     proc.a = 128;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 64);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.v, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 1);
 
     // Overflow, no carry out
     proc.pc = 0;
     proc.memory[0] = 0x69; // ADC #192
     proc.memory[1] = 126;
     proc.a = 3;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 129);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.v, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 1);
 
     // Zero result
     proc.memory[0] = 0x69; // ADC #-23
     proc.memory[1] = 233;
     proc.a = 23;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0);
-    TEST_EQ(proc.z, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Zero page
     proc.memory[0] = 0x65; // ADC $23
@@ -463,14 +476,14 @@ void test_adc() {
     proc.memory[2] = 0;
     proc.memory[0x23] = 0x64;
     proc.a = 0x12;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x77);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 }
 
 void test_sbc() {
@@ -482,13 +495,13 @@ void test_sbc() {
     proc.memory[1] = 0x13;
     proc.memory[2] = 0;
     proc.a = 0x27;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x14);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 1); // Borrow is reversed vs. adc
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1); // Borrow is reversed vs. adc
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Zero page
     proc.memory[0] = 0xe5; // SBC $33
@@ -496,14 +509,14 @@ void test_sbc() {
     proc.memory[2] = 0;
     proc.memory[0x33] = 0x8;
     proc.a = 0x12;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0xa); // XXX this may be wrong given carry is zero
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 }
 
 void test_branch() {
@@ -539,105 +552,105 @@ void test_branch() {
     proc.memory[3] = 0x00;
     proc.memory[4] = 0x00;
     proc.memory[5] = 0x00;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BCS, not taken
     proc.pc = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BCC, taken
     proc.pc = 0;
     proc.memory[0] = 0x90; // BCC +3
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BCC, not taken
     proc.pc = 0;
     proc.memory[0] = 0x90; // BCC +3
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BVS, taken
     proc.pc = 0;
     proc.memory[0] = 0x70; // BVS +3
-    proc.v = 1;
+    set_flag(&proc, FLAG_V, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BVS, not taken
     proc.pc = 0;
-    proc.v = 0;
+    set_flag(&proc, FLAG_V, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BVC, taken
     proc.pc = 0;
     proc.memory[0] = 0x50; // BVC +3
-    proc.v = 0;
+    set_flag(&proc, FLAG_V, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BVC, not taken
     proc.pc = 0;
-    proc.v = 1;
+    set_flag(&proc, FLAG_V, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BMI, taken
     proc.pc = 0;
     proc.memory[0] = 0x30; // BMI +3
-    proc.n = 1;
+    set_flag(&proc, FLAG_N, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BMI, not taken
     proc.pc = 0;
-    proc.n = 0;
+    set_flag(&proc, FLAG_N, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BPL, taken
     proc.pc = 0;
     proc.memory[0] = 0x10; // BPL +3
-    proc.n = 0;
+    set_flag(&proc, FLAG_N, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BPL, not taken
     proc.pc = 0;
-    proc.n = 1;
+    set_flag(&proc, FLAG_N, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BEQ, taken
     proc.pc = 0;
     proc.memory[0] = 0xf0; // BEQ +3
-    proc.z = 1;
+    set_flag(&proc, FLAG_Z, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BEQ, not taken
     proc.pc = 0;
-    proc.z = 0;
+    set_flag(&proc, FLAG_Z, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 
     // BNE, taken
     proc.pc = 0;
     proc.memory[0] = 0xd0; // BNE +3
-    proc.z = 0;
+    set_flag(&proc, FLAG_Z, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 6);
 
     // BNE, not taken
     proc.pc = 0;
-    proc.z = 1;
+    set_flag(&proc, FLAG_Z, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.pc, 3);
 }
@@ -649,33 +662,33 @@ void test_shifts() {
     // Accumulator, no carry in, carry out
     proc.memory[0] = 0x2a; // ROL
     proc.memory[1] = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     proc.a = 0x9c;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x38);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Carry in, carry out
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.a = 0x9c;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x39);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // No carry in, no carry out
     proc.pc = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     proc.a = 0x7c;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0xf8);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Memory location, no carry in, carry out
     proc.memory[0] = 0x2e; // ROL $100
@@ -684,68 +697,68 @@ void test_shifts() {
     proc.memory[3] = 0;
     proc.memory[0x100] = 0xe4;
     proc.pc = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.memory[0x100], 0xc8);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Memory location, carry in, no carry out
     proc.memory[0x100] = 0x75;
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     run_emulator(&proc, 0);
     TEST_EQ(proc.memory[0x100], 0xeb);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Location gets set to zero
     proc.memory[0x100] = 0x80;
     proc.pc = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
     TEST_EQ(proc.memory[0x100], 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 1);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
 
     // Test ROR
     proc.memory[0] = 0x6a; // ROR
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.a = 0x9d;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0xce);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // LSR does not shift in the carry
     proc.memory[0] = 0x4a; // LSR
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.a = 0x6d;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x36);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // ASL does not shift in the carry
     proc.memory[0] = 0xa; // ASL
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     proc.a = 0x9d;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x3a);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 }
 
 void test_logical() {
@@ -758,9 +771,9 @@ void test_logical() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x81);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0x9; // ORA #$91
     proc.memory[1] = 0x91;
@@ -768,9 +781,9 @@ void test_logical() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x99);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0x49; // EOR #$91
     proc.memory[1] = 0x91;
@@ -778,9 +791,9 @@ void test_logical() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0x11);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 }
 
 void test_jsr_rts() {
@@ -836,8 +849,52 @@ void test_stack() {
     run_emulator(&proc, 0);
     TEST_EQ(proc.s, 0xff);
     TEST_EQ((uint8_t) proc.a, 0xe2);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+}
+
+void test_status_stack() {
+    struct m6502 proc;
+    init_proc(&proc);
+
+    // Push. B and the unused bit are always set in the pushed copy.
+    proc.memory[0] = 0x08; // PHP
+    proc.memory[1] = 0;
+    set_flag(&proc, FLAG_N, 1);
+    set_flag(&proc, FLAG_Z, 1);
+    set_flag(&proc, FLAG_C, 1);
+    set_flag(&proc, FLAG_D, 1);
+    run_emulator(&proc, 0);
+    TEST_EQ(proc.s, 0xfe);
+    TEST_EQ(proc.memory[0x1ff], 0xbb);
+
+    // Pop
+    proc.memory[0] = 0x28; // PLP
+    proc.memory[0x1ff] = 0xd5;
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ(proc.s, 0xff);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 1);
+    TEST_EQ(get_flag(&proc, FLAG_B), 0);
+    TEST_EQ(get_flag(&proc, FLAG_D), 0);
+    TEST_EQ(get_flag(&proc, FLAG_I), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_status(&proc), 0xe5);
+
+    // Return from interrupt: pops flags, then the return address
+    proc.memory[0] = 0x40; // RTI
+    proc.memory[0x1fd] = 0x03;
+    proc.memory[0x1fe] = 0x34;
+    proc.memory[0x1ff] = 0x12;
+    proc.memory[0x1234] = 0; // BRK
+    proc.s = 0xfc;
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ(proc.s, 0xff);
+    TEST_EQ(proc.pc, 0x1235);
+    TEST_EQ(get_status(&proc), 0x23);
 }
 
 void test_transfer() {
@@ -852,8 +909,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x8d);
     TEST_EQ((uint8_t) proc.x, 0x8d);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Transfer a zero
     proc.a = 0;
@@ -862,8 +919,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ(proc.a, 0);
     TEST_EQ(proc.x, 0);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
 
     proc.memory[0] = 0x8a; // TXA
     proc.memory[1] = 0;
@@ -873,8 +930,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x8d);
     TEST_EQ((uint8_t) proc.x, 0x8d);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0x9a; // TXS
     proc.memory[1] = 0;
@@ -884,8 +941,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.s, 0xd6);
     TEST_EQ((uint8_t) proc.x, 0xd6);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0xba; // TSX
     proc.memory[1] = 0;
@@ -895,8 +952,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.s, 0x6b);
     TEST_EQ((uint8_t) proc.x, 0x6b);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0xa8; // TAY
     proc.memory[1] = 0;
@@ -906,8 +963,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x8f);
     TEST_EQ((uint8_t) proc.y, 0x8f);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     proc.memory[0] = 0x98; // TYA
     proc.memory[1] = 0;
@@ -917,8 +974,8 @@ void test_transfer() {
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.a, 0x14);
     TEST_EQ((uint8_t) proc.y, 0x14);
-    TEST_EQ(proc.n, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 }
 
 void test_inc_dec() {
@@ -931,24 +988,24 @@ void test_inc_dec() {
     proc.x = 0x23;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x24);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Increment to negative
     proc.x = 0x7f;
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x80);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Increment to zero
     proc.x = 0xff;
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.x, 0x0);
-    TEST_EQ(proc.z, 1);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Decrement X
     proc.memory[0] = 0xca; // DEX
@@ -965,8 +1022,8 @@ void test_inc_dec() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ((uint8_t) proc.y, 0x24);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // Decrement Y
     proc.memory[0] = 0x88; // DEY
@@ -984,8 +1041,8 @@ void test_inc_dec() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.memory[0xf0], 0x83);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
 
     // Decrement memory location
     proc.memory[0] = 0xc6; // DEC $f0
@@ -995,8 +1052,8 @@ void test_inc_dec() {
     proc.pc = 0;
     run_emulator(&proc, 0);
     TEST_EQ(proc.memory[0xf7], 0);
-    TEST_EQ(proc.z, 1);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 }
 
 void test_set_clear_flags() {
@@ -1005,37 +1062,37 @@ void test_set_clear_flags() {
 
     proc.memory[0] = 0x18; // CLC
     proc.memory[1] = 0;
-    proc.c = 1;
+    set_flag(&proc, FLAG_C, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
 
     proc.memory[0] = 0x38; // SEC
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.c = 0;
+    set_flag(&proc, FLAG_C, 0);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 1);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
 
     proc.memory[0] = 0xf8; // SED
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.d = 0;
+    set_flag(&proc, FLAG_D, 0);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.d, 1);
+    TEST_EQ(get_flag(&proc, FLAG_D), 1);
 
     proc.memory[0] = 0xd8; // CLD
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.d = 1;
+    set_flag(&proc, FLAG_D, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.d, 0);
+    TEST_EQ(get_flag(&proc, FLAG_D), 0);
 
     proc.memory[0] = 0xb8; // CLV
     proc.memory[1] = 0;
     proc.pc = 0;
-    proc.v = 1;
+    set_flag(&proc, FLAG_V, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 }
 
 // Ensure comparisons don't look at carry in.
@@ -1049,24 +1106,24 @@ void test_compare() {
     proc.memory[2] = 0;
     proc.a = 0x76;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.a, 0x76);
 
     // A = operand
     proc.a = 0x77;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.z, 1);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
     TEST_EQ(proc.a, 0x77);
 
     // A > operand
     proc.a = 0x78;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.a, 0x78);
 
     // X < operand
@@ -1074,16 +1131,16 @@ void test_compare() {
     proc.x = 0x76;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.x, 0x76);
 
     // X > operand
     proc.x = 0x78;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.x, 0x78);
 
     // Y < operand
@@ -1091,16 +1148,16 @@ void test_compare() {
     proc.y = 0x76;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.y, 0x76);
 
     // Y > operand
     proc.y = 0x78;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.c, 1);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_C), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
     TEST_EQ(proc.y, 0x78);
 }
 
@@ -1118,9 +1175,10 @@ void test_bit() {
     proc.memory[0x20] = 0x80;
     proc.a = 0;
     proc.pc = 0;
-    proc.n = 0;
+    set_flag(&proc, FLAG_N, 0);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.n, 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1); // Both set at once
 
     // N = 0
     proc.memory[0] = 0x24; // BIT $20
@@ -1129,9 +1187,9 @@ void test_bit() {
     proc.memory[0x20] = 0x7f;
     proc.a = 0;
     proc.pc = 0;
-    proc.n = 1;
+    set_flag(&proc, FLAG_N, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.n, 0);
+    TEST_EQ(get_flag(&proc, FLAG_N), 0);
 
     // V = 1
     proc.memory[0] = 0x24; // BIT $20
@@ -1140,9 +1198,9 @@ void test_bit() {
     proc.memory[0x20] = 0x40;
     proc.a = 0;
     proc.pc = 0;
-    proc.v = 0;
+    set_flag(&proc, FLAG_V, 0);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.v, 1);
+    TEST_EQ(get_flag(&proc, FLAG_V), 1);
 
     // V = 0
     proc.memory[0] = 0x24; // BIT $20
@@ -1151,9 +1209,9 @@ void test_bit() {
     proc.memory[0x20] = 0xbf;
     proc.a = 0;
     proc.pc = 0;
-    proc.v = 1;
+    set_flag(&proc, FLAG_V, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.v, 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 0);
 
     // Z = 1
     proc.memory[0] = 0x24; // BIT $20
@@ -1162,9 +1220,9 @@ void test_bit() {
     proc.memory[0x20] = 0xa5;
     proc.a = 0x5a;
     proc.pc = 0;
-    proc.z = 0;
+    set_flag(&proc, FLAG_Z, 0);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.z, 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 1);
 
     // Z = 0
     proc.memory[0] = 0x24; // BIT $20
@@ -1173,9 +1231,9 @@ void test_bit() {
     proc.memory[0x20] = 0xa7;
     proc.a = 0x5a;
     proc.pc = 0;
-    proc.z = 1;
+    set_flag(&proc, FLAG_Z, 1);
     run_emulator(&proc, 0);
-    TEST_EQ(proc.z, 0);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
 
     // Absolute
     proc.memory[0] = 0x2c; // BIT $120
@@ -1186,11 +1244,1485 @@ void test_bit() {
     proc.a = 0x76;
     proc.pc = 0;
     run_emulator(&proc, 0);
-    TEST_EQ(proc.n, 1);
-    TEST_EQ(proc.z, 0);
-    TEST_EQ(proc.v, 1);
+    TEST_EQ(get_flag(&proc, FLAG_N), 1);
+    TEST_EQ(get_flag(&proc, FLAG_Z), 0);
+    TEST_EQ(get_flag(&proc, FLAG_V), 1);
+}
+
+// N, Z, C, and V are stored lazily, check each can be set independently.
+void test_flag_accessors() {
+    static const int FLAGS[] = { FLAG_C, FLAG_Z, FLAG_I, FLAG_D, FLAG_B,
+        FLAG_V, FLAG_N };
+    struct m6502 proc;
+    init_proc(&proc);
+
+    for (int bits = 0; bits < 128; bits++) {
+        for (int i = 0; i < 7; i++) {
+            set_flag(&proc, FLAGS[i], (bits >> i) & 1);
+        }
+
+        for (int i = 0; i < 7; i++) {
+            TEST_EQ(get_flag(&proc, FLAGS[i]), (bits >> i) & 1);
+        }
+    }
+
+    for (int status = 0; status < 256; status++) {
+        set_status(&proc, status);
+        TEST_EQ(get_status(&proc), status | FLAG_UNUSED);
+    }
+}
+
+// Decoded instructions are cached, make sure stores invalidate them.
+void test_self_modifying_code() {
+    struct m6502 proc;
+    init_proc(&proc);
+
+    proc.memory[0] = 0xa2; // LDX #2
+    proc.memory[1] = 0x02;
+    proc.memory[2] = 0xa9; // LDA #$11
+    proc.memory[3] = 0x11;
+    proc.memory[4] = 0xee; // INC $0003
+    proc.memory[5] = 0x03;
+    proc.memory[6] = 0x00;
+    proc.memory[7] = 0xca; // DEX
+    proc.memory[8] = 0xd0; // BNE 2
+    proc.memory[9] = 0xf8;
+    proc.memory[10] = 0; // BRK
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ((uint8_t) proc.a, 0x12);
+
+    // Instruction that crosses a page boundary, with the modified byte
+    // in the second page.
+    proc.memory[0x1fc] = 0xa2; // LDX #2
+    proc.memory[0x1fd] = 0x02;
+    proc.memory[0x1fe] = 0xad; // LDA $0300
+    proc.memory[0x1ff] = 0x00;
+    proc.memory[0x200] = 0x03;
+    proc.memory[0x201] = 0xee; // INC $0200
+    proc.memory[0x202] = 0x00;
+    proc.memory[0x203] = 0x02;
+    proc.memory[0x204] = 0xca; // DEX
+    proc.memory[0x205] = 0xd0; // BNE $1fe
+    proc.memory[0x206] = 0xf7;
+    proc.memory[0x207] = 0; // BRK
+    proc.memory[0x300] = 0x33;
+    proc.memory[0x400] = 0x44;
+    proc.pc = 0x1fc;
+    run_emulator(&proc, 0);
+    TEST_EQ((uint8_t) proc.a, 0x44);
+}
+
+void test_run_instructions() {
+    struct m6502 proc;
+    init_proc(&proc);
+
+    proc.memory[0] = 0xa2; // LDX #0
+    proc.memory[1] = 0x00;
+    proc.memory[2] = 0xe8; // INX
+    proc.memory[3] = 0x4c; // JMP 2
+    proc.memory[4] = 0x02;
+    proc.memory[5] = 0x00;
+    proc.pc = 0;
+    TEST_EQ(run_instructions(&proc, 0), STOP_BUDGET);
+    TEST_EQ((int) proc.instructions, 0);
+    TEST_EQ(proc.pc, 0);
+    TEST_EQ(run_instructions(&proc, 10), STOP_BUDGET);
+    TEST_EQ((int) proc.instructions, 10);
+    TEST_EQ(proc.x, 5);
+    TEST_EQ(proc.pc, 3);
+    TEST_EQ(run_instructions(&proc, 1), STOP_BUDGET);
+    TEST_EQ((int) proc.instructions, 11);
+    TEST_EQ(proc.pc, 2);
+
+    proc.memory[0] = 0xa9; // LDA #1
+    proc.memory[1] = 0x01;
+    proc.memory[2] = 0x00; // BRK
+    proc.pc = 0;
+    flush_decode_cache(&proc);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    TEST_EQ((int) proc.instructions, 13);
+    TEST_EQ(proc.pc, 3);
+
+    proc.memory[3] = 0x02; // Invalid
+    TEST_EQ(run_instructions(&proc, 100), STOP_INVALID);
+    TEST_EQ((int) proc.instructions, 14);
+
+    // Stop on a console write and resume after it.
+    proc.memory[0] = 0xa9; // LDA #$41
+    proc.memory[1] = 0x41;
+    proc.memory[2] = 0x8d; // STA $fffa
+    proc.memory[3] = 0xfa;
+    proc.memory[4] = 0xff;
+    proc.memory[5] = 0xa9; // LDA #2
+    proc.memory[6] = 0x02;
+    proc.memory[7] = 0x00; // BRK
+    proc.pc = 0;
+    proc.exit_on_mmio = 1;
+    flush_decode_cache(&proc);
+    TEST_EQ(run_instructions(&proc, 100), STOP_MMIO);
+    TEST_EQ(proc.mmio_addr, CONSOLE_OUT);
+    TEST_EQ(proc.mmio_value, 0x41);
+    TEST_EQ(proc.pc, 5);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    TEST_EQ((uint8_t) proc.a, 2);
+    TEST_EQ((int) proc.instructions, 18);
+}
+
+void test_cycles() {
+    struct m6502 proc;
+    init_proc(&proc);
+
+    static const uint8_t PROGRAM[] = {
+        0xa2, 0x20,         // LDX #$20
+        0xa5, 0x10,         // LDA $10
+        0xbd, 0xf0, 0x10,   // LDA $10f0,X (page crossing)
+        0xbd, 0x00, 0x10,   // LDA $1000,X
+        0x9d, 0x00, 0x10,   // STA $1000,X
+        0xd0, 0x00,         // BNE 0 (taken)
+        0xf0, 0x00,         // BEQ 0 (not taken)
+        0xd0, 0x10,         // BNE $0103 (taken, page crossing)
+    };
+    static const int CYCLES[] = { 2, 3, 5, 4, 5, 3, 2, 4 };
+
+    memcpy(proc.memory + 0xe0, PROGRAM, sizeof(PROGRAM));
+    proc.memory[0x10] = 1;
+    proc.memory[0x1020] = 1;
+    proc.pc = 0xe0;
+    uint64_t total = 0;
+    for (int i = 0; i < 8; i++) {
+        run_instructions(&proc, 1);
+        total += CYCLES[i];
+        TEST_EQ((int) proc.cycles, (int) total);
+    }
+
+    TEST_EQ(proc.pc, 0x103);
+
+    // Runs whole instructions, so may go slightly over.
+    proc.memory[0x103] = 0x4c; // JMP $0103
+    proc.memory[0x104] = 0x03;
+    proc.memory[0x105] = 0x01;
+    proc.cycles = 0;
+    TEST_EQ(run_cycles(&proc, 1000), STOP_BUDGET);
+    TEST_EQ((int) proc.cycles, 1002);
+}
+
+// Device for the memory map tests. Reads of its first register return an
+// incrementing count, and writes to it are recorded. The rest of its page
+// is left to memory.
+struct test_device {
+    uint8_t count;
+    uint8_t last_write;
+};
+
+static int test_device_read(struct m6502 *proc, uint16_t addr, uint8_t *value,
+                            void *context) {
+    struct test_device *device = context;
+    if ((addr & 0xff) != 0) {
+        return 0;
+    }
+
+    *value = device->count++;
+    return 1;
+}
+
+static int test_device_write(struct m6502 *proc, uint16_t addr, uint8_t value,
+                             void *context) {
+    struct test_device *device = context;
+    if ((addr & 0xff) != 0) {
+        return 0;
+    }
+
+    device->last_write = value;
+    return 1;
+}
+
+void test_memory_map() {
+    struct m6502 proc;
+    struct test_device device = { 0x40, 0 };
+    uint8_t buffer[PAGE_SIZE * 2] = { 0 };
+    init_proc(&proc);
+
+    proc.memory[0x8000] = 0x55;
+    map_memory(&proc, 0x80, 0x10, proc.memory + 0x8000, MAP_READ_ONLY);
+    map_memory(&proc, 0x40, 2, buffer, 0);
+    map_handlers(&proc, 0x90, 1, test_device_read, test_device_write,
+        &device);
+
+    // ROM can be read but not written
+    proc.memory[0] = 0xa9; // LDA #$aa
+    proc.memory[1] = 0xaa;
+    proc.memory[2] = 0x8d; // STA $8000
+    proc.memory[3] = 0x00;
+    proc.memory[4] = 0x80;
+    proc.memory[5] = 0xae; // LDX $8000
+    proc.memory[6] = 0x00;
+    proc.memory[7] = 0x80;
+    proc.memory[8] = 0x00; // BRK
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ(proc.x, 0x55);
+    TEST_EQ(proc.memory[0x8000], 0x55);
+
+    // Other host memory
+    proc.memory[2] = 0x8d; // STA $4110
+    proc.memory[3] = 0x10;
+    proc.memory[4] = 0x41;
+    proc.memory[5] = 0xae; // LDX $4110
+    proc.memory[6] = 0x10;
+    proc.memory[7] = 0x41;
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ(buffer[0x110], 0xaa);
+    TEST_EQ(proc.x, 0xaa);
+    TEST_EQ(proc.memory[0x4110], 0);
+
+    // A device at $9000, with memory behind the rest of its page
+    proc.memory[2] = 0x8d; // STA $9000
+    proc.memory[3] = 0x00;
+    proc.memory[4] = 0x90;
+    proc.memory[5] = 0xae; // LDX $9000
+    proc.memory[6] = 0x00;
+    proc.memory[7] = 0x90;
+    proc.memory[8] = 0x8d; // STA $9001
+    proc.memory[9] = 0x01;
+    proc.memory[10] = 0x90;
+    proc.memory[11] = 0xac; // LDY $9001
+    proc.memory[12] = 0x01;
+    proc.memory[13] = 0x90;
+    proc.memory[14] = 0x00; // BRK
+    proc.pc = 0;
+    run_emulator(&proc, 0);
+    TEST_EQ(device.last_write, 0xaa);
+    TEST_EQ(proc.x, 0x40);
+    TEST_EQ(device.count, 0x41);
+    TEST_EQ(proc.y, 0xaa);
+    TEST_EQ(proc.memory[0x9000], 0);
+    TEST_EQ(proc.memory[0x9001], 0xaa);
+}
+
+static void write_image(const char *filename, const uint8_t *data,
+                        int length) {
+    FILE *file = fopen(filename, "wb");
+    fwrite(data, length, 1, file);
+    fclose(file);
+}
+
+void test_load_image() {
+    struct m6502 proc;
+    char filename[] = "/tmp/6502-imageXXXXXX";
+    close(mkstemp(filename));
+    init_proc(&proc);
+
+    // RAM images are copied, and don't need to be page aligned. The part
+    // past the end of the address space is dropped.
+    const uint8_t DATA[] = { 0x11, 0x22, 0x33, 0x44 };
+    write_image(filename, DATA, sizeof(DATA));
+    TEST_EQ(load_image(&proc, filename, 0x1234, 0), 0);
+    TEST_EQ(proc.memory[0x1233], 0);
+    TEST_EQ(proc.memory[0x1234], 0x11);
+    TEST_EQ(proc.memory[0x1237], 0x44);
+    TEST_EQ(proc.memory[0x1238], 0);
+    TEST_EQ(load_image(&proc, filename, 0xfffe, 0), 0);
+    TEST_EQ(proc.memory[0xffff], 0x22);
+    TEST_EQ(proc.memory[0], 0);
+
+    // ROM images are mapped read-only and start at the reset vector
+    uint8_t rom[0x1000] = { 0 };
+    rom[0] = 0xad; // LDA $f080
+    rom[1] = 0x80;
+    rom[2] = 0xf0;
+    rom[3] = 0xee; // INC $f080
+    rom[4] = 0x80;
+    rom[5] = 0xf0;
+    rom[6] = 0xae; // LDX $f080
+    rom[7] = 0x80;
+    rom[8] = 0xf0;
+    rom[9] = 0x00; // BRK
+    rom[0x80] = 0x37;
+    rom[RESET_VECTOR - 0xf000] = 0x00;
+    rom[RESET_VECTOR - 0xf000 + 1] = 0xf0;
+    write_image(filename, rom, sizeof(rom));
+    TEST_EQ(load_image(&proc, filename, 0xf080, MAP_READ_ONLY), -1);
+    TEST_EQ(load_image(&proc, filename, 0xf000, MAP_READ_ONLY), 0);
+    unlink(filename);
+
+    reset_proc(&proc);
+    TEST_EQ(proc.pc, 0xf000);
+    run_emulator(&proc, 0);
+    TEST_EQ(proc.pc, 0xf00a);
+    TEST_EQ((uint8_t) proc.a, 0x37);
+    TEST_EQ(proc.x, 0x37);
+    TEST_EQ(read_mem_u8(&proc, 0xf080), 0x37);
+
+    // The console is still in front of the ROM
+    proc.exit_on_mmio = 1;
+    write_mem_u8(&proc, CONSOLE_OUT, 0x41);
+    TEST_EQ(proc.halt, STOP_MMIO);
+    TEST_EQ(proc.mmio_value, 0x41);
+}
+
+void test_fleet() {
+    // Prints the letters from 'A' up to the one in $80, then stops.
+    const uint8_t PROGRAM[] = {
+        0xa9, 0x41,         // LDA #'A'
+        0x8d, 0xfa, 0xff,   // loop: STA $fffa
+        0xc5, 0x80,         // CMP $80
+        0xf0, 0x05,         // BEQ done
+        0x18,               // CLC
+        0x69, 0x01,         // ADC #1
+        0xd0, 0xf4,         // BNE loop
+        0x00                // done: BRK
+    };
+    const int NUM_INSTANCES = 37;
+    struct fleet_instance *instances = calloc(NUM_INSTANCES,
+        sizeof(struct fleet_instance));
+
+    // Forked instances capture their own output
+    init_instance(&instances[0], NULL);
+    memcpy(instances[0].proc.memory, PROGRAM, sizeof(PROGRAM));
+    for (int i = 1; i < NUM_INSTANCES; i++) {
+        fork_instance(&instances[i], &instances[0], NULL);
+    }
+
+    for (int i = 0; i < NUM_INSTANCES; i++) {
+        write_mem_u8(&instances[i].proc, 0x80, 'A' + i % 26);
+    }
+
+    // This one never finishes
+    write_mem_u8(&instances[5].proc, 0x80, 0);
+
+    // The short slice makes instances move between threads.
+    run_fleet(instances, NUM_INSTANCES, 4, 3, 1000);
+    for (int i = 0; i < NUM_INSTANCES; i++) {
+        struct fleet_instance *instance = &instances[i];
+        if (i == 5) {
+            TEST_EQ(instance->result, STOP_BUDGET);
+            TEST_EQ((int) instance->proc.instructions, 1000);
+            free_instance(instance);
+            continue;
+        }
+
+        int letters = i % 26 + 1;
+        TEST_EQ(instance->result, STOP_BRK);
+        size_t length;
+        const char *output = console_output(instance->proc.console, &length);
+        TEST_EQ((int) length, letters);
+        for (int j = 0; j < letters; j++) {
+            TEST_EQ(output[j], 'A' + j);
+        }
+
+        TEST_EQ(instance->proc.pc, 0xf);
+        TEST_EQ((uint8_t) instance->proc.a, 'A' + i % 26);
+        free_instance(instance);
+    }
+
+    free(instances);
+}
+
+void test_fork() {
+    // Adds the byte at $81 to the one at $80 in a loop, stopping when it
+    // wraps.
+    const uint8_t PROGRAM[] = {
+        0xa5, 0x80,         // loop: LDA $80
+        0x18,               // CLC
+        0x65, 0x81,         // ADC $81
+        0x85, 0x80,         // STA $80
+        0x90, 0xf7,         // BCC loop
+        0x00                // BRK
+    };
+    static uint8_t rom[PAGE_SIZE];
+    struct m6502 parent;
+    struct m6502 child1;
+    struct m6502 child2;
+
+    init_proc(&parent);
+    memcpy(parent.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    parent.memory[0x81] = 1;
+    parent.memory[0x1234] = 0x55;
+    rom[0] = 0xaa;
+    map_memory(&parent, 0xc0, 1, rom, MAP_READ_ONLY);
+    parent.pc = 0x200;
+    TEST_EQ(run_instructions(&parent, 40), STOP_BUDGET);
+    TEST_EQ(parent.memory[0x80], 8);
+
+    fork_proc(&child1, &parent);
+    fork_proc(&child2, &parent);
+    TEST_EQ(child1.pc, parent.pc);
+    TEST_EQ((int) child1.instructions, 40);
+    TEST_EQ((int) child1.cycles, (int) parent.cycles);
+    TEST_EQ((uint8_t) child2.a, (uint8_t) parent.a);
+    TEST_EQ(read_mem_u8(&child1, 0x80), 8);
+    TEST_EQ(read_mem_u8(&child2, 0x1234), 0x55);
+
+    // The decode cache is only allocated for pages code runs from, and a
+    // child starts without one.
+    TEST_EQ(parent.decode_cache[0x02] != parent.decode_cache[0x03], 1);
+    TEST_EQ(parent.decode_cache[0x03] == parent.decode_cache[0x12], 1);
+    TEST_EQ(child1.decode_cache[0x02] == child1.decode_cache[0x03], 1);
+
+    // Pages are shared until written
+    TEST_EQ(child1.read_map[0x12] == parent.read_map[0x12], 1);
+    TEST_EQ(child1.read_map[0xc0] == rom, 1);
+    write_mem_u8(&child1, 0x1234, 0x66);
+    TEST_EQ(child1.read_map[0x12] != parent.read_map[0x12], 1);
+    TEST_EQ(read_mem_u8(&child1, 0x1234), 0x66);
+    TEST_EQ(read_mem_u8(&child2, 0x1234), 0x55);
+    TEST_EQ(read_mem_u8(&parent, 0x1234), 0x55);
+
+    // Writes to ROM are still ignored
+    write_mem_u8(&child2, 0xc000, 0x12);
+    TEST_EQ(read_mem_u8(&child2, 0xc000), 0xaa);
+
+    // Each continues on its own from the checkpoint
+    write_mem_u8(&child1, 0x81, 2);
+    write_mem_u8(&child2, 0x81, 3);
+    TEST_EQ(run_instructions(&child1, 10000), STOP_BRK);
+    TEST_EQ(run_instructions(&child2, 10000), STOP_BRK);
+    TEST_EQ(run_instructions(&parent, 10000), STOP_BRK);
+    TEST_EQ((int) parent.instructions, 40 + 248 * 5 + 1);
+    TEST_EQ((int) child1.instructions, 40 + 124 * 5 + 1);
+    TEST_EQ((int) child2.instructions, 40 + 83 * 5 + 1);
+    TEST_EQ(read_mem_u8(&child2, 0x81), 3);
+    TEST_EQ(child1.pc, 0x20a);
+    TEST_EQ(child2.pc, 0x20a);
+
+    // Modifying shared code in one doesn't affect the others' cached
+    // copies.
+    free_proc(&child2);
+    fork_proc(&child2, &parent);
+    write_mem_u8(&child2, 0x203, 0xe5);    // SBC $81
+    write_mem_u8(&child2, 0x202, 0x38);    // SEC
+    write_mem_u8(&child2, 0x207, 0xb0);    // BCS loop
+    write_mem_u8(&child2, 0x80, 5);
+    write_mem_u8(&parent, 0x80, 5);
+    child2.pc = 0x200;
+    parent.pc = 0x200;
+    TEST_EQ(run_instructions(&child2, 10000), STOP_BRK);
+    TEST_EQ(run_instructions(&parent, 10000), STOP_BRK);
+    TEST_EQ(read_mem_u8(&child2, 0x80), 0xff);
+    TEST_EQ(read_mem_u8(&parent, 0x80), 0);
+
+    // Forking a fork
+    struct m6502 grandchild;
+    fork_proc(&grandchild, &child1);
+    write_mem_u8(&child1, 0x1234, 0x77);
+    TEST_EQ(read_mem_u8(&grandchild, 0x1234), 0x66);
+
+    free_proc(&grandchild);
+    free_proc(&child1);
+    free_proc(&child2);
+    free_proc(&parent);
+}
+
+void test_save_state() {
+    // Adds the byte at $81 to the one at $80 in a loop, stopping when it
+    // wraps.
+    const uint8_t PROGRAM[] = {
+        0xa5, 0x80,         // loop: LDA $80
+        0x18,               // CLC
+        0x65, 0x81,         // ADC $81
+        0x85, 0x80,         // STA $80
+        0x90, 0xf7,         // BCC loop
+        0x00                // BRK
+    };
+    char filename[] = "/tmp/6502-stateXXXXXX";
+    close(mkstemp(filename));
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.memory[0x81] = 3;
+    proc.memory[0x40ff] = 0x12;
+    proc.pc = 0x200;
+    TEST_EQ(run_instructions(&proc, 37), STOP_BUDGET);
+    TEST_EQ(save_state(&proc, filename), 0);
+
+    // Pages of zeroes (e.g. the stack) aren't saved
+    struct stat st;
+    stat(filename, &st);
+    TEST_EQ((int) st.st_size, 88 + 3 * PAGE_SIZE);
+
+    struct m6502 restored;
+    init_proc(&restored);
+    restored.memory[0x3000] = 0x99;
+    TEST_EQ(load_state(&restored, filename), 0);
+    TEST_EQ(restored.pc, proc.pc);
+    TEST_EQ((uint8_t) restored.a, (uint8_t) proc.a);
+    TEST_EQ(restored.memory[0x3000], 0);
+    TEST_EQ(restored.memory[0x40ff], 0x12);
+
+    // Both finish the same way
+    TEST_EQ(run_instructions(&proc, 10000), STOP_BRK);
+    TEST_EQ(run_instructions(&restored, 10000), STOP_BRK);
+    TEST_EQ(restored.pc, proc.pc);
+    TEST_EQ((int) restored.instructions, (int) proc.instructions);
+    TEST_EQ((int) restored.cycles, (int) proc.cycles);
+    TEST_EQ(get_flag(&restored, FLAG_C), get_flag(&proc, FLAG_C));
+    TEST_EQ(get_flag(&restored, FLAG_Z), get_flag(&proc, FLAG_Z));
+    TEST_EQ(restored.memory[0x80], proc.memory[0x80]);
+
+    // Restoring into a fork doesn't change the memory it shares
+    struct m6502 child;
+    fork_proc(&child, &proc);
+    TEST_EQ(load_state(&child, filename), 0);
+    TEST_EQ(read_mem_u8(&child, 0x80), 21);
+    TEST_EQ(read_mem_u8(&proc, 0x80), 2);
+
+    // Not a save state
+    const uint8_t GARBAGE[80] = { 1, 2, 3 };
+    write_image(filename, GARBAGE, sizeof(GARBAGE));
+    TEST_EQ(load_state(&restored, filename), -1);
+    TEST_EQ(errno, EINVAL);
+    unlink(filename);
+
+    free_proc(&child);
+    free_proc(&proc);
+    free_proc(&restored);
+}
+
+void test_delta_state() {
+    // Same loop as test_save_state
+    const uint8_t PROGRAM[] = {
+        0xa5, 0x80,         // loop: LDA $80
+        0x18,               // CLC
+        0x65, 0x81,         // ADC $81
+        0x85, 0x80,         // STA $80
+        0x90, 0xf7,         // BCC loop
+        0x00                // BRK
+    };
+    char base[] = "/tmp/6502-stateXXXXXX";
+    char delta1[] = "/tmp/6502-stateXXXXXX";
+    char delta2[] = "/tmp/6502-stateXXXXXX";
+    close(mkstemp(base));
+    close(mkstemp(delta1));
+    close(mkstemp(delta2));
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.memory[0x81] = 3;
+    proc.memory[0x4000] = 7;
+    proc.pc = 0x200;
+#ifdef ENABLE_JIT
+    TEST_EQ(jit_enable(&proc), 0);
+#endif
+
+    // Nothing to follow yet
+    TEST_EQ(save_delta(&proc, delta1), -1);
+    TEST_EQ(errno, EINVAL);
+
+    TEST_EQ(run_instructions(&proc, 37), STOP_BUDGET);
+    TEST_EQ(save_state(&proc, base), 0);
+    TEST_EQ(proc.dirty_pages[0], 0);
+
+    // Only the page with the counter changes
+    TEST_EQ(run_instructions(&proc, 20), STOP_BUDGET);
+    TEST_EQ(proc.dirty_pages[0], 1);
+    TEST_EQ(save_delta(&proc, delta1), 0);
+    struct stat st;
+    stat(delta1, &st);
+    TEST_EQ((int) st.st_size, 88 + PAGE_SIZE);
+
+    // A page that was cleared is still saved
+    write_mem_u8(&proc, 0x4000, 0);
+    TEST_EQ(run_instructions(&proc, 10), STOP_BUDGET);
+    TEST_EQ(save_delta(&proc, delta2), 0);
+    stat(delta2, &st);
+    TEST_EQ((int) st.st_size, 88 + 2 * PAGE_SIZE);
+
+    // Deltas only apply on top of the state they follow
+    struct m6502 restored;
+    init_proc(&restored);
+    TEST_EQ(load_state(&restored, delta1), -1);
+    TEST_EQ(errno, EINVAL);
+    TEST_EQ(load_state(&restored, base), 0);
+    TEST_EQ(load_state(&restored, delta2), -1);
+    TEST_EQ(errno, EINVAL);
+    TEST_EQ(restored.memory[0x4000], 7);
+    TEST_EQ(load_state(&restored, delta1), 0);
+    TEST_EQ(load_state(&restored, delta2), 0);
+    TEST_EQ(restored.pc, proc.pc);
+    TEST_EQ((uint8_t) restored.a, (uint8_t) proc.a);
+    TEST_EQ((int) restored.instructions, (int) proc.instructions);
+    TEST_EQ(memcmp(restored.memory, proc.memory, MEM_SIZE), 0);
+
+    // Both finish the same way
+    TEST_EQ(run_instructions(&proc, 10000), STOP_BRK);
+    TEST_EQ(run_instructions(&restored, 10000), STOP_BRK);
+    TEST_EQ((int) restored.cycles, (int) proc.cycles);
+    TEST_EQ(restored.memory[0x80], proc.memory[0x80]);
+
+    unlink(base);
+    unlink(delta1);
+    unlink(delta2);
+    free_proc(&proc);
+    free_proc(&restored);
+}
+
+static int history_output;
+
+static int count_output(struct m6502 *proc, uint16_t addr, uint8_t val,
+                        void *context) {
+    const struct history *history = context;
+    if (addr == CONSOLE_OUT && !history->replaying) {
+        history_output++;
+    }
+
+    return addr == CONSOLE_OUT;
+}
+
+static int discard_output(struct m6502 *proc, uint16_t addr, uint8_t val,
+                          void *context) {
+    return addr == CONSOLE_OUT;
+}
+
+// Run a fresh copy of the history test program to compare against
+static void check_history_state(struct m6502 *proc, const uint8_t *program,
+                                int length, uint64_t instructions) {
+    struct m6502 expected;
+    init_proc(&expected);
+    map_handlers(&expected, CONSOLE_OUT >> PAGE_SHIFT, 1, NULL,
+        discard_output, NULL);
+    memcpy(expected.memory + 0x200, program, length);
+    expected.pc = 0x200;
+    run_instructions(&expected, instructions);
+    TEST_EQ((int) proc->instructions, (int) instructions);
+    TEST_EQ((int) proc->cycles, (int) expected.cycles);
+    TEST_EQ(proc->pc, expected.pc);
+    TEST_EQ((uint8_t) proc->a, (uint8_t) expected.a);
+    TEST_EQ(read_mem_u8(proc, 0x80), expected.memory[0x80]);
+    free_proc(&expected);
+}
+
+void test_history() {
+    const uint8_t PROGRAM[] = {
+        0xe6, 0x80,         // loop: INC $80
+        0xa5, 0x80,         // LDA $80
+        0x8d, 0xfa, 0xff,   // STA CONSOLE_OUT
+        0x4c, 0x00, 0x02    // JMP loop
+    };
+
+    struct m6502 proc;
+    struct history history;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+#ifdef ENABLE_JIT
+    TEST_EQ(jit_enable(&proc), 0);
+#endif
+    map_handlers(&proc, CONSOLE_OUT >> PAGE_SHIFT, 1, NULL, count_output,
+        &history);
+    init_history(&history, 10, 4);
+    restart_history(&history, &proc);
+    history_output = 0;
+    TEST_EQ(run_history(&history, &proc, 100), STOP_BUDGET);
+    TEST_EQ(history_output, 25);
+    check_history_state(&proc, PROGRAM, sizeof(PROGRAM), 100);
+
+    // Only the last four snapshots are kept
+    TEST_EQ(seek_history(&history, &proc, 69), -1);
+    TEST_EQ(seek_history(&history, &proc, 73), 0);
+    check_history_state(&proc, PROGRAM, sizeof(PROGRAM), 73);
+    TEST_EQ(seek_history(&history, &proc, 100), 0);
+    check_history_state(&proc, PROGRAM, sizeof(PROGRAM), 100);
+
+    // Output isn't repeated when running forward again
+    TEST_EQ(history_output, 25);
+    TEST_EQ(run_history(&history, &proc, 20), STOP_BUDGET);
+    TEST_EQ(history_output, 30);
+
+    // The last STA is instruction 118 (counting from 0)
+    TEST_EQ(reverse_to_address(&history, &proc, 0x204), 0);
+    check_history_state(&proc, PROGRAM, sizeof(PROGRAM), 118);
+    TEST_EQ(reverse_to_address(&history, &proc, 0x300), -1);
+    check_history_state(&proc, PROGRAM, sizeof(PROGRAM), 90);
+
+    // Changing memory starts a different history from here
+    write_mem_u8(&proc, 0x80, 0);
+    restart_history(&history, &proc);
+    TEST_EQ(run_history(&history, &proc, 8), STOP_BUDGET);
+    TEST_EQ(read_mem_u8(&proc, 0x80), 2);
+    TEST_EQ(seek_history(&history, &proc, 94), 0);
+    TEST_EQ(read_mem_u8(&proc, 0x80), 1);
+    TEST_EQ(seek_history(&history, &proc, 110), 0);
+    TEST_EQ(read_mem_u8(&proc, 0x80), 5);
+    TEST_EQ(history.count, 3);
+
+    free_history(&history);
+    free_proc(&proc);
+}
+
+void test_breakpoints() {
+    const uint8_t PROGRAM[] = {
+        0xa2, 0x03,         // 0200 LDX #3
+        0xca,               // 0202 DEX
+        0xd0, 0xfd,         // 0203 BNE 0202
+        0x00                // 0205 BRK
+    };
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+    TEST_EQ(set_breakpoint(&proc, 0x203), 0);
+    TEST_EQ(set_breakpoint(&proc, 0x203), 0);
+    TEST_EQ(proc.num_breakpoints, 1);
+    TEST_EQ(is_breakpoint(&proc, 0x203), 1);
+    TEST_EQ(is_breakpoint(&proc, 0x202), 0);
+
+    // Stops before the instruction each time it is reached
+    for (int x = 2; x >= 0; x--) {
+        TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+        TEST_EQ(proc.pc, 0x203);
+        TEST_EQ(proc.x, x);
+    }
+
+    TEST_EQ((int) proc.instructions, 6);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+
+    // Removing the last one goes back to the fast loop
+    TEST_EQ(clear_breakpoint(&proc, 0x203), 0);
+    TEST_EQ(clear_breakpoint(&proc, 0x203), -1);
+    TEST_EQ(proc.num_breakpoints, 0);
+    TEST_EQ(proc.breakpoints == NULL, 1);
+
+    // A breakpoint where it starts stops without running anything
+    proc.pc = 0x200;
+    set_breakpoint(&proc, 0x200);
+    uint64_t before = proc.instructions;
+    TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+    TEST_EQ((int) (proc.instructions - before), 0);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    clear_breakpoint(&proc, 0x200);
+
+    // Going back in time runs through them
+    struct history history;
+    proc.pc = 0x200;
+    proc.instructions = 0;
+    init_history(&history, 2, 8);
+    restart_history(&history, &proc);
+    set_breakpoint(&proc, 0x202);
+    TEST_EQ(run_history(&history, &proc, 100), STOP_BREAKPOINT);
+    TEST_EQ((int) proc.instructions, 1);
+
+    // without counting hits or using up ignore counts
+    struct breakpoint *breakpoint = find_breakpoint(&proc, 0x202);
+    breakpoint->ignore = 5;
+    TEST_EQ(seek_history(&history, &proc, 5), 0);
+    TEST_EQ(proc.x, 1);
+    TEST_EQ(reverse_to_address(&history, &proc, 0x202), 0);
+    TEST_EQ((int) proc.instructions, 3);
+    TEST_EQ(proc.breakpoint_pc, 0x202);
+    TEST_EQ(seek_history(&history, &proc, 0), 0);
+    TEST_EQ((int) breakpoint->hits, 1);
+    TEST_EQ((int) breakpoint->ignore, 5);
+    breakpoint->ignore = 0;
+    TEST_EQ(run_history(&history, &proc, 100), STOP_BREAKPOINT);
+    TEST_EQ((int) proc.instructions, 1);
+    TEST_EQ((int) breakpoint->hits, 2);
+
+    // Reverse continue goes to the last breakpoint with its condition true
+    const char *error;
+    clear_breakpoint(&proc, 0x202);
+    set_breakpoint(&proc, 0x203);
+    breakpoint = find_breakpoint(&proc, 0x203);
+    TEST_EQ(compile_condition(&breakpoint->condition, "x == 2", &error), 0);
+    TEST_EQ(run_history(&history, &proc, 100), STOP_BREAKPOINT);
+    TEST_EQ(run_history(&history, &proc, 100), STOP_BRK);
+    TEST_EQ(reverse_to_breakpoint(&history, &proc), 0);
+    TEST_EQ((int) proc.instructions, 2);
+    TEST_EQ(proc.x, 2);
+    TEST_EQ((int) find_breakpoint(&proc, 0x203)->hits, 1);
+    set_breakpoint(&proc, 0x202);
+    TEST_EQ(reverse_to_breakpoint(&history, &proc), 0);
+    TEST_EQ((int) proc.instructions, 1);
+    TEST_EQ(reverse_to_breakpoint(&history, &proc), -1);
+    TEST_EQ((int) proc.instructions, 0);
+
+    free_history(&history);
+    free_proc(&proc);
+}
+
+void test_conditions() {
+    struct m6502 proc;
+    struct condition condition;
+    const char *error;
+    init_proc(&proc);
+    proc.a = 0x80;
+    proc.x = 0x10;
+    proc.pc = 0x1234;
+    proc.memory[0x20] = 6;
+    proc.memory[0x1234] = 0x34;
+    set_flag(&proc, FLAG_C, 1);
+
+    static const struct {
+        const char *text;
+        int result;
+    } CASES[] = {
+        {"x == $10", 1},
+        {"X = 16", 1},
+        {"x == $10 and mem[$20] > 5", 1},
+        {"x == $10 && mem[$20] > 6", 0},
+        {"x != $10 or mem[$20] >= 6", 1},
+        {"a >= $80 and a <= $80 and a < $81", 1},
+        {"y || not c", 0},
+        {"!z and c", 1},
+        {"not (x == $10 or y == 0)", 0},
+        {"mem[pc] == $34", 1},
+        {"pc == $1234", 1},
+        {"mem[mem[$20]]", 0},
+        {"s == $ff", 1},
+        {"n", 0}
+    };
+
+    for (int i = 0; i < (int) (sizeof(CASES) / sizeof(CASES[0])); i++) {
+        TEST_EQ(compile_condition(&condition, CASES[i].text, &error), 0);
+        TEST_EQ(eval_condition(&proc, &condition), CASES[i].result);
+    }
+
+    // A bad one isn't used
+    TEST_EQ(compile_condition(&condition, "x ==", &error), -1);
+    TEST_EQ(compile_condition(&condition, "q == 1", &error), -1);
+    TEST_EQ(compile_condition(&condition, "mem[$20", &error), -1);
+    TEST_EQ(strcmp(error, "Missing ]"), 0);
+    TEST_EQ(compile_condition(&condition, "x == $10000", &error), -1);
+    TEST_EQ(compile_condition(&condition,
+        "((((((((((((((((((1))))))))))))))))))", &error), 0);
+    TEST_EQ(compile_condition(&condition,
+        "1 and (1 and (1 and (1 and (1 and (1 and (1 and (1 and (1 and "
+        "(1 and (1 and (1 and (1 and (1 and (1 and (1 and (1 and 1))))"
+        "))))))))))))", &error), -1);
+    TEST_EQ(eval_condition(&proc, &condition), 1);
+
+    // Breakpoints with a condition and an ignore count
+    const uint8_t PROGRAM[] = {
+        0xa2, 0x05,         // 0200 LDX #5
+        0xca,               // 0202 DEX
+        0xd0, 0xfd,         // 0203 BNE 0202
+        0x00                // 0205 BRK
+    };
+
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+    set_breakpoint(&proc, 0x203);
+    struct breakpoint *breakpoint = find_breakpoint(&proc, 0x203);
+    TEST_EQ(compile_condition(&breakpoint->condition, "x < 3", &error), 0);
+    TEST_EQ(find_breakpoint(&proc, 0x202) == NULL, 1);
+    set_breakpoint(&proc, 0x202);
+    find_breakpoint(&proc, 0x202)->ignore = 3;
+
+    // DEX runs through the first three times, and BNE until x < 3
+    TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+    TEST_EQ(proc.pc, 0x203);
+    TEST_EQ(proc.x, 2);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+    TEST_EQ(proc.pc, 0x202);
+    TEST_EQ(proc.x, 2);
+    TEST_EQ((int) find_breakpoint(&proc, 0x202)->hits, 4);
+    TEST_EQ(clear_breakpoint(&proc, 0x202), 0);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+    TEST_EQ(proc.pc, 0x203);
+    TEST_EQ(proc.x, 1);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BREAKPOINT);
+    TEST_EQ(proc.x, 0);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    breakpoint = find_breakpoint(&proc, 0x203);
+    TEST_EQ((int) breakpoint->hits, 3);
+    TEST_EQ((int) breakpoint->ignore, 0);
+
+    free_proc(&proc);
+}
+
+void test_watchpoints() {
+    const uint8_t PROGRAM[] = {
+        0xa2, 0x03,         // 0200 LDX #3
+        0xad, 0x00, 0x04,   // 0202 LDA $0400
+        0x9d, 0x10, 0x03,   // 0205 STA $0310,X
+        0xca,               // 0208 DEX
+        0xd0, 0xf7,         // 0209 BNE 0202
+        0xee, 0x11, 0x03,   // 020b INC $0311
+        0x00                // 020e BRK
+    };
+
+    struct m6502 proc;
+    init_proc(&proc);
+#ifdef ENABLE_JIT
+    TEST_EQ(jit_enable(&proc), 0);
+#endif
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.memory[0x400] = 0x55;
+    proc.pc = 0x200;
+
+    TEST_EQ(add_watchpoint(&proc, 0x312, 0x311, WATCH_WRITE), -1);
+    TEST_EQ(errno, EINVAL);
+    TEST_EQ(add_watchpoint(&proc, 0x311, 0x312, 0), -1);
+    TEST_EQ(add_watchpoint(&proc, 0x311, 0x312, WATCH_WRITE), 0);
+
+    // Only the watched page leaves the fast path, and only for writes
+    TEST_EQ(proc.write_map[3] == NULL, 1);
+    TEST_EQ(proc.read_map[3] != NULL, 1);
+    TEST_EQ(proc.write_map[4] != NULL, 1);
+
+    // STA $0313 is on the same page, but outside the range
+    TEST_EQ(run_instructions(&proc, 100), STOP_WATCHPOINT);
+    TEST_EQ((int) proc.instructions, 7);
+    TEST_EQ(proc.pc, 0x208);
+    TEST_EQ(proc.watch_hit.pc, 0x205);
+    TEST_EQ(proc.watch_hit.addr, 0x312);
+    TEST_EQ(proc.watch_hit.flags, WATCH_WRITE);
+    TEST_EQ(proc.watch_hit.old_value, 0);
+    TEST_EQ(proc.watch_hit.new_value, 0x55);
+    TEST_EQ(proc.memory[0x312], 0x55);
+
+    TEST_EQ(run_instructions(&proc, 100), STOP_WATCHPOINT);
+    TEST_EQ(proc.watch_hit.addr, 0x311);
+
+    // Read-modify-write
+    TEST_EQ(run_instructions(&proc, 100), STOP_WATCHPOINT);
+    TEST_EQ(proc.watch_hit.pc, 0x20b);
+    TEST_EQ(proc.watch_hit.old_value, 0x55);
+    TEST_EQ(proc.watch_hit.new_value, 0x56);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+
+    TEST_EQ(remove_watchpoint(&proc, 0x312), -1);
+    TEST_EQ(remove_watchpoint(&proc, 0x311), 0);
+    TEST_EQ(proc.num_watchpoints, 0);
+    TEST_EQ(proc.write_map[3] != NULL, 1);
+
+    // Fetching instructions doesn't count as reading them
+    add_watchpoint(&proc, 0x200, 0x2ff, WATCH_READ);
+    add_watchpoint(&proc, 0x400, 0x400, WATCH_READ | WATCH_WRITE);
+    TEST_EQ(proc.read_map[2] == NULL, 1);
+    proc.pc = 0x200;
+    TEST_EQ(run_instructions(&proc, 100), STOP_WATCHPOINT);
+    TEST_EQ(proc.pc, 0x205);
+    TEST_EQ(proc.watch_hit.pc, 0x202);
+    TEST_EQ(proc.watch_hit.addr, 0x400);
+    TEST_EQ(proc.watch_hit.flags, WATCH_READ);
+    TEST_EQ(proc.watch_hit.new_value, 0x55);
+
+    // Watchpoints aren't inherited
+    struct m6502 child;
+    fork_proc(&child, &proc);
+    TEST_EQ(child.num_watchpoints, 0);
+    TEST_EQ(child.read_map[4] != NULL, 1);
+    free_proc(&child);
+
+    // Going back in time runs through them, but reports one hit by the
+    // last instruction before the new state.
+    TEST_EQ(remove_watchpoint(&proc, 0x200), 0);
+    TEST_EQ(remove_watchpoint(&proc, 0x400), 0);
+    add_watchpoint(&proc, 0x311, 0x311, WATCH_WRITE);
+    struct history history;
+    proc.pc = 0x200;
+    proc.instructions = 0;
+    init_history(&history, 4, 8);
+    restart_history(&history, &proc);
+    TEST_EQ(run_history(&history, &proc, 100), STOP_WATCHPOINT);
+    TEST_EQ((int) proc.instructions, 11);
+    TEST_EQ(seek_history(&history, &proc, 0), 0);
+    TEST_EQ(seek_history(&history, &proc, 12), 0);
+    TEST_EQ(proc.halt, STOP_NONE);
+    TEST_EQ(seek_history(&history, &proc, 11), 0);
+    TEST_EQ(proc.halt, STOP_WATCHPOINT);
+    TEST_EQ(proc.watch_hit.pc, 0x205);
+    TEST_EQ(seek_history(&history, &proc, 10), 0);
+    TEST_EQ(proc.halt, STOP_NONE);
+    free_history(&history);
+
+    free_proc(&proc);
+}
+
+void test_console() {
+    const uint8_t PROGRAM[] = {
+        0xa9, 'h',          // LDA #'h'
+        0x8d, 0xfa, 0xff,   // STA CONSOLE_OUT
+        0xa9, 'i',          // LDA #'i'
+        0x8d, 0xfa, 0xff,   // STA CONSOLE_OUT
+        0x00                // BRK
+    };
+
+    // Collected in memory
+    struct m6502 proc;
+    init_proc(&proc);
+    close_console(proc.console);
+    proc.console = open_console(-1, 0);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    size_t length;
+    const char *output = console_output(proc.console, &length);
+    TEST_EQ((int) length, 2);
+    TEST_EQ(memcmp(output, "hi", 2), 0);
+    clear_console_output(proc.console);
+    console_output(proc.console, &length);
+    TEST_EQ((int) length, 0);
+    free_proc(&proc);
+
+    int fds[2];
+    TEST_EQ(pipe(fds), 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    char *buf = malloc(CONSOLE_BUFFER_SIZE);
+
+    // Written at a newline
+    struct console *console = open_console(fds[1], CONSOLE_FLUSH_NEWLINE);
+    TEST_EQ(console_put(console, 'a'), 0);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), -1);
+    TEST_EQ(console_put(console, '\n'), 0);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), 2);
+    TEST_EQ(memcmp(buf, "a\n", 2), 0);
+
+    // Written when the buffer fills
+    console->flags = 0;
+    for (int i = 0; i < CONSOLE_BUFFER_SIZE; i++) {
+        TEST_EQ(console_put(console, '\n'), 0);
+    }
+
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), -1);
+    TEST_EQ(console_put(console, 'b'), 0);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), CONSOLE_BUFFER_SIZE);
+
+    // Written when closed
+    close_console(console);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), 1);
+    TEST_EQ(buf[0], 'b');
+
+    // Written when the emulator stops, but not when its budget runs out
+    init_proc(&proc);
+    close_console(proc.console);
+    proc.console = open_console(fds[1], 0);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+    TEST_EQ(run_instructions(&proc, 3), STOP_BUDGET);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), -1);
+    TEST_EQ(run_instructions(&proc, 100), STOP_BRK);
+    TEST_EQ((int) read(fds[0], buf, CONSOLE_BUFFER_SIZE), 2);
+    TEST_EQ(memcmp(buf, "hi", 2), 0);
+    free_proc(&proc);
+
+    free(buf);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_trace() {
+    // Counts X down from 0 to 0 (256 times) and stores it, 200 times, so
+    // the ring wraps.
+    const uint8_t PROGRAM[] = {
+        0xa0, 0xc8,         // LDY #200
+        0xe8,               // outer: INX
+        0x86, 0x80,         // inner: STX $80
+        0xca,               // DEX
+        0xd0, 0xfb,         // BNE inner
+        0x88,               // DEY
+        0xd0, 0xf7,         // BNE outer
+        0x00                // BRK
+    };
+    char filename[] = "/tmp/6502-traceXXXXXX";
+    close(mkstemp(filename));
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+#ifdef ENABLE_JIT
+    TEST_EQ(jit_enable(&proc), 0);
+#endif
+    TEST_EQ(start_trace(&proc, filename), 0);
+    TEST_EQ(start_trace(&proc, filename), -1);
+    TEST_EQ(errno, EBUSY);
+    TEST_EQ(run_instructions(&proc, 1000), STOP_BUDGET);
+    TEST_EQ(run_instructions(&proc, 1000000), STOP_BRK);
+    TEST_EQ(stop_trace(&proc), 0);
+    TEST_EQ(proc.trace == NULL, 1);
+
+    FILE *file = fopen(filename, "rb");
+    struct trace_header header;
+    TEST_EQ((int) fread(&header, sizeof(header), 1, file), 1);
+    TEST_EQ(memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)), 0);
+    TEST_EQ((int) header.record_size, (int) sizeof(struct trace_record));
+
+    // Check against the program, as run by itself
+    struct m6502 expected;
+    init_proc(&expected);
+    memcpy(expected.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    expected.pc = 0x200;
+    struct trace_record record;
+    uint64_t count = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        TEST_EQ(record.pc, expected.pc);
+        TEST_EQ(record.opcode, expected.memory[expected.pc]);
+        if (record.opcode == 0x86) {
+            TEST_EQ(record.operand, 0x80);
+        }
+
+        run_instructions(&expected, 1);
+        TEST_EQ(record.x, expected.x);
+        TEST_EQ(record.y, expected.y);
+        TEST_EQ(record.status, get_status(&expected));
+        count++;
+    }
+
+    TEST_EQ((int) count, (int) proc.instructions);
+    TEST_EQ(expected.pc, proc.pc);
+    fclose(file);
+    unlink(filename);
+
+    char text[32];
+    format_inst(text, sizeof(text), 0x207, 0xd0, 0xfb);
+    TEST_EQ(strcmp(text, "BNE 0204"), 0);
+    format_inst(text, sizeof(text), 0, 0xbd, 0x1234);
+    TEST_EQ(strcmp(text, "LDA $1234, X"), 0);
+
+    free_proc(&proc);
+    free_proc(&expected);
+}
+
+#ifdef ENABLE_PROFILE
+
+void test_profile() {
+    const uint8_t PROGRAM[] = {
+        0xa2, 0x0a,         // LDX #10
+        0x9d, 0x00, 0x30,   // loop: STA $3000, X
+        0xbd, 0x00, 0x31,   // LDA $3100, X
+        0xca,               // DEX
+        0xd0, 0xf7,         // BNE loop
+        0x00                // BRK
+    };
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+#ifdef ENABLE_JIT
+    TEST_EQ(jit_enable(&proc), 0);
+#endif
+    TEST_EQ(start_profile(&proc), 0);
+    TEST_EQ(run_instructions(&proc, 1000), STOP_BRK);
+    TEST_EQ((int) proc.profile->opcodes[0xa2], 1);
+    TEST_EQ((int) proc.profile->opcodes[0xca], 10);
+    TEST_EQ((int) proc.profile->addresses[0x202], 10);
+    TEST_EQ((int) proc.profile->addresses[0x20b], 1);
+    TEST_EQ((int) proc.profile->page_writes[0x30], 10);
+    TEST_EQ((int) proc.profile->page_reads[0x31], 10);
+    TEST_EQ((int) proc.profile->page_writes[0x31], 0);
+    TEST_EQ((int) proc.profile->page_reads[0x02], 0);
+
+    // Starting again clears the counts
+    TEST_EQ(start_profile(&proc), 0);
+    TEST_EQ((int) proc.profile->opcodes[0xca], 0);
+    stop_profile(&proc);
+    TEST_EQ(proc.profile == NULL, 1);
+
+    free_proc(&proc);
+}
+
+void test_call_graph() {
+    const uint8_t PROGRAM[] = {
+        0x20, 0x10, 0x02,   // 0200 JSR a
+        0x20, 0x20, 0x02,   // 0203 JSR c
+        0xa9, 0x02,         // 0206 LDA #$02      Jump to e with RTS
+        0x48,               // 0208 PHA
+        0xa9, 0x30,         // 0209 LDA #$30
+        0x48,               // 020b PHA
+        0x60,               // 020c RTS
+        0, 0, 0,
+        0x20, 0x18, 0x02,   // 0210 a: JSR b
+        0x60,               // 0213 RTS
+        0, 0, 0, 0,
+        0xe8,               // 0218 b: INX
+        0x60,               // 0219 RTS
+        0, 0, 0, 0, 0, 0,
+        0x20, 0x28, 0x02,   // 0220 c: JSR d
+        0xe8,               // 0223 INX (skipped)
+        0, 0, 0, 0,
+        0x68,               // 0228 d: PLA        Return to c's caller
+        0x68,               // 0229 PLA
+        0x60,               // 022a RTS
+        0, 0, 0, 0, 0,
+        0x00                // 0230 e: BRK
+    };
+    char symbols[] = "/tmp/6502-symbolsXXXXXX";
+    int fd = mkstemp(symbols);
+    const char SYMBOLS[] = "--- Symbol List\na 0210 (R )\nd 228\n";
+    TEST_EQ((int) write(fd, SYMBOLS, sizeof(SYMBOLS) - 1),
+        (int) sizeof(SYMBOLS) - 1);
+    close(fd);
+
+    struct m6502 proc;
+    init_proc(&proc);
+    memcpy(proc.memory + 0x200, PROGRAM, sizeof(PROGRAM));
+    proc.pc = 0x200;
+    TEST_EQ(start_profile(&proc), 0);
+    TEST_EQ(load_symbols(&proc, symbols), 0);
+    TEST_EQ(run_instructions(&proc, 1000), STOP_BRK);
+    TEST_EQ(proc.pc, 0x231);
+    TEST_EQ(proc.profile->call_depth, 0);
+
+    char *folded;
+    size_t length;
+    FILE *file = open_memstream(&folded, &length);
+    write_folded(&proc, file, 0);
+    fclose(file);
+    TEST_EQ(strcmp(folded,
+        "$0200 8\n"
+        "$0200;a 2\n"
+        "$0200;a;$0218 2\n"
+        "$0200;$0220 1\n"
+        "$0200;$0220;d 3\n"), 0);
+    free(folded);
+
+    file = open_memstream(&folded, &length);
+    write_folded(&proc, file, 1);
+    fclose(file);
+    TEST_EQ(strcmp(folded,
+        "$0200 35\n"
+        "$0200;a 12\n"
+        "$0200;a;$0218 8\n"
+        "$0200;$0220 6\n"
+        "$0200;$0220;d 14\n"), 0);
+    free(folded);
+
+    unlink(symbols);
+    free_proc(&proc);
 }
 
+#endif
+
+#ifdef ENABLE_JIT
+
+static void check_same_state(struct m6502 *jit, struct m6502 *interp) {
+    TEST_EQ(jit->pc, interp->pc);
+    TEST_EQ((int) jit->cycles, (int) interp->cycles);
+    TEST_EQ((uint8_t) jit->a, (uint8_t) interp->a);
+    TEST_EQ(jit->x, interp->x);
+    TEST_EQ(jit->y, interp->y);
+    TEST_EQ(jit->s, interp->s);
+    TEST_EQ(get_flag(jit, FLAG_N), get_flag(interp, FLAG_N));
+    TEST_EQ(get_flag(jit, FLAG_V), get_flag(interp, FLAG_V));
+    TEST_EQ(get_flag(jit, FLAG_Z), get_flag(interp, FLAG_Z));
+    TEST_EQ(get_flag(jit, FLAG_C), get_flag(interp, FLAG_C));
+    for (int addr = 0; addr < 0x800; addr++) {
+        TEST_EQ(jit->memory[addr], interp->memory[addr]);
+    }
+}
+
+// Run the same program with the interpreter and with the JIT enabled, and
+// check they end up in the same state. The programs loop enough times for
+// their blocks to be translated. If slice is nonzero, run them that many
+// instructions at a time and compare after each.
+static void check_jit_matches_interpreter(const uint8_t *program, int length,
+                                          int slice) {
+    struct m6502 interp;
+    struct m6502 jit;
+    init_proc(&interp);
+    init_proc(&jit);
+    TEST_EQ(jit_enable(&jit), 0);
+    memcpy(interp.memory, program, length);
+    memcpy(jit.memory, program, length);
+    if (slice == 0) {
+        run_emulator(&interp, 0);
+        run_emulator(&jit, 0);
+        check_same_state(&jit, &interp);
+    } else {
+        // Translated blocks must stop at exactly the same instruction
+        // when the budget runs out part way through them.
+        enum stop_reason reason;
+        do {
+            reason = run_instructions(&interp, slice);
+            TEST_EQ(run_instructions(&jit, slice), reason);
+            TEST_EQ((int) jit.instructions, (int) interp.instructions);
+            check_same_state(&jit, &interp);
+        } while (reason == STOP_BUDGET);
+    }
+
+    free_proc(&jit);
+    free_proc(&interp);
+}
+
+// Reads from a device go through the page table in translated code.
+static void test_jit_device_reads() {
+    //          ldy #0
+    //          lda #$00
+    //          sta $e0
+    //          lda #$90
+    //          sta $e1
+    // loop:    lda $9000
+    //          sta $0400,y
+    //          lda ($e0),y
+    //          eor $9000,y
+    //          sta $0500,y
+    //          iny
+    //          bne loop
+    //          brk
+    static const uint8_t PROGRAM[] = {
+        0xa0, 0x00, 0xa9, 0x00, 0x85, 0xe0, 0xa9, 0x90, 0x85, 0xe1, 0xad, 0x00,
+        0x90, 0x99, 0x00, 0x04, 0xb1, 0xe0, 0x59, 0x00, 0x90, 0x99, 0x00, 0x05,
+        0xc8, 0xd0, 0xef, 0x00
+    };
+
+    struct m6502 interp;
+    struct m6502 jit;
+    struct test_device interp_device = { 0, 0 };
+    struct test_device jit_device = { 0, 0 };
+    init_proc(&interp);
+    init_proc(&jit);
+    TEST_EQ(jit_enable(&jit), 0);
+    memcpy(interp.memory, PROGRAM, sizeof(PROGRAM));
+    memcpy(jit.memory, PROGRAM, sizeof(PROGRAM));
+    for (int i = 1; i < PAGE_SIZE; i++) {
+        interp.memory[0x9000 + i] = jit.memory[0x9000 + i] = i * 7;
+    }
+
+    map_handlers(&interp, 0x90, 1, test_device_read, NULL, &interp_device);
+    map_handlers(&jit, 0x90, 1, test_device_read, NULL, &jit_device);
+    run_emulator(&interp, 0);
+    run_emulator(&jit, 0);
+    check_same_state(&jit, &interp);
+    TEST_EQ(jit_device.count, interp_device.count);
+
+    free_proc(&jit);
+    free_proc(&interp);
+}
+
+void test_jit() {
+    // The last part of the outer loop increments the operand of an
+    // instruction in a translated block.
+    //
+    //          ldx #0
+    //          ldy #0
+    //          lda #$00
+    //          sta $f0
+    //          lda #$03
+    //          sta $f1
+    //          lda #64
+    //          sta count
+    // outer:   ldy #0
+    // fill:    tya
+    //          eor count
+    //          sta ($f0),y
+    //          iny
+    //          bne fill
+    // accum:   lda ($f0),y
+    //          clc
+    //          adc sum
+    //          sta sum
+    //          lda sum+1
+    //          adc #0
+    //          sta sum+1
+    //          lda ($f0),y
+    //          asl
+    //          rol sum+1
+    //          lsr
+    //          ror sum
+    //          bit sum
+    //          bvc nov
+    //          inc $0500,x
+    // nov:     bmi neg
+    //          dec $0500,x
+    // neg:     cmp #$40
+    //          bcc less
+    //          sbc #$10
+    //          sta $0400,y
+    //          jmp next
+    // less:    pha
+    //          jsr sub
+    //          pla
+    //          sta $0400,y
+    // next:    iny
+    //          bne accum
+    // smc:     lda #0
+    //          sta $0600,x
+    //          inc smc+1
+    //          inx
+    //          dec count
+    //          bne outer
+    //          txa
+    //          tay
+    //          lda ($e0,x)
+    //          brk
+    // sub:     tax
+    //          lda $0400,x
+    //          cpx #$20
+    //          beq skip
+    //          cpy #$30
+    //          bcs skip
+    //          adc #$37
+    //          sta $0400,x
+    // skip:    ldx count
+    //          rts
+    //
+    // count = $ea, sum = $eb
+    static const uint8_t PROGRAM1[] = {
+        0xa2, 0x00, 0xa0, 0x00, 0xa9, 0x00, 0x85, 0xf0, 0xa9, 0x03, 0x85, 0xf1,
+        0xa9, 0x40, 0x85, 0xea, 0xa0, 0x00, 0x98, 0x45, 0xea, 0x91, 0xf0, 0xc8,
+        0xd0, 0xf8, 0xb1, 0xf0, 0x18, 0x65, 0xeb, 0x85, 0xeb, 0xa5, 0xec, 0x69,
+        0x00, 0x85, 0xec, 0xb1, 0xf0, 0x0a, 0x26, 0xec, 0x4a, 0x66, 0xeb, 0x24,
+        0xeb, 0x50, 0x03, 0xfe, 0x00, 0x05, 0x30, 0x03, 0xde, 0x00, 0x05, 0xc9,
+        0x40, 0x90, 0x08, 0xe9, 0x10, 0x99, 0x00, 0x04, 0x4c, 0x4f, 0x00, 0x48,
+        0x20, 0x63, 0x00, 0x68, 0x99, 0x00, 0x04, 0xc8, 0xd0, 0xc8, 0xa9, 0x00,
+        0x9d, 0x00, 0x06, 0xe6, 0x53, 0xe8, 0xc6, 0xea, 0xd0, 0xb2, 0x8a, 0xa8,
+        0xa1, 0xe0, 0x00, 0xaa, 0xbd, 0x00, 0x04, 0xe0, 0x20, 0xf0, 0x09, 0xc0,
+        0x30, 0xb0, 0x05, 0x69, 0x37, 0x9d, 0x00, 0x04, 0xa6, 0xea, 0x60
+    };
+
+    //          ldy #200
+    // loop:    tsx
+    //          txs
+    //          sec
+    //          tya
+    //          and #$3c
+    //          ora ($e0,x)
+    //          sbc #$05
+    //          clv
+    //          sta $0300,y
+    //          ldx $0300,y
+    //          stx $30,y
+    //          sty $40,x
+    //          txa
+    //          bmi neg
+    //          dex
+    // neg:     dex
+    //          dey
+    //          bne loop
+    //          brk
+    static const uint8_t PROGRAM2[] = {
+        0xa0, 0xc8, 0xba, 0x9a, 0x38, 0x98, 0x29, 0x3c, 0x01, 0xe0, 0xe9, 0x05,
+        0xb8, 0x99, 0x00, 0x03, 0xbe, 0x00, 0x03, 0x96, 0x30, 0x94, 0x40, 0x8a,
+        0x30, 0x01, 0xca, 0xca, 0x88, 0xd0, 0xe3, 0x00
+    };
+
+    // Indexed reads that cross pages part of the time, which costs an
+    // extra cycle.
+    //
+    //          ldy #0
+    //          lda #$c0
+    //          sta $e0
+    //          lda #$10
+    //          sta $e1
+    // loop:    lda $10f0,y
+    //          adc ($e0),y
+    //          tax
+    //          lda $1000,x
+    //          iny
+    //          bne loop
+    //          brk
+    static const uint8_t PROGRAM3[] = {
+        0xa0, 0x00, 0xa9, 0xc0, 0x85, 0xe0, 0xa9, 0x10, 0x85, 0xe1, 0xb9, 0xf0,
+        0x10, 0x71, 0xe0, 0xaa, 0xbd, 0x00, 0x10, 0xc8, 0xd0, 0xf4, 0x00
+    };
+
+    check_jit_matches_interpreter(PROGRAM1, sizeof(PROGRAM1), 0);
+    check_jit_matches_interpreter(PROGRAM2, sizeof(PROGRAM2), 0);
+    check_jit_matches_interpreter(PROGRAM1, sizeof(PROGRAM1), 37);
+    check_jit_matches_interpreter(PROGRAM2, sizeof(PROGRAM2), 37);
+    check_jit_matches_interpreter(PROGRAM3, sizeof(PROGRAM3), 0);
+    test_jit_device_reads();
+}
+
+#endif
+
 int main() {
     test_ld();
     test_st();
@@ -1201,11 +2733,35 @@ int main() {
     test_logical();
     test_jsr_rts();
     test_stack();
+    test_status_stack();
     test_transfer();
     test_inc_dec();
     test_set_clear_flags();
     test_compare();
     test_bit();
+    test_flag_accessors();
+    test_self_modifying_code();
+    test_run_instructions();
+    test_cycles();
+    test_memory_map();
+    test_load_image();
+    test_fleet();
+    test_fork();
+    test_save_state();
+    test_delta_state();
+    test_history();
+    test_console();
+    test_breakpoints();
+    test_conditions();
+    test_watchpoints();
+    test_trace();
+#ifdef ENABLE_PROFILE
+    test_profile();
+    test_call_graph();
+#endif
+#ifdef ENABLE_JIT
+    test_jit();
+#endif
 
     printf("PASS\n");
     return 0;
@@ -43,11 +43,145 @@ def inst_encoding(fmt, field_index, field_value):
         table[table_index][field_index] = field_value
 
 
+# How each instruction consumes its operand. This determines the code
+# generated for its handlers, so that the addressing mode is resolved
+# here rather than being switched on at runtime.
+#   VALUE   - inst_X(proc, value), operand is the value read from memory
+#   ADDRESS - inst_X(proc, addr), operand is the effective address
+#   RMW     - inst_X(proc, value) returns the new value, which is written
+#             back to the accumulator or memory location.
+#   IMPLIED - inst_X(proc), no operand
+OPERAND_KIND = {
+    'ORA': 'VALUE', 'AND': 'VALUE', 'EOR': 'VALUE', 'ADC': 'VALUE',
+    'LDA': 'VALUE', 'CMP': 'VALUE', 'SBC': 'VALUE', 'LDX': 'VALUE',
+    'LDY': 'VALUE', 'BIT': 'VALUE', 'CPX': 'VALUE', 'CPY': 'VALUE',
+    'BPL': 'VALUE', 'BMI': 'VALUE', 'BVC': 'VALUE', 'BVS': 'VALUE',
+    'BCC': 'VALUE', 'BCS': 'VALUE', 'BNE': 'VALUE', 'BEQ': 'VALUE',
+    'STA': 'ADDRESS', 'STX': 'ADDRESS', 'STY': 'ADDRESS', 'JMP': 'ADDRESS',
+    'JSR': 'ADDRESS',
+    'ASL': 'RMW', 'ROL': 'RMW', 'LSR': 'RMW', 'ROR': 'RMW', 'INC': 'RMW',
+    'DEC': 'RMW',
+}
+
+OPERAND_BYTES = {
+    'IMPLIED': 0,
+    'IMMEDIATE': 1,
+    'RELATIVE': 1,
+    'ZERO_PAGE': 1,
+    'ZERO_PAGE_X': 1,
+    'ZERO_PAGE_Y': 1,
+    'IND_ZERO_PAGE_X': 1,
+    'IND_ZERO_PAGE_Y': 1,
+    'ABSOLUTE': 2,
+    'ABSOLUTE_X': 2,
+    'ABSOLUTE_Y': 2,
+    'INDIRECT': 2,
+}
+
+# Indexed reads take an extra cycle when adding the index register carries
+# into the high byte of the address.
+PAGE_CROSS_INDEX = {
+    'ABSOLUTE_X': 'x',
+    'ABSOLUTE_Y': 'y',
+    'IND_ZERO_PAGE_Y': 'y',
+}
+
+# Base cycle counts, before page crossing and branch penalties
+ADDRESS_CYCLES = {
+    'IMMEDIATE': 2,
+    'ZERO_PAGE': 3,
+    'ZERO_PAGE_X': 4,
+    'ZERO_PAGE_Y': 4,
+    'ABSOLUTE': 4,
+    'ABSOLUTE_X': 4,
+    'ABSOLUTE_Y': 4,
+    'IND_ZERO_PAGE_X': 6,
+    'IND_ZERO_PAGE_Y': 5,
+}
+
+SPECIAL_CYCLES = {
+    'BRK': 7, 'JSR': 6, 'RTS': 6, 'RTI': 6, 'PHA': 3, 'PHP': 3, 'PLA': 4,
+    'PLP': 4,
+}
+
+def value_expr(mode):
+    if mode in ('IMMEDIATE', 'RELATIVE'):
+        return 'operand'
+    elif mode == 'IMPLIED':
+        return 'proc->a'
+    else:
+        return f'read_mem_u8(proc, get_operand_addr_{mode}(proc, operand))'
+
+def handler_body(mode, mnemonic):
+    kind = OPERAND_KIND.get(mnemonic, 'IMPLIED')
+    has_addr = mode not in ('IMMEDIATE', 'IMPLIED', 'RELATIVE')
+    if kind == 'IMPLIED':
+        return [f'inst_{mnemonic}(proc);']
+    elif kind == 'VALUE' and mode in PAGE_CROSS_INDEX:
+        return [
+            f'uint16_t addr = get_operand_addr_{mode}(proc, operand);',
+            f'proc->cycles += (uint8_t) addr < proc->{PAGE_CROSS_INDEX[mode]};',
+            f'inst_{mnemonic}(proc, read_mem_u8(proc, addr));'
+        ]
+    elif kind == 'VALUE':
+        return [f'inst_{mnemonic}(proc, {value_expr(mode)});']
+    elif kind == 'ADDRESS' and has_addr:
+        return [f'inst_{mnemonic}(proc, get_operand_addr_{mode}(proc, operand));']
+    elif kind == 'RMW' and mode == 'IMPLIED' and mnemonic not in ('INC', 'DEC'):
+        return [f'proc->a = inst_{mnemonic}(proc, proc->a);']
+    elif kind == 'RMW' and has_addr:
+        return [
+            f'uint16_t addr = get_operand_addr_{mode}(proc, operand);',
+            f'write_mem_u8(proc, addr, inst_{mnemonic}(proc, read_mem_u8(proc, addr)));'
+        ]
+    else:
+        # Combination that doesn't exist on the real part (e.g. STA #imm).
+        return None
+
+# Whether the handler can stop the emulator, in which case it returns
+# proc->halt. The rest return a constant zero, so the check after them in
+# the dispatch loop compiles away.
+def may_stop(mode, mnemonic):
+    body = handler_body(mode, mnemonic)
+    return body is None or any('write_mem_u8' in line for line in body) \
+        or mnemonic in ('BRK', 'INVALID', 'STA', 'STX', 'STY', 'PHA', 'PHP',
+                        'JSR')
+
+def instruction_cycles(mode, mnemonic):
+    kind = OPERAND_KIND.get(mnemonic, 'IMPLIED')
+    if mnemonic == 'INVALID' or handler_body(mode, mnemonic) is None:
+        return 2
+    elif mnemonic in SPECIAL_CYCLES:
+        return SPECIAL_CYCLES[mnemonic]
+    elif mnemonic == 'JMP':
+        return 5 if mode == 'INDIRECT' else 3
+    elif mode in ('IMPLIED', 'RELATIVE'):
+        return 2
+    elif kind == 'RMW':
+        return ADDRESS_CYCLES[mode] + (3 if mode == 'ABSOLUTE_X' else 2)
+    elif kind == 'ADDRESS' and mode in PAGE_CROSS_INDEX:
+        return ADDRESS_CYCLES[mode] + 1 # Stores always take the extra cycle
+    else:
+        return ADDRESS_CYCLES[mode]
+
+def instruction_length(mode, mnemonic):
+    if mnemonic == 'INVALID' or handler_body(mode, mnemonic) is None:
+        return 1
+
+    return 1 + OPERAND_BYTES[mode]
+
 def dump_table():
     with open('instructions.h', 'w', encoding='UTF-8') as outfile:
         outfile.write(f'''// This file autogenerated by {sys.argv[0]}
-
-struct m6502;
+//
+// Define INSTRUCTION_HANDLERS before including this to get the handler
+// functions and the definition of the INSTRUCTIONS table. This must be
+// done after the inst_ and get_operand_addr_ functions are defined, as the
+// handlers call them directly. Handlers are called with the operand bytes
+// already fetched (see decode_inst) and advance the PC by their own
+// length, which is a constant here rather than something that has to be
+// loaded before the next instruction can start. Handlers return nonzero
+// if the instruction stopped the emulator (see enum stop_reason).
 
 ''')
 
@@ -55,36 +189,60 @@ struct m6502;
         for entry in table:
             address_modes.add(entry[0])
 
-        instructions = set()
-        for entry in table:
-            instructions.add(entry[1])
-
         outfile.write('enum address_mode {\n')
         for entry in sorted(address_modes):
             outfile.write(f'    {entry},\n')
 
-        outfile.write('};\n\n')
-
-        for inst in sorted(instructions):
-            outfile.write(f'void inst_{inst}(struct m6502*, enum address_mode);\n')
+        outfile.write('''};
 
-        outfile.write('''\nstruct instruction {
+struct instruction {
     enum address_mode mode;
-    void (*func)(struct m6502*, enum address_mode);
+    int (*func)(struct m6502*, uint16_t operand);
     const char *mnemonic;
+    int length;
+    int cycles;
 };
 
-const struct instruction INSTRUCTIONS[] = {
+extern const struct instruction INSTRUCTIONS[256];
+
+#ifdef INSTRUCTION_HANDLERS
+
 ''')
 
+        for index, entry in enumerate(table):
+            body = handler_body(entry[0], entry[1]) or ['inst_INVALID(proc);']
+            body = [
+                f'proc->pc += {instruction_length(entry[0], entry[1])};',
+                f'proc->cycles += {instruction_cycles(entry[0], entry[1])};'
+            ] + body
+            body.append('return proc->halt;' if may_stop(entry[0], entry[1]) else 'return 0;')
+            outfile.write(f'static int op_{index:02x}(struct m6502 *proc, uint16_t operand) {{ // {entry[1]} {entry[0]}\n')
+            for line in body:
+                outfile.write(f'    {line}\n')
+
+            outfile.write('}\n\n')
+
+        outfile.write('const struct instruction INSTRUCTIONS[256] = {\n')
+
         for index, entry in enumerate(table):
             mnemonic = '???' if entry[1] == 'INVALID' else entry[1]
-            line = f'    {{ {entry[0]}, inst_{entry[1]}, "{mnemonic}" }},'
+            length = instruction_length(entry[0], entry[1])
+            cycles = instruction_cycles(entry[0], entry[1])
+            line = f'    {{ {entry[0]}, op_{index:02x}, "{mnemonic}", {length}, {cycles} }},'
             if index % 16 == 0:
-                line += (' ' * (40 - len(line))) + '// ' + hex(index)
+                line += (' ' * (44 - len(line))) + '// ' + hex(index)
             outfile.write(line + '\n')
 
-        outfile.write('};\n')
+        outfile.write('};\n\n')
+        outfile.write('#endif\n\n')
+
+        # X-macro used to build the computed goto dispatch loop, which needs
+        # a label per opcode rather than a function pointer.
+        outfile.write('#define FOR_EACH_OPCODE(X) \\\n')
+        for index, entry in enumerate(table):
+            outfile.write(f'    X({index:02x}, {entry[1]}, {entry[0]}) \\\n')
+
+        outfile.write('\n')
 
 def main():
     # Group 1 instructions
@@ -0,0 +1,255 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Measures how long the interpreter takes to run each instruction. For
+// every opcode, this builds a loop that runs it many times in a row, then
+// times run_instructions on it and prints a table sorted from the slowest.
+// Opcodes that stop the emulator (BRK and the undefined ones) are skipped.
+//
+// Every instance of the opcode gets the same operand, chosen so the
+// instruction can run forever: reads and writes go to a data area away
+// from the code, indirect addresses point there too, branches have an
+// offset of zero, and jumps go to the next instance. Instructions that
+// push or pull have the stack pointer reset at the end of each pass, with
+// return addresses already on the stack for RTS and RTI. The time includes
+// a share of the jump (and stack reset) that closes the loop.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "6502-core.h"
+#include "6502-jit.h"
+#include "instructions.h"
+
+#define CODE_ADDR 0x1000
+#define DATA_ADDR 0x3000
+#define JUMP_TABLE 0x4000   // Targets for JMP (indirect)
+#define ZP_POINTER 0x80     // Points to DATA_ADDR
+#define ZP_DATA 0x90
+#define COPIES 64
+
+struct result {
+    int opcode;
+    double ns;
+};
+
+static int use_jit = 0;
+
+// Bytes each instance pushes (positive) or pulls (negative)
+static int stack_bytes(const char *mnemonic) {
+    if (strcmp(mnemonic, "PHA") == 0 || strcmp(mnemonic, "PHP") == 0) {
+        return 1;
+    } else if (strcmp(mnemonic, "JSR") == 0) {
+        return 2;
+    } else if (strcmp(mnemonic, "PLA") == 0 || strcmp(mnemonic, "PLP") == 0) {
+        return -1;
+    } else if (strcmp(mnemonic, "RTS") == 0) {
+        return -2;
+    } else if (strcmp(mnemonic, "RTI") == 0) {
+        return -3;
+    } else {
+        return 0;
+    }
+}
+
+static uint16_t choose_operand(int opcode, uint16_t addr, int index) {
+    const struct instruction *inst = &INSTRUCTIONS[opcode];
+    switch (inst->mode) {
+        case IMMEDIATE: return 1;
+        case RELATIVE: return 0;
+        case ZERO_PAGE:
+        case ZERO_PAGE_X:
+        case ZERO_PAGE_Y:
+            return ZP_DATA;
+
+        case IND_ZERO_PAGE_X:
+        case IND_ZERO_PAGE_Y:
+            return ZP_POINTER;
+
+        case INDIRECT: return JUMP_TABLE + index * 2;
+        case ABSOLUTE:
+            if (strcmp(inst->mnemonic, "JMP") == 0
+                    || strcmp(inst->mnemonic, "JSR") == 0) {
+                return addr + inst->length;
+            }
+
+            return DATA_ADDR;
+
+        default:
+            return DATA_ADDR;
+    }
+}
+
+static void build_loop(struct m6502 *proc, int opcode) {
+    const struct instruction *inst = &INSTRUCTIONS[opcode];
+    uint8_t *mem = proc->memory;
+    memset(mem, 0, MEM_SIZE);
+    mem[ZP_POINTER] = DATA_ADDR & 0xff;
+    mem[ZP_POINTER + 1] = DATA_ADDR >> 8;
+
+    // RTS and RTI return to the next instance. RTS in this emulator
+    // returns to the pulled address itself.
+    int stack = stack_bytes(inst->mnemonic);
+    uint8_t initial_s = stack < 0 ? 0xff + stack * COPIES : 0xff;
+    uint16_t sp = 0x100 + initial_s + 1;
+    uint16_t addr = CODE_ADDR;
+    for (int i = 0; i < COPIES; i++) {
+        uint16_t operand = choose_operand(opcode, addr, i);
+        mem[addr] = opcode;
+        mem[addr + 1] = operand & 0xff;
+        mem[addr + 2] = operand >> 8;
+        addr += inst->length;
+        mem[JUMP_TABLE + i * 2] = addr & 0xff;
+        mem[JUMP_TABLE + i * 2 + 1] = addr >> 8;
+        if (stack == -3) {
+            mem[sp++] = 0;  // Status
+        }
+
+        if (stack <= -2) {
+            mem[sp++] = addr & 0xff;
+            mem[sp++] = addr >> 8;
+        }
+    }
+
+    if (stack != 0) {
+        mem[addr++] = 0xa2; // LDX #initial_s
+        mem[addr++] = initial_s;
+        mem[addr++] = 0x9a; // TXS
+    }
+
+    mem[addr++] = 0x4c; // JMP CODE_ADDR
+    mem[addr++] = CODE_ADDR & 0xff;
+    mem[addr++] = CODE_ADDR >> 8;
+
+    proc->a = 0;
+    proc->x = 0;
+    proc->y = 0;
+    proc->s = initial_s;
+    proc->pc = CODE_ADDR;
+    set_status(proc, 0);
+    proc->halt = STOP_NONE;
+    flush_decode_cache(proc);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the fastest of several timed runs in nanoseconds per
+// instruction, or a negative value if the instruction stopped the
+// emulator.
+static double time_opcode(struct m6502 *proc, int opcode, uint64_t count,
+                          int repeats) {
+    build_loop(proc, opcode);
+    if (run_instructions(proc, COPIES * 4) != STOP_BUDGET) {
+        return -1;  // Also warms up the decode cache
+    }
+
+    double best = 0;
+    for (int i = 0; i < repeats; i++) {
+        double start = now();
+        enum stop_reason reason = run_instructions(proc, count);
+        double elapsed = now() - start;
+        if (reason != STOP_BUDGET) {
+            return -1;
+        }
+
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best * 1e9 / count;
+}
+
+static int compare_results(const void *a, const void *b) {
+    double ns_a = ((const struct result*) a)->ns;
+    double ns_b = ((const struct result*) b)->ns;
+    return ns_a < ns_b ? 1 : (ns_a > ns_b ? -1 : 0);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    uint64_t count = 1000000;
+    int repeats = 5;
+    while ((opt = getopt(argc, argv, "jn:r:")) != -1) {
+        switch (opt) {
+            case 'j':
+                use_jit = 1;
+                break;
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-n instructions] "
+                        "[-r repeats]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (count == 0 || repeats < 1) {
+        fprintf(stderr, "Need at least one instruction and one repeat\n");
+        return 1;
+    }
+
+    struct m6502 proc;
+    init_proc(&proc);
+#ifdef ENABLE_JIT
+    if (use_jit && jit_enable(&proc) < 0) {
+        fprintf(stderr, "Unable to allocate JIT code buffer, interpreting\n");
+    }
+#else
+    if (use_jit) {
+        fprintf(stderr, "Built without the JIT, interpreting\n");
+    }
+#endif
+
+    struct result results[256];
+    int num_results = 0;
+    for (int opcode = 0; opcode < 256; opcode++) {
+        double ns = time_opcode(&proc, opcode, count, repeats);
+        if (ns >= 0) {
+            results[num_results].opcode = opcode;
+            results[num_results].ns = ns;
+            num_results++;
+        }
+    }
+
+    qsort(results, num_results, sizeof(struct result), compare_results);
+    double median = results[num_results / 2].ns;
+    printf("opcode  instruction       ns/inst  vs median\n");
+    for (int i = 0; i < num_results; i++) {
+        int opcode = results[i].opcode;
+        char text[32];
+        format_inst(text, sizeof(text), CODE_ADDR, opcode,
+            choose_operand(opcode, CODE_ADDR, 0));
+        printf("  %02x    %-16s %8.2f  %8.2fx\n", opcode, text,
+            results[i].ns, results[i].ns / median);
+    }
+
+    free_proc(&proc);
+    return 0;
+}
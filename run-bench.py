@@ -0,0 +1,178 @@
+#
+# Copyright 2024 Jeff Bush
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Runs the bench-*.asm workloads in the emulator several times each and
+# reports the speed as JSON, for example:
+#
+#   python3 run-bench.py -n 10 -o results.json bench-*.asm
+#
+# With -b, the mean speed of each workload is compared with an earlier
+# results file, and the script fails if any got slower by more than the
+# threshold.
+#
+
+import argparse
+import json
+import re
+import statistics
+import subprocess
+import sys
+
+STATS_PATTERN = re.compile(
+    r'(\d+) instructions, (\d+) cycles in ([0-9.]+) s')
+
+
+def assemble(filename):
+    try:
+        subprocess.run(f'dasm {filename} -f3 -obench.bin',
+                       shell=True, check=True, timeout=10,
+                       stdout=subprocess.PIPE)
+    except subprocess.CalledProcessError as err:
+        print('assemble error ' + str(err.stdout, 'UTF-8'))
+        raise
+
+
+def check_output(filename, output):
+    check_prefix = '; CHECK:'
+    search_offset = 0
+    with open(filename) as f:
+        for line in f:
+            check_offs = line.find(check_prefix)
+            if check_offs != -1:
+                check_pattern = line[check_offs + len(check_prefix) + 1:].strip()
+                got = output.find(check_pattern, search_offset)
+                if got == -1:
+                    raise Exception(filename + ': could not find check pattern '
+                                    + check_pattern + ' all output\n' + output)
+
+                search_offset = got + len(check_pattern)
+
+
+# Returns (instructions, cycles, seconds) for one run. The time is measured
+# by the emulator around execution, so it doesn't include starting the
+# process or loading the image.
+def run_once(filename, emulator_args):
+    result = subprocess.run(['./emulator', '-s'] + emulator_args
+                            + ['bench.bin'], check=True, timeout=120,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    check_output(filename, str(result.stdout, encoding='ASCII'))
+    match = STATS_PATTERN.search(str(result.stderr, encoding='ASCII'))
+    if match is None:
+        raise Exception(filename + ': no statistics in emulator output')
+
+    return int(match.group(1)), int(match.group(2)), float(match.group(3))
+
+
+def summarize(values):
+    return {
+        'mean': statistics.mean(values),
+        'median': statistics.median(values),
+        'min': min(values),
+        'max': max(values),
+        'stdev': statistics.stdev(values) if len(values) > 1 else 0.0,
+        'variance': statistics.variance(values) if len(values) > 1 else 0.0
+    }
+
+
+def run_benchmark(filename, runs, emulator_args):
+    assemble(filename)
+    run_once(filename, emulator_args)   # Warm up caches
+    seconds = []
+    mips = []
+    for _ in range(runs):
+        instructions, cycles, elapsed = run_once(filename, emulator_args)
+        elapsed = max(elapsed, 0.001)   # Resolution of the emulator's timer
+        seconds.append(elapsed)
+        mips.append(instructions / elapsed / 1e6)
+
+    return {
+        'instructions': instructions,
+        'cycles': cycles,
+        'seconds': summarize(seconds),
+        'mips': summarize(mips)
+    }
+
+
+# Returns the names of workloads that are slower than in the baseline
+def compare(results, baseline, threshold):
+    regressions = []
+    for name, result in results['benchmarks'].items():
+        if name not in baseline['benchmarks']:
+            continue
+
+        old = baseline['benchmarks'][name]['mips']['mean']
+        new = result['mips']['mean']
+        change = (new - old) / old * 100
+        print(f'{name:20} {old:10.2f} -> {new:10.2f} MIPS ({change:+.1f}%)',
+              file=sys.stderr)
+        if change < -threshold:
+            regressions.append(name)
+
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-n', dest='runs', type=int, default=10,
+                        help='timed runs of each workload')
+    parser.add_argument('-i', dest='interpret', action='store_true',
+                        help='run the emulator without the JIT')
+    parser.add_argument('-o', dest='output', help='write results here')
+    parser.add_argument('-b', dest='baseline',
+                        help='results file to compare against')
+    parser.add_argument('-t', dest='threshold', type=float, default=5.0,
+                        help='allowed slowdown from the baseline, in percent')
+    parser.add_argument('files', nargs='+')
+    args = parser.parse_args()
+
+    emulator_args = ['-i'] if args.interpret else []
+    results = {
+        'runs': args.runs,
+        'emulator_args': emulator_args,
+        'benchmarks': {}
+    }
+
+    for filename in args.files:
+        name = filename.replace('.asm', '')
+        result = run_benchmark(filename, args.runs, emulator_args)
+        results['benchmarks'][name] = result
+        mips = result['mips']
+        print(f'{name:20} {mips["mean"]:10.2f} MIPS '
+              f'(stdev {mips["stdev"]:.2f}, '
+              f'{result["seconds"]["mean"]:.3f} s)', file=sys.stderr)
+
+    results['geomean_mips'] = statistics.geometric_mean(
+        [result['mips']['mean'] for result in results['benchmarks'].values()])
+
+    text = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+        regressions = compare(results, baseline, args.threshold)
+        if regressions:
+            print('Slower than baseline: ' + ', '.join(regressions),
+                  file=sys.stderr)
+            sys.exit(1)
+
+
+main()
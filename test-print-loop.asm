@@ -0,0 +1,50 @@
+;
+; Copyright 2024 Jeff Bush
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+;
+
+; Console output from a loop that runs often enough to be translated by
+; the JIT, with both absolute and indexed stores to the console port.
+
+CONSOLE_OUT = $fffa
+
+                    processor 6502
+
+                    seg code
+                    org $0000
+reset:              ldy #4
+line:               ldx #0
+digit:              lda digits,X
+                    sta CONSOLE_OUT
+                    stx save
+                    ldx #0
+                    lda #'.
+                    sta CONSOLE_OUT,X
+                    ldx save
+                    inx
+                    cpx #16
+                    bne digit
+                    lda #10
+                    sta CONSOLE_OUT
+                    dey
+                    bne line
+                    brk
+
+save:               dc.b 0
+digits:             dc "0123456789ABCDEF"
+
+; CHECK: 0.1.2.3.4.5.6.7.8.9.A.B.C.D.E.F.
+; CHECK: 0.1.2.3.4.5.6.7.8.9.A.B.C.D.E.F.
+; CHECK: 0.1.2.3.4.5.6.7.8.9.A.B.C.D.E.F.
+; CHECK: 0.1.2.3.4.5.6.7.8.9.A.B.C.D.E.F.
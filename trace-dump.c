@@ -0,0 +1,96 @@
+//
+// Copyright 2024 Jeff Bush
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+// Print a trace file written by start_trace (emulator -x), one line per
+// instruction, in the same form as the monitor's dis command, followed by
+// the registers after the instruction ran.
+//
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "6502-trace.h"
+#include "instructions.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("error opening trace");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("error opening trace");
+        return 1;
+    }
+
+    size_t size = st.st_size;
+    const struct trace_header *header = NULL;
+    if (size >= sizeof(struct trace_header)) {
+        header = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+    if (header == NULL || header == MAP_FAILED
+            || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+            || header->version != TRACE_VERSION
+            || header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    const struct trace_record *records
+        = (const struct trace_record *) (header + 1);
+    size_t num_records = (size - sizeof(struct trace_header))
+        / sizeof(struct trace_record);
+    for (size_t i = 0; i < num_records; i++) {
+        const struct trace_record *record = &records[i];
+        char line[128];
+        snprintf(line, sizeof(line), "%10zu %04x %02x", i, record->pc,
+            record->opcode);
+        for (int j = 1; j < INSTRUCTIONS[record->opcode].length; j++) {
+            snprintf(line + strlen(line), sizeof(line) - strlen(line),
+                " %02x", (record->operand >> (8 * (j - 1))) & 0xff);
+        }
+
+        while (strlen(line) < 30) {
+            strcat(line, " ");
+        }
+
+        strcat(line, " ");
+        format_inst(line + strlen(line), sizeof(line) - strlen(line),
+            record->pc, record->opcode, record->operand);
+        while (strlen(line) < 48) {
+            strcat(line, " ");
+        }
+
+        printf("%s A %02x X %02x Y %02x S %02x P %02x\n", line, record->a,
+            record->x, record->y, record->s, record->status);
+    }
+
+    return 0;
+}